@@ -0,0 +1,461 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements CPU placement for pipeline stages.  A
+ * placement is an ordered list of CPUs; stage i of a pipeline is
+ * pinned to entry i (wrapping around), so the order decides which
+ * stages end up close together:
+ *
+ *  compact - neighboring stages on neighboring CPUs: SMT siblings,
+ *            then cores sharing an L2, then an L3, then a NUMA node.
+ *            Data handed down the pipeline stays in a shared cache.
+ *  spread  - neighboring stages on different NUMA nodes (sockets),
+ *            then different cores, using SMT siblings last.
+ *  a list  - e.g., "0,2,4-7": stage i runs on the i-th CPU listed.
+ *
+ * Under compact and spread, each pipeline starts in the order where
+ * the last one left off (wrapping around), so that pipelines do not
+ * all pile onto the first few CPUs.
+ *
+ * The topology comes from /sys/devices/system/cpu, and only covers
+ * the CPUs the shell was allowed to run on when it was first read
+ * (e.g., under taskset or a cpuset), so stages stay there.  Memory is not
+ * bound explicitly: with the default first-touch policy, a pinned
+ * stage allocates from its own node anyway.
+ *
+ * So that placement can be tested on any machine, THSH_SYSFS_CPU names
+ * a directory to read the topology from instead, laid out like sysfs,
+ * and THSH_CPU_MASK a CPU list to use as the shell's mask (see
+ * tests/affinity.sh).
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+struct cpu_info {
+    int cpu;
+    int node;       // NUMA node
+    int package;    // Socket
+    int l3;         // Id of the shared L3 (or package, if unknown)
+    int l2;         // Id of the shared L2 (or core, if unknown)
+    int core;       // Physical core, unique within the package
+    int thread;     // Index among the core's SMT siblings
+    int core_rank;  // Index of the core within its node
+};
+
+// A placement; interned by its spec, and never freed
+struct placement {
+    char *spec;
+    int ncpus;
+    int *cpus;
+    bool rotate;  // Start each pipeline where the last one ended
+    int start;    // ...which is here
+    struct placement *next;
+};
+
+static struct cpu_info *topology;
+static int ncpus = -1;  // -1 until the topology has been read
+static const char *sysfs_cpu = SYSFS_CPU;
+
+static struct placement *placements;
+static struct placement *default_placement;
+
+/* Read a small sysfs file into buf.
+ *
+ * Returns the length read, or -errno on failure.
+ */
+static int read_sysfs(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0) {
+        return -errno;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -errno;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* Read an integer from a sysfs file, or return dflt if it is missing. */
+static int read_sysfs_int(const char *path, int dflt) {
+    char buf[32];
+    if (read_sysfs(path, buf, sizeof(buf)) <= 0 || !isdigit(buf[0])) {
+        return dflt;
+    }
+    return atoi(buf);
+}
+
+/* Parse a CPU list such as "0-3,8,10-11" into cpus (at most max
+ * entries), in the order given.
+ *
+ * Returns the number of CPUs, or -EINVAL if list is malformed.
+ */
+static int parse_cpu_list(const char *list, int *cpus, int max) {
+    int n = 0;
+    const char *p = list;
+
+    while (*p && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10), hi;
+
+        if (end == p || lo < 0) {
+            return -EINVAL;
+        }
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) {
+                return -EINVAL;
+            }
+        }
+        for (long c = lo; c <= hi; c++) {
+            if (n == max || c >= CPU_SETSIZE) {
+                return -EINVAL;
+            }
+            cpus[n++] = c;
+        }
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            return -EINVAL;
+        }
+    }
+    return n ? n : -EINVAL;
+}
+
+/* Find the id of the cache at the given level that cpu uses. */
+static int cache_id(int cpu, int level, int dflt) {
+    char path[128];
+
+    for (int i = 0;; i++) {
+        snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level",
+                 sysfs_cpu, cpu, i);
+        int lvl = read_sysfs_int(path, -1);
+        if (lvl < 0) {
+            return dflt;
+        }
+        if (lvl == level) {
+            snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/id",
+                     sysfs_cpu, cpu, i);
+            return read_sysfs_int(path, dflt);
+        }
+    }
+}
+
+/* Find the NUMA node of cpu, from its "nodeN" link in sysfs. */
+static int cpu_node(int cpu) {
+    char path[128];
+    struct dirent *de;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "%s/cpu%d", sysfs_cpu, cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "node", 4) == 0 && isdigit(de->d_name[4])) {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+static int by_location(const void *a, const void *b) {
+    const struct cpu_info *x = a, *y = b;
+    int keys[][2] = {{x->node, y->node}, {x->package, y->package},
+                     {x->l3, y->l3},     {x->l2, y->l2},
+                     {x->core, y->core}, {x->cpu, y->cpu}};
+
+    for (int i = 0; i < 6; i++) {
+        if (keys[i][0] != keys[i][1]) {
+            return keys[i][0] < keys[i][1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int by_spread(const void *a, const void *b) {
+    const struct cpu_info *x = a, *y = b;
+    int keys[][2] = {{x->thread, y->thread},
+                     {x->core_rank, y->core_rank},
+                     {x->node, y->node},
+                     {x->cpu, y->cpu}};
+
+    for (int i = 0; i < 4; i++) {
+        if (keys[i][0] != keys[i][1]) {
+            return keys[i][0] < keys[i][1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/* The CPUs the shell may run on: its affinity mask, or THSH_CPU_MASK.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int allowed_cpus(cpu_set_t *allowed) {
+    const char *list = getenv("THSH_CPU_MASK");
+    int *cpus, n;
+
+    if (list == NULL) {
+        return sched_getaffinity(0, sizeof(*allowed), allowed) < 0 ? -errno
+                                                                   : 0;
+    }
+    cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    if (cpus == NULL) {
+        return -ENOMEM;
+    }
+    n = parse_cpu_list(list, cpus, CPU_SETSIZE);
+    CPU_ZERO(allowed);
+    for (int i = 0; i < n; i++) {
+        CPU_SET(cpus[i], allowed);
+    }
+    free(cpus);
+    return n < 0 ? n : 0;
+}
+
+/* Read the topology of the online CPUs that the shell may run on
+ * from sysfs, once, leaving topology[] in compact order.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int load_topology(void) {
+    char buf[4096], path[128];
+    const char *root = getenv("THSH_SYSFS_CPU");
+    cpu_set_t allowed;
+    int *online;
+    int rv, n = 0;
+
+    if (ncpus >= 0) {
+        return 0;
+    }
+
+    if (root) {
+        sysfs_cpu = root;
+    }
+    snprintf(path, sizeof(path), "%s/online", sysfs_cpu);
+    rv = read_sysfs(path, buf, sizeof(buf));
+    if (rv < 0) {
+        return rv;
+    }
+    online = malloc(sizeof(int) * CPU_SETSIZE);
+    if (online == NULL) {
+        return -ENOMEM;
+    }
+    rv = parse_cpu_list(buf, online, CPU_SETSIZE);
+    if (rv < 0) {
+        free(online);
+        return rv;
+    }
+    // Leave out any the shell may not use (if it can tell)
+    if (allowed_cpus(&allowed) == 0) {
+        for (int i = 0; i < rv; i++) {
+            if (CPU_ISSET(online[i], &allowed)) {
+                online[n++] = online[i];
+            }
+        }
+        rv = n;
+    }
+    topology = calloc(rv ? rv : 1, sizeof(struct cpu_info));
+    if (topology == NULL) {
+        free(online);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < rv; i++) {
+        struct cpu_info *ci = &topology[i];
+
+        ci->cpu = online[i];
+        ci->node = cpu_node(ci->cpu);
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/physical_package_id",
+                 sysfs_cpu, ci->cpu);
+        ci->package = read_sysfs_int(path, 0);
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/core_id", sysfs_cpu,
+                 ci->cpu);
+        ci->core = read_sysfs_int(path, ci->cpu);
+        ci->l2 = cache_id(ci->cpu, 2, ci->core);
+        ci->l3 = cache_id(ci->cpu, 3, ci->package);
+    }
+    free(online);
+    ncpus = rv;
+
+    // Number SMT siblings and cores, walking in compact order
+    qsort(topology, ncpus, sizeof(struct cpu_info), by_location);
+    for (int i = 0; i < ncpus; i++) {
+        struct cpu_info *ci = &topology[i], *prev = i ? ci - 1 : NULL;
+
+        if (prev && prev->node == ci->node) {
+            bool same_core =
+                prev->package == ci->package && prev->core == ci->core;
+            ci->thread = same_core ? prev->thread + 1 : 0;
+            ci->core_rank = prev->core_rank + !same_core;
+        }
+    }
+
+    return 0;
+}
+
+/* Build the CPU order for a placement spec. */
+static int build_placement(const char *spec, struct placement *pl) {
+    int rv = load_topology();
+
+    if (strcmp(spec, "none") == 0) {
+        pl->ncpus = 0;
+        return 0;
+    }
+
+    pl->cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    if (pl->cpus == NULL) {
+        return -ENOMEM;
+    }
+
+    if (strcmp(spec, "compact") == 0 || strcmp(spec, "spread") == 0) {
+        if (rv < 0) {
+            return rv;
+        }
+        struct cpu_info *order = malloc(sizeof(struct cpu_info) * ncpus);
+        if (order == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(order, topology, sizeof(struct cpu_info) * ncpus);
+        if (spec[0] == 's') {
+            qsort(order, ncpus, sizeof(struct cpu_info), by_spread);
+        }
+        for (int i = 0; i < ncpus; i++) {
+            pl->cpus[i] = order[i].cpu;
+        }
+        pl->ncpus = ncpus;
+        pl->rotate = true;
+        free(order);
+        return 0;
+    }
+
+    bool known = rv == 0;
+    rv = parse_cpu_list(spec, pl->cpus, CPU_SETSIZE);
+    if (rv < 0) {
+        return rv;
+    }
+    pl->ncpus = rv;
+
+    // Every CPU listed must be online and allowed (if we know which are)
+    for (int i = 0; known && i < pl->ncpus; i++) {
+        int j;
+        for (j = 0; j < ncpus && topology[j].cpu != pl->cpus[i]; j++)
+            ;
+        if (j == ncpus) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* Look up the placement for spec: "compact", "spread", "none" or a CPU
+ * list.  Placements are built once per spec and kept for the life of
+ * the shell.
+ *
+ * Returns the placement, or NULL with errno set if spec is invalid.
+ */
+struct placement *find_placement(const char *spec) {
+    struct placement *pl;
+    int rv;
+
+    for (pl = placements; pl; pl = pl->next) {
+        if (strcmp(pl->spec, spec) == 0) {
+            return pl;
+        }
+    }
+
+    pl = calloc(1, sizeof(struct placement));
+    if (pl == NULL) {
+        return NULL;
+    }
+    rv = build_placement(spec, pl);
+    if (rv < 0 || (pl->spec = strdup(spec)) == NULL) {
+        free(pl->cpus);
+        free(pl);
+        errno = rv < 0 ? -rv : ENOMEM;
+        return NULL;
+    }
+    pl->next = placements;
+    placements = pl;
+    return pl;
+}
+
+/* Start a pipeline of nstages stages under placement pl (which may be
+ * NULL): under compact or spread, it takes the next nstages CPUs in
+ * order after the last pipeline's.
+ *
+ * Returns the stage number to pass placement_cpu() for its first
+ * stage.
+ */
+int placement_start(struct placement *pl, int nstages) {
+    int start;
+
+    if (pl == NULL || pl->ncpus == 0 || !pl->rotate) {
+        return 0;
+    }
+    start = pl->start;
+    pl->start = (start + nstages) % pl->ncpus;
+    return start;
+}
+
+/* The CPU that stage number stage of a pipeline should run on under
+ * placement pl (which may be NULL).
+ *
+ * Returns the CPU, or -1 if the stage should not be pinned.
+ */
+int placement_cpu(const struct placement *pl, int stage) {
+    if (pl == NULL || pl->ncpus == 0) {
+        return -1;
+    }
+    return pl->cpus[stage % pl->ncpus];
+}
+
+struct placement *get_default_placement(void) {
+    return default_placement;
+}
+
+void set_default_placement(struct placement *pl) {
+    default_placement = pl && pl->ncpus ? pl : NULL;
+}
+
+/* Print the CPU topology and the shell-wide placement to fd, and
+ * under compact or spread, where in it the next pipeline starts.
+ */
+void print_topology(int fd) {
+    if (load_topology() < 0) {
+        dprintf(fd, "affinity: CPU topology not available\n");
+    }
+    for (int i = 0; i < ncpus; i++) {
+        struct cpu_info *ci = &topology[i];
+        dprintf(fd, "cpu %3d: node %d package %d l3 %d l2 %d core %d\n",
+                ci->cpu, ci->node, ci->package, ci->l3, ci->l2, ci->core);
+    }
+
+    const struct placement *pl = default_placement;
+    dprintf(fd, "placement: %s", pl ? pl->spec : "none");
+    for (int i = 0; pl && i < pl->ncpus; i++) {
+        dprintf(fd, "%c%d", i ? ',' : ' ', pl->cpus[i]);
+    }
+    if (pl && pl->rotate && pl->ncpus) {
+        dprintf(fd, " (next from cpu %d)", pl->cpus[pl->start]);
+    }
+    dprintf(fd, "\n");
+}
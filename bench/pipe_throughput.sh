@@ -0,0 +1,54 @@
+#!/bin/bash
+# COMP 530: Tar Heel SHell
+#
+# Pipe throughput benchmark: pushes a few GiB of zeroes through
+# multi-stage pipelines run by thsh, once per pipe capacity, and
+# reports the rate for each.
+#
+# usage: bench/pipe_throughput.sh [GiB] [stages] [sizes...]
+#   GiB    - amount of data to push per run (default 4)
+#   stages - number of "cat" stages between source and sink (default 3)
+#   sizes  - pipe capacities to try, as accepted by the pipesz builtin
+#            (default: 0 64K 256K 1M, where 0 is the kernel default)
+#
+# Run from the top of the tree after "make".
+
+set -e
+
+THSH=${THSH:-./thsh}
+GIB=${1:-4}
+STAGES=${2:-3}
+shift 2 2>/dev/null || shift $#
+SIZES=${*:-0 64K 256K 1M}
+
+if [ ! -x "$THSH" ]; then
+    echo "$THSH not found; run make first" >&2
+    exit 1
+fi
+
+BYTES=$((GIB << 30))
+LINE="head -c $BYTES /dev/zero"
+for ((i = 0; i < STAGES; i++)); do
+    LINE="$LINE | cat"
+done
+LINE="$LINE | wc -c"
+
+printf "%-8s %6s %10s %10s\n" "pipesz" "stages" "seconds" "MiB/s"
+for size in $SIZES; do
+    if [ "$size" = 0 ]; then
+        cmd="$LINE"
+    else
+        cmd="pipesz $size $LINE"
+    fi
+
+    start=$(date +%s.%N)
+    out=$(printf '%s\n' "$cmd" | "$THSH" | grep -o "[0-9]*$" | tail -n 1)
+    end=$(date +%s.%N)
+
+    if [ "$out" != "$BYTES" ]; then
+        echo "pipesz $size: expected $BYTES bytes, got '$out'" >&2
+        exit 1
+    fi
+    awk -v s="$size" -v n="$STAGES" -v a="$start" -v b="$end" -v c="$BYTES" \
+        'BEGIN { t = b - a; printf "%-8s %6d %10.3f %10.1f\n", s, n, t, c / t / 1048576 }'
+done
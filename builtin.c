@@ -2,20 +2,40 @@
  *
  * This file implements a table of builtin commands.
  */
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "thsh.h"
 
+// A builtin with usable set only runs if usable(args) is true, so that
+// forms it does not handle are left to a program of the same name.
 struct builtin {
     const char *cmd;
     int (*func)(char *args[MAX_ARGS], int stdin, int stdout);
+    bool (*usable)(char *args[MAX_ARGS]);
 };
 
-static char old_path[MAX_INPUT];
-static char cur_path[MAX_INPUT];
-static char usr_path[MAX_INPUT];
+// A prefix builtin modifies how the rest of the line runs, e.g.,
+// "pipesz 1M cat big | wc".  func returns the number of words it
+// consumed (including its own name), 0 if no command follows it,
+// or -errno on bad usage.
+struct prefix {
+    const char *cmd;
+    int (*func)(char *args[MAX_ARGS], struct pipeline_opts *opts);
+};
+
+static char old_path[PATH_MAX];
+static char cur_path[PATH_MAX];
+static char usr_path[PATH_MAX];
+
+// The prompt for cur_path, only rebuilt when the directory changes
+static char prompt[PATH_MAX + 16];
+
+static void update_prompt(void) {
+    snprintf(prompt, sizeof(prompt), "thsh> %s$ ", cur_path);
+}
 
 /* Handle a cd command.  */
 int handle_cd(char *args[MAX_INPUT], int stdin, int stdout) {
@@ -24,41 +44,57 @@ int handle_cd(char *args[MAX_INPUT], int stdin, int stdout) {
         return 1;
     }
 
-    char target_path[MAX_INPUT];
+    // The argument is used as is, however long (chdir() checks it)
+    const char *target_path = args[1];
+    char prev_path[PATH_MAX];
     if (strcmp(args[1], "-") == 0) {
         if (strlen(old_path) == 0) {
             dprintf(2, "cd: OLDPWD not set\n");
-            return -errno;
+            return -EINVAL;
         }
-        strcpy(target_path, old_path);
-    } else {
-        strcpy(target_path, args[1]);
+        target_path = old_path;
     }
 
     // Save current path before changing
-    strcpy(old_path, cur_path);
+    if (cur_path[0] == '\0') {
+        deferred_phase(DEFER_CWD, init_cwd);
+    }
+    snprintf(prev_path, sizeof(prev_path), "%s", cur_path);
 
     if (chdir(target_path) != 0) {
-        dprintf(2, "-thsh: cd: %s: invalid option\n", target_path);
-        return -errno;
+        int rv = -errno;
+        dprintf(2, "-thsh: cd: %s: %s\n", target_path, strerror(-rv));
+        return rv;
     }
+    snprintf(old_path, sizeof(old_path), "%s", prev_path);
 
     if (getcwd(cur_path, sizeof(cur_path)) == 0) {
         return -errno;
     }
+    update_prompt();
 
     return 0;
 }
 
-/* Handle an exit command. */
+/* Handle an exit command: "exit [n]" ends the shell with status n (0
+ * by default).  In a copy of the shell running a substitution (see
+ * subst.c), only the copy ends, without the shell's atexit handlers.
+ */
 int handle_exit(char *args[MAX_ARGS], int stdin, int stdout) {
-    exit(0);
+    int code = args[1] ? atoi(args[1]) & 0xff : 0;
+
+    if (in_subshell()) {
+        fflush(NULL);
+        _exit(code);
+    }
+    exit(code);
     return 0;  // Does not actually return
 }
 
 int init_cwd() {
     if (getcwd(usr_path, sizeof(usr_path)) != NULL) {
-        strcpy(cur_path, usr_path);
+        snprintf(cur_path, sizeof(cur_path), "%s", usr_path);
+        update_prompt();
     } else {
         return 1;
     }
@@ -66,6 +102,17 @@ int init_cwd() {
     return 0;
 }
 
+/* The prompt, "thsh> " and the current directory, or NULL if the
+ * directory cannot be found.
+ */
+const char *get_prompt(void) {
+    // The shell does not look up its directory until it needs to
+    if (cur_path[0] == '\0' && deferred_phase(DEFER_CWD, init_cwd) != 0) {
+        return NULL;
+    }
+    return prompt;
+}
+
 int print_prompt(void) {
     int ret = 0;
     // Print the prompt
@@ -73,21 +120,590 @@ int print_prompt(void) {
     // print the whole prompt string (write number of
     // bytes/chars equal to the length of prompt)
     //
-    const char *prompt = "thsh> ";
+    const char *full_prompt = get_prompt();
 
     // Lab 2: Your code here
 
-    char full_prompt[256];
-    strcpy(full_prompt, prompt);
-    strcat(full_prompt, cur_path);
-    strcat(full_prompt, "$ ");
+    if (full_prompt == NULL) {
+        return -1;
+    }
 
     ret = write(1, full_prompt, strlen(full_prompt));
     return ret;
 }
 
-static struct builtin builtins[] = {
-    {"cd", handle_cd}, {"exit", handle_exit}, {NULL, NULL}};
+/* Parse a byte count such as "65536", "64K" or "1M".
+ *
+ * Returns 0 and sets *size on success, -EINVAL on a malformed count.
+ */
+static int parse_size(const char *str, long *size) {
+    char *end;
+    long val = strtol(str, &end, 10);
+    int shift = 0;
+
+    if (end == str || val < 0) {
+        return -EINVAL;
+    }
+    switch (*end) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            end++;
+            break;
+    }
+    // Checked before shifting, which could overflow
+    if (*end != '\0' || val > (INT_MAX >> shift)) {
+        return -EINVAL;
+    }
+    val <<= shift;
+
+    *size = val;
+    return 0;
+}
+
+/* Handle a pipesz command.
+ *
+ * "pipesz" prints the shell-wide pipe capacity, "pipesz <bytes>" sets it
+ * (0 restores the kernel default).  As a prefix, "pipesz <bytes> cmd | ..."
+ * only applies to that pipeline; see prefix_pipesz.
+ */
+int handle_pipesz(char *args[MAX_ARGS], int stdin, int stdout) {
+    long size;
+    int rv;
+
+    if (args[1] == NULL) {
+        rv = probe_pipe_size(get_pipe_size());
+        if (rv < 0) {
+            return rv;
+        }
+        dprintf(stdout, "pipesz: %s%d bytes\n",
+                get_pipe_size() ? "" : "default, ", rv);
+        return 0;
+    }
+
+    if (parse_size(args[1], &size)) {
+        dprintf(2, "pipesz: %s: invalid size\n", args[1]);
+        return -EINVAL;
+    }
+
+    rv = set_pipe_size(size);
+    if (rv < 0) {
+        dprintf(2, "pipesz: %s: %s\n", args[1], strerror(-rv));
+        return rv;
+    }
+    return 0;
+}
+
+/* Handle an affinity command.
+ *
+ * "affinity" prints the CPU topology and the shell-wide placement;
+ * "affinity compact|spread|none|<cpu list>" sets the placement for
+ * every later pipeline.  As a prefix, it only applies to that
+ * pipeline; see prefix_affinity.
+ */
+int handle_affinity(char *args[MAX_ARGS], int stdin, int stdout) {
+    struct placement *pl;
+
+    if (args[1] == NULL) {
+        print_topology(stdout);
+        return 0;
+    }
+
+    pl = find_placement(args[1]);
+    if (pl == NULL) {
+        dprintf(2, "affinity: %s: %s\n", args[1], strerror(errno));
+        return -errno;
+    }
+    set_default_placement(pl);
+    return 0;
+}
+
+static double seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double elapsed(const struct timespec *start,
+                      const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_usage_row(int fd, const char *label, double real,
+                            const struct rusage *ru, char *args[MAX_ARGS]) {
+    char cmd[40];
+    int len = 0;
+
+    cmd[0] = '\0';
+    for (int i = 0; args && args[i] && len < (int)sizeof(cmd); i++) {
+        len += snprintf(cmd + len, sizeof(cmd) - len, "%s%s", i ? " " : "",
+                        args[i]);
+    }
+
+    dprintf(fd, "%-6s %9.3f %9.3f %9.3f %10ld %7ld %7ld %8ld %6ld%s%s\n",
+            label, real, seconds(&ru->ru_utime), seconds(&ru->ru_stime),
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt,
+            ru->ru_majflt, len ? "  " : "", cmd);
+}
+
+/* Print what a pipeline run under the "time" prefix cost, one row per
+ * stage plus a total, to fd.
+ *
+ * real is from starting a stage to reaping it; user and sys are CPU
+ * seconds; maxrss is in KiB; vcsw and ivcsw are voluntary (blocked,
+ * e.g., on a pipe) and involuntary (preempted) context switches; minflt
+ * and majflt are page faults.  Builtin stages run on threads in the
+ * shell, so their maxrss is that of the shell itself.
+ */
+void print_time_report(int fd, char *commands[MAX_PIPELINE][MAX_ARGS],
+                       struct job_stats stats[], int nstages) {
+    struct rusage total;
+    struct timespec start, end;
+    char label[16];
+
+    if (nstages == 0) {
+        return;
+    }
+    memset(&total, 0, sizeof(total));
+    start = stats[0].start;
+    end = stats[0].end;
+
+    dprintf(fd, "%-6s %9s %9s %9s %10s %7s %7s %8s %6s  %s\n", "stage",
+            "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "minflt",
+            "majflt", "command");
+    for (int i = 0; i < nstages; i++) {
+        snprintf(label, sizeof(label), "%d", i);
+        print_usage_row(fd, label, elapsed(&stats[i].start, &stats[i].end),
+                        &stats[i].ru, commands[i]);
+
+        rusage_add(&total, &stats[i].ru);
+        if (elapsed(&stats[i].start, &start) > 0) {
+            start = stats[i].start;
+        }
+        if (elapsed(&end, &stats[i].end) > 0) {
+            end = stats[i].end;
+        }
+    }
+    print_usage_row(fd, "total", elapsed(&start, &end), &total, NULL);
+}
+
+/* Handle a time command.
+ *
+ * On its own, "time" prints the CPU time used so far by the shell and
+ * by the children it has reaped.  As a prefix, "time cmd | ...", it
+ * reports on that pipeline when it finishes; see prefix_time.
+ */
+int handle_time(char *args[MAX_ARGS], int stdin, int stdout) {
+    struct rusage self, kids;
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &kids);
+    dprintf(stdout, "shell:    user %.3fs sys %.3fs\n",
+            seconds(&self.ru_utime), seconds(&self.ru_stime));
+    dprintf(stdout, "children: user %.3fs sys %.3fs\n",
+            seconds(&kids.ru_utime), seconds(&kids.ru_stime));
+    return 0;
+}
+
+/* Handle a stats command.
+ *
+ * "stats" prints the shell's counters (see metrics.c); "stats -r"
+ * zeroes them.  "stats -o <file>" writes them to file once, or every
+ * secs seconds with "-i <secs>"; "stats -o off" stops that.
+ */
+int handle_stats(char *args[MAX_ARGS], int stdin, int stdout) {
+    const char *path = NULL;
+    double interval = 0;
+    int rv;
+
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            metrics_reset();
+        } else if (strcmp(args[i], "-o") == 0 && args[i + 1]) {
+            path = args[++i];
+        } else if (strcmp(args[i], "-i") == 0 && args[i + 1]) {
+            char *end;
+            interval = strtod(args[++i], &end);
+            if (*end != '\0' || interval <= 0) {
+                dprintf(2, "stats: %s: invalid interval\n", args[i]);
+                return -EINVAL;
+            }
+        } else {
+            dprintf(2, "usage: stats [-r] [-o file|off [-i secs]]\n");
+            return -EINVAL;
+        }
+    }
+
+    if (path && strcmp(path, "off") == 0) {
+        return set_metrics_dump(NULL, 0);
+    } else if (path && interval > 0) {
+        rv = set_metrics_dump(path, interval);
+    } else if (path) {
+        rv = write_metrics(path);
+    } else {
+        if (args[1] == NULL) {
+            print_metrics(stdout);
+        }
+        return 0;
+    }
+    if (rv < 0) {
+        dprintf(2, "stats: %s: %s\n", path, strerror(-rv));
+    }
+    return rv;
+}
+
+/* Handle an export command.
+ *
+ * "export name=value" sets name and exports it to every command the
+ * shell runs; "export name" exports it as it is.  On its own, "export"
+ * lists what is exported.
+ */
+int handle_export(char *args[MAX_ARGS], int stdin, int stdout) {
+    if (args[1] == NULL) {
+        print_exports(stdout);
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq ? eq - args[i] : strlen(args[i]);
+        int rv;
+
+        if (!valid_name(args[i], len)) {
+            dprintf(2, "export: %s: not a valid name\n", args[i]);
+            return -EINVAL;
+        }
+        if (eq) {
+            *eq = '\0';
+        }
+        rv = export_var(args[i], eq ? eq + 1 : NULL);
+        if (eq) {
+            *eq = '=';
+        }
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return 0;
+}
+
+/* Handle an unset command: "unset name ..." */
+int handle_unset(char *args[MAX_ARGS], int stdin, int stdout) {
+    for (int i = 1; args[i]; i++) {
+        unset_var(args[i]);
+    }
+    return 0;
+}
+
+/* Parse "[-k grace] secs" from args, into *secs and *grace (0 if no
+ * -k).
+ *
+ * Returns the number of words parsed, or -EINVAL if they are malformed.
+ */
+static int parse_timeout(char **args, double *secs, double *grace) {
+    char *end = NULL;
+    int n = 0;
+
+    *grace = 0;
+    if (args[0] && strcmp(args[0], "-k") == 0) {
+        *grace = args[1] ? strtod(args[1], &end) : 0;
+        if (end == NULL || *end != '\0' || *grace <= 0) {
+            return -EINVAL;
+        }
+        n = 2;
+        end = NULL;
+    }
+    *secs = args[n] ? strtod(args[n], &end) : 0;
+    if (end == NULL || *end != '\0' || *secs < 0) {
+        return -EINVAL;
+    }
+    return n + 1;
+}
+
+/* The timeout builtin only takes "[-k grace] secs" (or nothing); any
+ * other form, e.g. "timeout -s KILL 1 cmd", is coreutils' timeout.
+ */
+static bool timeout_usable(char *args[MAX_ARGS]) {
+    double secs, grace;
+    int n;
+
+    if (args[1] == NULL) {
+        return true;
+    }
+    n = parse_timeout(args + 1, &secs, &grace);
+    return n > 0 && args[n + 1] == NULL;
+}
+
+/* Handle a timeout command.
+ *
+ * "timeout" prints the shell-wide deadline for pipelines;
+ * "timeout [-k grace] secs" sets it (0 for none), and how long after
+ * SIGTERM a pipeline still running gets SIGKILL.  As a prefix,
+ * "timeout [-k grace] secs cmd | ...", it only applies to that
+ * pipeline; see prefix_timeout and watchdog.c.
+ */
+int handle_timeout(char *args[MAX_ARGS], int stdin, int stdout) {
+    double secs, grace;
+    int n;
+
+    if (args[1] == NULL) {
+        secs = get_default_timeout(&grace);
+        if (secs == 0) {
+            dprintf(stdout, "timeout: none\n");
+        } else {
+            dprintf(stdout, "timeout: %g seconds, then %g to SIGKILL\n",
+                    secs, grace);
+        }
+        return 0;
+    }
+    n = parse_timeout(args + 1, &secs, &grace);
+    if (n < 0 || args[n + 1] != NULL) {
+        dprintf(2, "usage: timeout [-k grace] secs [command ...]\n");
+        return -EINVAL;
+    }
+    if (grace == 0) {
+        get_default_timeout(&grace);
+    }
+    set_default_timeout(secs, grace);
+    return 0;
+}
+
+/* Handle a limit command.
+ *
+ * "limit" prints the shell-wide resource limits and priorities for
+ * pipelines; "limit [-t secs] [-v bytes] [-n files] [-u procs]
+ * [-N nice] [-I class]" adds to them, and "limit none" clears them.
+ * As a prefix, "limit ... cmd | ...", they only apply to that
+ * pipeline; see prefix_limit and limits.c.
+ */
+int handle_limit(char *args[MAX_ARGS], int stdin, int stdout) {
+    struct job_limits l = {0};
+    int n;
+
+    if (args[1] == NULL) {
+        print_limits(stdout);
+        return 0;
+    }
+    if (strcmp(args[1], "none") == 0 && args[2] == NULL) {
+        set_default_limits(NULL);
+        return 0;
+    }
+    n = parse_limits(args + 1, &l);
+    if (n < 0) {
+        return n;
+    }
+    if (n == 0 || args[n + 1] != NULL) {
+        dprintf(2, "usage: limit [-t secs] [-v bytes] [-n files] [-u procs] "
+                   "[-N nice] [-I class] | limit none\n");
+        return -EINVAL;
+    }
+    set_default_limits(&l);
+    return 0;
+}
+
+static struct builtin builtins[] = {{"cd", handle_cd},
+                                    {"exit", handle_exit},
+                                    {"pipesz", handle_pipesz},
+                                    {"affinity", handle_affinity},
+                                    {"time", handle_time},
+                                    {"stats", handle_stats},
+                                    {"export", handle_export},
+                                    {"unset", handle_unset},
+                                    {"timeout", handle_timeout,
+                                     timeout_usable},
+                                    {"limit", handle_limit},
+                                    {NULL, NULL, NULL}};
+
+/* "pipesz <bytes>" as a pipeline prefix. */
+static int prefix_pipesz(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    long size;
+    int rv;
+
+    if (args[1] == NULL || args[2] == NULL) {
+        return 0;  // Not a prefix; "pipesz [bytes]" on its own is a builtin
+    }
+    if (parse_size(args[1], &size) || size == 0) {
+        dprintf(2, "usage: pipesz <bytes> command ...\n");
+        return -EINVAL;
+    }
+    // Refused sizes are reported as "pipesz <bytes>" reports them
+    rv = probe_pipe_size(size);
+    if (rv < 0) {
+        dprintf(2, "pipesz: %s: %s\n", args[1], strerror(-rv));
+        return rv;
+    }
+    opts->pipe_size = size;
+    return 2;
+}
+
+/* "affinity <placement>" as a pipeline prefix. */
+static int prefix_affinity(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    if (args[1] == NULL || args[2] == NULL) {
+        return 0;  // Not a prefix; "affinity [placement]" is a builtin
+    }
+    opts->placement = find_placement(args[1]);
+    if (opts->placement == NULL) {
+        dprintf(2, "affinity: %s: %s\n", args[1], strerror(errno));
+        return -errno;
+    }
+    return 2;
+}
+
+/* "time" as a pipeline prefix. */
+static int prefix_time(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    if (args[1] == NULL) {
+        return 0;  // Not a prefix; "time" on its own is a builtin
+    }
+    opts->time = true;
+    return 1;
+}
+
+/* "profile [-i secs]" as a pipeline prefix: sample each stage while
+ * the pipeline runs and report where it spends its time (see
+ * profile.c), every secs seconds with -i, and at the end.
+ */
+static int prefix_profile(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    int n = 1;
+
+    if (args[1] && strcmp(args[1], "-i") == 0) {
+        char *end = NULL;
+        opts->profile_interval = args[2] ? strtod(args[2], &end) : 0;
+        if (end == NULL || *end != '\0' || opts->profile_interval <= 0) {
+            dprintf(2, "usage: profile [-i secs] command ...\n");
+            return -EINVAL;
+        }
+        n = 3;
+    }
+    if (args[n] == NULL) {
+        dprintf(2, "usage: profile [-i secs] command ...\n");
+        return -EINVAL;
+    }
+    opts->profile = true;
+    return n;
+}
+
+/* "cache [-f file] [-m file] [-e name] ..." as a pipeline prefix:
+ * replay the pipeline's output if it has run before with the same
+ * words, directory, file contents (-f) or mtimes (-m) and variables
+ * (-e); see cache.c.
+ */
+static int prefix_cache(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    int n = 1;
+
+    while (args[n] && args[n + 1] &&
+           (strcmp(args[n], "-f") == 0 || strcmp(args[n], "-m") == 0 ||
+            strcmp(args[n], "-e") == 0)) {
+        if (opts->cache_ndeps == MAX_ARGS / 2) {
+            return -E2BIG;
+        }
+        opts->cache_deps[opts->cache_ndeps].kind = args[n][1];
+        opts->cache_deps[opts->cache_ndeps++].name = args[n + 1];
+        n += 2;
+    }
+    if (args[n] == NULL || args[n][0] == '-') {
+        dprintf(2, "usage: cache [-f file] [-m file] [-e name] ... "
+                   "command ...\n");
+        return -EINVAL;
+    }
+    opts->cache = true;
+    return n;
+}
+
+/* "timeout [-k grace] secs" as a pipeline prefix.  Any other form,
+ * and "timeout 0 cmd" (no deadline), is left to coreutils' timeout
+ * (see timeout_usable).
+ */
+static int prefix_timeout(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    int n = parse_timeout(args + 1, &opts->timeout, &opts->timeout_grace);
+
+    if (args[1] == NULL || n < 0 || args[n + 1] == NULL ||
+        opts->timeout == 0) {
+        opts->timeout = opts->timeout_grace = 0;
+        return 0;  // Not a prefix; "timeout [secs]" is a builtin
+    }
+    return n + 1;
+}
+
+/* "limit [-t secs] ..." as a pipeline prefix. */
+static int prefix_limit(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    int n = parse_limits(args + 1, &opts->limits);
+
+    if (n < 0) {
+        return n;
+    }
+    if (n == 0 || args[n + 1] == NULL) {
+        memset(&opts->limits, 0, sizeof(opts->limits));
+        return 0;  // Not a prefix; "limit [...]" is a builtin
+    }
+    return n + 1;
+}
+
+static struct prefix prefixes[] = {{"pipesz", prefix_pipesz},
+                                   {"affinity", prefix_affinity},
+                                   {"time", prefix_time},
+                                   {"profile", prefix_profile},
+                                   {"cache", prefix_cache},
+                                   {"timeout", prefix_timeout},
+                                   {"limit", prefix_limit},
+                                   {NULL, NULL}};
+
+/* The name of builtin (or prefix) i, for completion, or NULL if there
+ * are not that many.
+ */
+const char *builtin_name(int i) {
+    int nbuiltins = sizeof(builtins) / sizeof(builtins[0]) - 1;
+
+    if (i < nbuiltins) {
+        return builtins[i].cmd;
+    }
+    return prefixes[i - nbuiltins].cmd;
+}
+
+/* This function strips prefix builtins (e.g., "pipesz 1M") from the
+ * front of args, shifting the remaining words down, and records their
+ * settings in *opts.  Prefixes may be stacked.
+ *
+ * A prefix with no command after it is left in place (its func returns
+ * 0), so that handle_builtin() can run it as an ordinary builtin; e.g.,
+ * "pipesz 1M" on its own sets the shell-wide default.
+ *
+ * Returns the number of words removed, or -errno on bad usage.
+ */
+int handle_prefix(char *args[MAX_ARGS], struct pipeline_opts *opts) {
+    int total = 0;
+
+    while (args[0] != NULL) {
+        int i, n = 0;
+
+        for (i = 0; prefixes[i].cmd != NULL; i++) {
+            if (strcmp(args[0], prefixes[i].cmd) == 0) {
+                n = prefixes[i].func(args, opts);
+                break;
+            }
+        }
+        if (n <= 0) {
+            return n < 0 ? n : total;
+        }
+
+        for (i = 0; i + n < MAX_ARGS; i++) {
+            args[i] = args[i + n];
+        }
+        for (; i < MAX_ARGS; i++) {
+            args[i] = NULL;
+        }
+        total += n;
+    }
+
+    return total;
+}
 
 /* This function checks if the command (args[0]) is a built-in.
  * If so, call the appropriate handler, and return 1.
@@ -112,7 +728,12 @@ int handle_builtin(char *args[MAX_ARGS], int stdin, int stdout, int *retval) {
     // (void) builtins;
     for (int i = 0; builtins[i].cmd != NULL; i++) {
         if (strcmp(args[0], builtins[i].cmd) == 0) {
+            if (builtins[i].usable && !builtins[i].usable(args)) {
+                return 0;  // Run the program instead
+            }
+            trace_event(TRACE_BUILTIN, 'B', args[0], 0, 0);
             *retval = builtins[i].func(args, stdin, stdout);
+            trace_event(TRACE_BUILTIN, 'E', args[0], *retval, 0);
             return 1;
         }
     }
@@ -0,0 +1,391 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the "cache" prefix, which memoizes a pipeline
+ * of deterministic commands (code generators, listing tools, ...):
+ *
+ *   cache [-f file] [-m file] [-e name] ... command ...
+ *
+ * The pipeline's key is made of the words of every stage, the current
+ * directory, the value of each variable named with -e, and each input
+ * file: its contents with -f, or just its size and mtime with -m.  If
+ * a pipeline with the same key has run before, its stdout and exit
+ * status are replayed from the store and nothing is run; otherwise it
+ * runs as usual, with its stdout captured on the way out (see
+ * subst.c), and the result is stored.  Only pipelines that exited
+ * (rather than being killed) are stored; stderr is never cached.
+ *
+ * The store is a directory, $THSH_CACHE or else ~/.cache/thsh, of
+ * files named for the hash of their key.  Each holds:
+ *
+ *   "THSHCAC1", status (4 bytes), key length (4), output length (8),
+ *   the key, then the output
+ *
+ * The whole key is kept so that a hash collision is a miss, not a
+ * wrong answer.  Entries are written to a temporary file and renamed
+ * into place, so concurrent shells never see half of one.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+#define CACHE_MAGIC "THSHCAC1"
+
+struct cache_header {
+    char magic[8];
+    uint32_t status;
+    uint32_t key_len;
+    uint64_t out_len;
+};
+
+// A key being built up
+struct key {
+    char *buf;
+    size_t len, cap;
+};
+
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;  // FNV-1a
+    }
+    return h;
+}
+
+/* Append len bytes of data, and a NUL, to the key.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+static int key_add(struct key *k, const char *data, size_t len) {
+    if (k->len + len + 1 > k->cap) {
+        size_t cap = k->cap ? k->cap : 256;
+        while (cap < k->len + len + 1) {
+            cap *= 2;
+        }
+        char *grown = realloc(k->buf, cap);
+        if (grown == NULL) {
+            return -ENOMEM;
+        }
+        k->buf = grown;
+        k->cap = cap;
+    }
+    memcpy(k->buf + k->len, data, len);
+    k->buf[k->len + len] = '\0';
+    k->len += len + 1;
+    return 0;
+}
+
+static int key_printf(struct key *k, const char *fmt, ...) {
+    char buf[PATH_MAX + 64];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(buf)) {
+        return -E2BIG;
+    }
+    return key_add(k, buf, n);
+}
+
+/* Add one input file to the key: a hash of its contents (kind 'f') or
+ * its size and mtime ('m').  A missing file is part of the key too.
+ *
+ * Returns 0 on success, -errno if it could not be read.
+ */
+static int key_file(struct key *k, char kind, const char *path) {
+    struct stat st;
+    uint64_t h = 14695981039346656037ull;
+    int fd, rv = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        rv = -errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (rv == -ENOENT) {
+            return key_printf(k, "%c %s missing", kind, path);
+        }
+        return rv;
+    }
+
+    if (kind == 'm') {
+        rv = key_printf(k, "m %s %lld %ld.%09ld", path, (long long)st.st_size,
+                        (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+        close(fd);
+        return rv;
+    }
+
+    char buf[64 << 10];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno != EINTR) {
+            rv = -errno;
+            break;
+        }
+        h = n > 0 ? hash_bytes(h, buf, n) : h;
+    }
+    close(fd);
+    if (rv < 0) {
+        return rv;
+    }
+    return key_printf(k, "f %s %016llx", path, (unsigned long long)h);
+}
+
+/* Build the key for running commands with opts. */
+static int make_key(char *commands[MAX_PIPELINE][MAX_ARGS],
+                    struct pipeline_opts *opts, struct key *k) {
+    char cwd[PATH_MAX];
+    int rv = 0;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -errno;
+    }
+    rv = key_printf(k, "cwd %s", cwd);
+    for (int i = 0; rv == 0 && commands[i][0]; i++) {
+        rv = key_add(k, "|", 1);
+        for (int j = 0; rv == 0 && commands[i][j]; j++) {
+            rv = key_add(k, commands[i][j], strlen(commands[i][j]));
+        }
+    }
+    for (int i = 0; rv == 0 && i < opts->cache_ndeps; i++) {
+        const struct cache_dep *d = &opts->cache_deps[i];
+        if (d->kind == 'e') {
+            const char *value = get_var(d->name);
+            rv = key_printf(k, "e %s%s%s", d->name, value ? "=" : "",
+                            value ? value : "");
+        } else {
+            rv = key_file(k, d->kind, d->name);
+        }
+    }
+    return rv;
+}
+
+/* Find the shell's cache directory, $THSH_CACHE or else ~/.cache/thsh,
+ * creating it if need be.  Other persistent caches (see pathdb.c) live
+ * there too.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int cache_dir(char dir[PATH_MAX]) {
+    const char *env = get_var("THSH_CACHE");
+
+    if (env && *env) {
+        if (snprintf(dir, PATH_MAX, "%s", env) >= PATH_MAX) {
+            return -ENAMETOOLONG;
+        }
+    } else {
+        const char *home = get_var("HOME");
+        if (home == NULL) {
+            return -ENOENT;
+        }
+        if (snprintf(dir, PATH_MAX, "%s/.cache/thsh", home) >= PATH_MAX) {
+            return -ENAMETOOLONG;
+        }
+        snprintf(dir, PATH_MAX, "%s/.cache", home);
+        mkdir(dir, 0755);
+        strcat(dir, "/thsh");
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+/* Find the path in the store of the entry for key.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int entry_path(const struct key *k, char path[PATH_MAX]) {
+    char dir[PATH_MAX];
+    uint64_t h = hash_bytes(14695981039346656037ull, k->buf, k->len);
+    int rv = cache_dir(dir);
+
+    if (rv < 0) {
+        return rv;
+    }
+    if (snprintf(path, PATH_MAX, "%s/%016llx", dir, (unsigned long long)h) >=
+        PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+/* Write len bytes at offset in fd to stdout.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int replay_output(int fd, off_t offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;  // stdout does not take sendfile(); copy it ourselves
+        }
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        len -= n;
+    }
+    while (len > 0) {
+        char buf[64 << 10];
+        ssize_t n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf),
+                          offset);
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(STDOUT_FILENO, buf + off, n - off);
+            if (w < 0 && errno != EINTR) {
+                return -errno;
+            }
+            off += w > 0 ? w : 0;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Look up key in the store, and replay it if it is there.
+ *
+ * Returns 1 with the stored wait status in *status on a hit, 0 on a
+ * miss, or -errno if the entry could not be replayed.
+ */
+static int lookup(const char *path, const struct key *k, int *status) {
+    struct cache_header h;
+    char *stored = NULL;
+    int fd, rv = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.key_len != k->len) {
+        goto out;
+    }
+    stored = malloc(k->len);
+    if (stored == NULL ||
+        pread(fd, stored, k->len, sizeof(h)) != (ssize_t)k->len ||
+        memcmp(stored, k->buf, k->len) != 0) {
+        goto out;  // A different key with the same hash
+    }
+
+    fflush(stdout);
+    rv = replay_output(fd, sizeof(h) + k->len, h.out_len);
+    if (rv == 0) {
+        *status = h.status;
+        rv = 1;
+    }
+out:
+    free(stored);
+    close(fd);
+    return rv;
+}
+
+/* Store what the pipeline with key printed, and its status.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int store(const char *path, const struct key *k, int status,
+                 const char *out, size_t out_len) {
+    struct cache_header h = {.status = status,
+                             .key_len = k->len,
+                             .out_len = out_len};
+    struct iovec iov[3] = {{&h, sizeof(h)},
+                           {k->buf, k->len},
+                           {(char *)out, out_len}};
+    size_t total = sizeof(h) + k->len + out_len;
+    char tmp[PATH_MAX];
+    int fd, rv = 0;
+
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid()) >=
+        (int)sizeof(tmp)) {
+        return -ENAMETOOLONG;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (writev(fd, iov, 3) != (ssize_t)total) {
+        rv = errno ? -errno : -EIO;
+    }
+    if (close(fd) < 0 && rv == 0) {
+        rv = -errno;
+    }
+    if (rv == 0 && rename(tmp, path) < 0) {
+        rv = -errno;
+    }
+    if (rv < 0) {
+        unlink(tmp);
+    }
+    return rv;
+}
+
+/* Run commands with opts through run (see run_pipeline() in thsh.c),
+ * unless the same pipeline has run before with the same inputs, in
+ * which case replay what it printed instead.
+ *
+ * Returns what run would: a wait status, or -errno.
+ */
+int run_cached(char *commands[MAX_PIPELINE][MAX_ARGS],
+               struct pipeline_opts *opts,
+               int (*run)(char *commands[MAX_PIPELINE][MAX_ARGS],
+                          struct pipeline_opts *opts)) {
+    struct key k = {0};
+    struct capture *c;
+    char path[PATH_MAX], *out;
+    size_t out_len;
+    int rv, status = 0;
+
+    rv = make_key(commands, opts, &k);
+    if (rv == 0) {
+        rv = entry_path(&k, path);
+    }
+    if (rv < 0) {
+        dprintf(2, "cache: %s; running uncached\n", strerror(-rv));
+        free(k.buf);
+        return run(commands, opts);
+    }
+
+    rv = lookup(path, &k, &status);
+    if (rv != 0) {
+        metric_add(METRIC_CACHE_HITS, 1);
+        free(k.buf);
+        return rv < 0 ? rv : status;
+    }
+    metric_add(METRIC_CACHE_MISSES, 1);
+
+    // Shown as it arrives, and kept to be stored at the end
+    if (capture_begin(&c, true) < 0) {
+        free(k.buf);
+        return run(commands, opts);
+    }
+    status = run(commands, opts);
+    rv = capture_end(c, &out, &out_len);
+    if (rv == 0) {
+        if (status >= 0 && WIFEXITED(status)) {
+            store(path, &k, status, out, out_len);
+        }
+        free(out);
+    }
+    free(k.buf);
+    return status;
+}
@@ -0,0 +1,659 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements tab completion for the line editor (see
+ * edit.c): of command names in the first word of a pipeline, and of
+ * file names everywhere else.
+ *
+ * Command names are every executable in the path table's directories,
+ * plus the shell's builtins, kept in a compressed trie: a chain of
+ * nodes with one child each is merged into one node, so a lookup
+ * visits one node per branching point rather than one per byte, and
+ * the node where a prefix ends gives the longest common completion
+ * directly.  Each node counts the names below it, so completing never
+ * walks the tree unless the candidates are to be listed.  Labels point
+ * into names copied into an arena, and splitting a node just splits
+ * its label, so a trie of tens of thousands of names is a few large
+ * allocations.
+ *
+ * The trie is built by a background thread, started after the first
+ * prompt, so startup does not pay for reading PATH.  It inserts one
+ * directory at a time under a lock, so completion works (from what has
+ * been read so far) while it runs.  Setting PATH makes it stale; it is
+ * rebuilt from scratch at the next prompt.
+ *
+ * File names come from directory listings, read once and kept sorted,
+ * so the candidates for a prefix are found by binary search.  A
+ * listing is reused until its directory's mtime changes, which costs
+ * one stat() per completion instead of a readdir() of the directory.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Size of each block the trie's nodes and names are carved from
+#define ARENA_CHUNK (64 << 10)
+
+// Directory listings kept for file name completion
+#define LISTING_CACHE_SIZE 8
+
+// At most this many candidates are listed
+#define LIST_MAX 256
+
+struct tnode {
+    const char *label;  // Not NUL-terminated; points into the arena
+    size_t len;
+    size_t count;  // Names ending at or below this node
+    bool word;     // A name ends here
+    struct tnode *child;    // Children, sorted by their first byte
+    struct tnode *sibling;
+};
+
+struct chunk {
+    struct chunk *next;
+    size_t used;
+    char data[];
+};
+
+struct trie {
+    struct tnode root;
+    struct chunk *chunks;
+};
+
+// The command names, and the lock the builder inserts under
+static struct trie *commands;
+static pthread_mutex_t commands_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bumped when PATH is set; the builder stops if it changes under it
+static _Atomic unsigned path_generation = 1;
+static unsigned built_generation;  // Shell thread only
+static pthread_t builder;
+static bool builder_started;
+static _Atomic bool builder_done;
+
+struct listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char **names;  // Sorted; a directory's name ends in '/'
+    int n;
+    unsigned long used;  // When it was last used, to evict the oldest
+};
+
+static struct listing listings[LISTING_CACHE_SIZE];
+static unsigned long listing_clock;
+
+/* Allocate size bytes from the trie's arena.  Returns NULL if out of
+ * memory.
+ */
+static void *arena_alloc(struct trie *t, size_t size) {
+    struct chunk *c = t->chunks;
+
+    size = (size + 7) & ~(size_t)7;
+    if (c == NULL || ARENA_CHUNK - c->used < size) {
+        size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        c = malloc(sizeof(struct chunk) + cap);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->next = t->chunks;
+        c->used = 0;
+        t->chunks = c;
+    }
+    c->used += size;
+    return c->data + c->used - size;
+}
+
+static struct trie *trie_create(void) {
+    return calloc(1, sizeof(struct trie));
+}
+
+static void trie_free(struct trie *t) {
+    while (t && t->chunks) {
+        struct chunk *c = t->chunks;
+        t->chunks = c->next;
+        free(c);
+    }
+    free(t);
+}
+
+/* Add name to the trie, if it is not there already.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+static int trie_insert(struct trie *t, const char *name) {
+    struct tnode *path[NAME_MAX + 2];  // Each node takes a byte or more
+    struct tnode *n = &t->root;
+    int depth = 0;
+
+    if (strlen(name) > NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+
+    for (;;) {
+        struct tnode **link = &n->child, *c;
+        size_t i = 1;
+
+        path[depth++] = n;
+        if (*name == '\0') {
+            if (n->word) {
+                return 0;
+            }
+            n->word = true;
+            break;
+        }
+        while (*link &&
+               (unsigned char)(*link)->label[0] < (unsigned char)*name) {
+            link = &(*link)->sibling;
+        }
+        c = *link;
+
+        // Nothing starts this way yet: the rest of the name is a leaf
+        if (c == NULL || c->label[0] != *name) {
+            size_t len = strlen(name);
+            struct tnode *leaf = arena_alloc(t, sizeof(struct tnode));
+            char *label = arena_alloc(t, len);
+            if (leaf == NULL || label == NULL) {
+                return -ENOMEM;
+            }
+            memcpy(label, name, len);
+            *leaf = (struct tnode){.label = label, .len = len, .count = 1,
+                                   .word = true, .sibling = c};
+            *link = leaf;
+            break;
+        }
+
+        // Split c where the name leaves its label
+        while (i < c->len && name[i] == c->label[i]) {
+            i++;
+        }
+        if (i < c->len) {
+            struct tnode *mid = arena_alloc(t, sizeof(struct tnode));
+            if (mid == NULL) {
+                return -ENOMEM;
+            }
+            *mid = (struct tnode){.label = c->label, .len = i,
+                                  .count = c->count, .child = c,
+                                  .sibling = c->sibling};
+            c->label += i;
+            c->len -= i;
+            c->sibling = NULL;
+            *link = mid;
+            c = mid;
+        }
+        n = c;
+        name += i;
+    }
+
+    // One more name below every node on the way down
+    for (int i = 0; i < depth; i++) {
+        path[i]->count++;
+    }
+    return 0;
+}
+
+/* Find the node below which every name starting with prefix lies.
+ * *rest is set to the part of its label past the prefix, and *rest_len
+ * to its length.
+ *
+ * Returns the node, or NULL if no name starts with prefix.
+ */
+static struct tnode *trie_find(struct trie *t, const char *prefix, size_t len,
+                               const char **rest, size_t *rest_len) {
+    struct tnode *n = &t->root;
+
+    *rest = "";
+    *rest_len = 0;
+    while (len > 0) {
+        struct tnode *c = n->child;
+        size_t i = 0;
+
+        while (c && c->label[0] != *prefix) {
+            c = c->sibling;
+        }
+        if (c == NULL) {
+            return NULL;
+        }
+        while (i < c->len && i < len && prefix[i] == c->label[i]) {
+            i++;
+        }
+        if (i < c->len && i < len) {
+            return NULL;
+        }
+        if (i == len) {
+            *rest = c->label + i;
+            *rest_len = c->len - i;
+            return c;
+        }
+        n = c;
+        prefix += i;
+        len -= i;
+    }
+    return n;
+}
+
+/* Write the names below n, each after name (len bytes), to fd, at most
+ * *left of them.
+ */
+static void trie_list(int fd, struct tnode *n, char name[PATH_MAX],
+                      size_t len, int *left) {
+    if (len + n->len >= PATH_MAX) {
+        return;
+    }
+    memcpy(name + len, n->label, n->len);
+    len += n->len;
+    if (n->word && *left > 0) {
+        dprintf(fd, "%.*s\n", (int)len, name);
+        --*left;
+    }
+    for (struct tnode *c = n->child; c && *left > 0; c = c->sibling) {
+        trie_list(fd, c, name, len, left);
+    }
+}
+
+/* Add every executable in dir to t (under commands_lock), unless PATH
+ * changes first.
+ */
+static void add_directory(struct trie *t, const char *dir,
+                          unsigned generation) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+
+    if (d == NULL) {
+        return;
+    }
+    while ((e = readdir(d)) != NULL &&
+           atomic_load(&path_generation) == generation) {
+        struct stat st;
+
+        if (e->d_name[0] == '.' || e->d_type == DT_DIR ||
+            faccessat(dirfd(d), e->d_name, X_OK, AT_EACCESS) < 0) {
+            continue;
+        }
+        // Only a link (or an unknown type) might name a directory
+        if (e->d_type != DT_REG &&
+            (fstatat(dirfd(d), e->d_name, &st, 0) < 0 ||
+             !S_ISREG(st.st_mode))) {
+            continue;
+        }
+        pthread_mutex_lock(&commands_lock);
+        int rv = trie_insert(t, e->d_name);
+        pthread_mutex_unlock(&commands_lock);
+        if (rv < 0) {
+            break;
+        }
+    }
+    closedir(d);
+}
+
+struct build_args {
+    struct trie *trie;
+    char **dirs;  // A copy of the path table, NULL-terminated
+    unsigned generation;
+};
+
+static void *build_commands(void *arg) {
+    struct build_args *b = arg;
+
+    for (int i = 0; b->dirs[i]; i++) {
+        add_directory(b->trie, b->dirs[i], b->generation);
+        free(b->dirs[i]);
+    }
+    free(b->dirs);
+    free(b);
+    atomic_store(&builder_done, true);
+    return NULL;
+}
+
+/* Forget the command names, which were read from the old PATH.  Called
+ * whenever PATH is set.
+ */
+void complete_path_changed(void) {
+    atomic_fetch_add(&path_generation, 1);
+}
+
+/* Start (re)building the command names in the background, if PATH has
+ * changed since they were last built.  Called at each prompt.
+ */
+void complete_start(void) {
+    unsigned generation = atomic_load(&path_generation);
+    struct build_args *b;
+    struct trie *t;
+    char **table;
+    sigset_t all, old;
+    int n = 0, rv;
+
+    if (generation == built_generation) {
+        return;
+    }
+    if (builder_started) {
+        // Still running (and stopping soon, if PATH changed under it)
+        if (!atomic_load(&builder_done)) {
+            return;
+        }
+        pthread_join(builder, NULL);
+        builder_started = false;
+    }
+
+    table = get_path_table();
+    while (table && table[n]) {
+        n++;
+    }
+    t = trie_create();
+    b = malloc(sizeof(struct build_args));
+    if (b) {
+        b->dirs = calloc(n + 1, sizeof(char *));
+    }
+    if (t == NULL || b == NULL || b->dirs == NULL) {
+        goto fail;
+    }
+    for (int i = 0; i < n; i++) {
+        b->dirs[i] = strdup(table[i]);
+        if (b->dirs[i] == NULL) {
+            goto fail;
+        }
+    }
+    b->trie = t;
+    b->generation = generation;
+
+    // Builtins are few, and there from the start
+    for (int i = 0; builtin_name(i); i++) {
+        trie_insert(t, builtin_name(i));
+    }
+    for (int i = 0; stage_builtin_name(i); i++) {
+        trie_insert(t, stage_builtin_name(i));
+    }
+
+    pthread_mutex_lock(&commands_lock);
+    trie_free(commands);
+    commands = t;
+    pthread_mutex_unlock(&commands_lock);
+
+    // Leave signals to the shell's own thread
+    atomic_store(&builder_done, false);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rv = pthread_create(&builder, NULL, build_commands, b);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rv == 0) {
+        builder_started = true;
+    } else {
+        build_commands(b);  // Not in the background, then
+    }
+    built_generation = generation;
+    return;
+
+fail:
+    for (int i = 0; b && b->dirs && i < n; i++) {
+        free(b->dirs[i]);
+    }
+    if (b) {
+        free(b->dirs);
+    }
+    free(b);
+    trie_free(t);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void free_listing(struct listing *l) {
+    for (int i = 0; i < l->n; i++) {
+        free(l->names[i]);
+    }
+    free(l->names);
+    l->names = NULL;
+    l->n = 0;
+}
+
+/* Read the names in dir into l, sorted, with a '/' after each
+ * directory.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int read_listing(const char *dir, struct listing *l) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    int cap = 0;
+
+    if (d == NULL) {
+        return -errno;
+    }
+    while ((e = readdir(d)) != NULL) {
+        struct stat st;
+        bool is_dir = e->d_type == DT_DIR;
+        size_t len = strlen(e->d_name);
+
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        if ((e->d_type == DT_LNK || e->d_type == DT_UNKNOWN) &&
+            fstatat(dirfd(d), e->d_name, &st, 0) == 0) {
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (l->n == cap) {
+            char **names = realloc(l->names, (cap ? cap * 2 : 64) *
+                                                 sizeof(char *));
+            if (names == NULL) {
+                break;
+            }
+            l->names = names;
+            cap = cap ? cap * 2 : 64;
+        }
+        l->names[l->n] = malloc(len + 2);
+        if (l->names[l->n] == NULL) {
+            break;
+        }
+        memcpy(l->names[l->n], e->d_name, len);
+        strcpy(l->names[l->n] + len, is_dir ? "/" : "");
+        l->n++;
+    }
+    closedir(d);
+    if (e != NULL) {
+        free_listing(l);
+        return -ENOMEM;
+    }
+    qsort(l->names, l->n, sizeof(char *), compare_names);
+    return 0;
+}
+
+/* Find the listing of dir, reading it if it is not cached or has
+ * changed since.
+ *
+ * Returns it, or NULL if dir cannot be read.
+ */
+static struct listing *find_listing(const char *dir) {
+    struct listing *l = &listings[0];
+    struct stat st;
+
+    if (stat(dir, &st) < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+        struct listing *c = &listings[i];
+        if (c->names && c->dev == st.st_dev && c->ino == st.st_ino) {
+            l = c;
+            break;
+        }
+        if (c->used < l->used) {
+            l = c;  // The oldest, if it is not here
+        }
+    }
+    l->used = ++listing_clock;
+    if (l->names && l->dev == st.st_dev && l->ino == st.st_ino &&
+        l->mtime.tv_sec == st.st_mtim.tv_sec &&
+        l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return l;
+    }
+
+    free_listing(l);
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    if (read_listing(dir, l) < 0) {
+        return NULL;
+    }
+    return l;
+}
+
+/* Complete the file name word (len bytes).  See complete_word(). */
+static int complete_file(const char *word, size_t len, char *insert,
+                         size_t size, int list_fd) {
+    const char *slash = memrchr(word, '/', len);
+    const char *base = slash ? slash + 1 : word;
+    size_t base_len = len - (base - word);
+    char dir[PATH_MAX];
+    const char *match = NULL;
+    struct listing *l;
+    int lo, hi, first, n, count = 0;
+    size_t common = 0, j;
+    bool hide;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == word) {
+        strcpy(dir, "/");
+    } else if ((size_t)(slash - word) < sizeof(dir)) {
+        memcpy(dir, word, slash - word);
+        dir[slash - word] = '\0';
+    } else {
+        return 0;
+    }
+    l = find_listing(dir);
+    if (l == NULL) {
+        return 0;
+    }
+
+    // The names starting with base are a run of the sorted listing
+    for (lo = 0, hi = l->n; lo < hi;) {
+        int mid = (lo + hi) / 2;
+        if (strncmp(l->names[mid], base, base_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    first = lo;
+    for (n = 0; first + n < l->n &&
+                strncmp(l->names[first + n], base, base_len) == 0;
+         n++) {
+    }
+    // Hidden files only if asked for
+    hide = base_len == 0 || base[0] != '.';
+    for (int i = first; i < first + n; i++) {
+        if (hide && l->names[i][0] == '.') {
+            continue;
+        }
+        if (count++ == 0) {
+            match = l->names[i];
+            common = strlen(match);
+        }
+        for (j = 0; j < common && match[j] == l->names[i][j]; j++) {
+        }
+        common = j;
+    }
+    if (count == 0 || common - base_len >= size - 1) {
+        return 0;
+    }
+    memcpy(insert, match + base_len, common - base_len);
+    insert[common - base_len] = '\0';
+    if (count == 1 && match[common - 1] != '/') {
+        strcat(insert, " ");
+    }
+
+    if (list_fd >= 0 && count > 1) {
+        for (int i = first, left = LIST_MAX; i < first + n && left > 0; i++) {
+            if (!hide || l->names[i][0] != '.') {
+                dprintf(list_fd, "%s\n", l->names[i]);
+                left--;
+            }
+        }
+    }
+    return count;
+}
+
+/* Complete the command name word (len bytes).  See complete_word(). */
+static int complete_command(const char *word, size_t len, char *insert,
+                            size_t size, int list_fd) {
+    const char *rest;
+    size_t rest_len, extra = 0;
+    struct tnode *n;
+    int count = 0;
+
+    pthread_mutex_lock(&commands_lock);
+    n = commands ? trie_find(commands, word, len, &rest, &rest_len) : NULL;
+    if (n == NULL || rest_len >= size) {
+        goto out;
+    }
+    count = n->count;
+    memcpy(insert, rest, rest_len);
+    extra = rest_len;
+
+    // Down to where the names branch (or one ends)
+    while (!n->word && n->child && n->child->sibling == NULL &&
+           extra + n->child->len < size) {
+        n = n->child;
+        memcpy(insert + extra, n->label, n->len);
+        extra += n->len;
+    }
+    insert[extra] = '\0';
+    if (count == 1 && extra + 1 < size) {
+        strcat(insert, " ");
+    }
+
+    // Every candidate is the word, the insert, then a name below n
+    if (list_fd >= 0 && count > 1 && len + extra < PATH_MAX) {
+        char name[PATH_MAX];
+        int left = LIST_MAX;
+
+        memcpy(name, word, len);
+        memcpy(name + len, insert, extra);
+        trie_list(list_fd, n, name, len + extra - n->len, &left);
+    }
+out:
+    pthread_mutex_unlock(&commands_lock);
+    return count;
+}
+
+/* Complete the last word of line (len bytes): a command name if it is
+ * the first word of a pipeline, else a file name.  insert (size bytes)
+ * is set to the text to add after it: as much as every candidate has in
+ * common, and a space once there is only one (or a '/' for a
+ * directory).  If list_fd is not -1 and there are several candidates,
+ * they are also written to it, one per line.
+ *
+ * Returns the number of candidates.
+ */
+int complete_word(const char *line, size_t len, char *insert, size_t size,
+                  int list_fd) {
+    size_t start = len;
+    bool command;
+
+    insert[0] = '\0';
+    while (start > 0 && !strchr(" \t|;&()<>", line[start - 1])) {
+        start--;
+    }
+    // The first word of a pipeline (or of a substitution)
+    command = true;
+    for (size_t i = start; i > 0; i--) {
+        if (line[i - 1] != ' ' && line[i - 1] != '\t') {
+            command = strchr("|;&(", line[i - 1]) != NULL;
+            break;
+        }
+    }
+
+    if (command && !memchr(line + start, '/', len - start)) {
+        return complete_command(line + start, len - start, insert, size,
+                                list_fd);
+    }
+    return complete_file(line + start, len - start, insert, size, list_fd);
+}
@@ -0,0 +1,479 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the line editor used when commands are typed at
+ * a terminal: cursor movement, history recall (see history.c) and tab
+ * completion (see complete.c).
+ *
+ * The terminal is put in raw mode for the line (signals, ^C and ^Z,
+ * are left to the terminal as before), and the editor keeps its own
+ * copy of what the terminal shows.  Keys are handled as they are read,
+ * but nothing is drawn until no more input is waiting, so a burst of
+ * keys (a paste, or typing ahead over a slow link) is drawn once.  A
+ * redraw only rewrites the line from the first byte that changed (or
+ * just moves the cursor), and is handed to the terminal as one
+ * writev(), so each batch costs one write and a few bytes on the wire;
+ * the prompt is only written again after a listing or ^L.
+ *
+ * Keys are still read one at a time, so a line's Enter is never read
+ * along with what was typed after it: that is left for whatever reads
+ * stdin next, e.g., the command just started.
+ *
+ * Keys: Left/Right (^B/^F), Home/End (^A/^E), Up/Down (^P/^N) through
+ * the history, Backspace, Delete (^D on a non-empty line), ^K and ^U
+ * (delete to the end or start), ^W (delete a word), ^L (clear the
+ * screen), Tab (complete; twice to list the candidates), and ^D on an
+ * empty line for the end of input.
+ */
+
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_ESC 27
+#define KEY_BACKSPACE 127
+
+// Keys sent as escape sequences, past any byte
+enum {
+    KEY_LEFT = 256,
+    KEY_RIGHT,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_NONE,  // A sequence we do not handle
+};
+
+struct editor {
+    const char *prompt;
+    char *buf;
+    size_t size, len, pos;  // pos is the cursor, in buf
+
+    // What the terminal shows (after the prompt), as of the last draw
+    char *shown;
+    size_t shown_len, shown_pos;
+    bool redraw;  // Write the prompt and the whole line
+    bool clear;   // ...after clearing the screen
+
+    int back;     // Lines back in the history, 0 for the one being typed
+    char *typed;  // The line being typed, while recalling
+    size_t typed_len;
+};
+
+/* Is more input waiting to be read? */
+static bool input_waiting(int fd) {
+    int n = 0;
+    return ioctl(fd, FIONREAD, &n) == 0 && n > 0;
+}
+
+/* Read one byte.  Returns it, or -1 at the end of input, -errno on
+ * failure.
+ */
+static int read_byte(int fd) {
+    unsigned char c;
+    ssize_t n;
+
+    do {
+        n = read(fd, &c, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n < 0 ? -errno : -1;
+    }
+    return c;
+}
+
+/* Read one key: a byte, or one of the KEY_ codes for an escape
+ * sequence (ESC [ or ESC O, parameters, then a final byte).
+ *
+ * Returns the key, or as read_byte() does.
+ */
+static int read_key(int fd) {
+    int c = read_byte(fd), param = 0;
+
+    if (c != KEY_ESC) {
+        return c;
+    }
+    c = read_byte(fd);
+    if (c != '[' && c != 'O') {
+        return c < 0 ? c : KEY_NONE;
+    }
+    for (;;) {
+        c = read_byte(fd);
+        if (c < 0) {
+            return c;
+        }
+        if (c >= '0' && c <= '9') {
+            param = param * 10 + c - '0';
+        } else if (c >= 0x40 && c <= 0x7e) {
+            break;  // The final byte
+        }
+    }
+    switch (c) {
+        case 'A':
+            return KEY_UP;
+        case 'B':
+            return KEY_DOWN;
+        case 'C':
+            return KEY_RIGHT;
+        case 'D':
+            return KEY_LEFT;
+        case 'H':
+            return KEY_HOME;
+        case 'F':
+            return KEY_END;
+        case '~':
+            switch (param) {
+                case 1:
+                case 7:
+                    return KEY_HOME;
+                case 4:
+                case 8:
+                    return KEY_END;
+                case 3:
+                    return KEY_DELETE;
+            }
+    }
+    return KEY_NONE;
+}
+
+/* Bring the terminal up to date with the line, in one write.  */
+static void draw(struct editor *e) {
+    struct iovec iov[6];
+    char move_left[32], move_end[32];
+    size_t from = 0;
+    int n = 0;
+
+#define ADD(base, length)                           \
+    do {                                            \
+        if ((length) > 0) {                         \
+            iov[n].iov_base = (void *)(base);       \
+            iov[n++].iov_len = (length);            \
+        }                                           \
+    } while (0)
+
+    if (e->redraw) {
+        ADD(e->clear ? "\x1b[H\x1b[2J" : "\r", e->clear ? 7 : 1);
+        ADD(e->prompt, strlen(e->prompt));
+        e->shown_len = 0;
+    } else {
+        // Keep what is unchanged at the front
+        while (from < e->len && from < e->shown_len &&
+               e->buf[from] == e->shown[from]) {
+            from++;
+        }
+        if (from == e->len && e->len == e->shown_len) {
+            // Only the cursor moves
+            from = e->pos;
+            if (e->pos < e->shown_pos) {
+                ADD(move_left, snprintf(move_left, sizeof(move_left),
+                                        "\x1b[%zuD", e->shown_pos - e->pos));
+            } else {
+                ADD(e->buf + e->shown_pos, e->pos - e->shown_pos);
+            }
+            goto out;
+        }
+        if (from > e->shown_pos) {
+            from = e->shown_pos;
+        }
+        if (from < e->shown_pos) {
+            ADD(move_left, snprintf(move_left, sizeof(move_left), "\x1b[%zuD",
+                                    e->shown_pos - from));
+        }
+    }
+    ADD(e->buf + from, e->len - from);
+    if (e->len < e->shown_len) {
+        ADD("\x1b[K", 3);
+    }
+    if (e->pos < e->len) {
+        ADD(move_end, snprintf(move_end, sizeof(move_end), "\x1b[%zuD",
+                               e->len - e->pos));
+    }
+#undef ADD
+
+out:
+    if (n > 0) {
+        writev(STDOUT_FILENO, iov, n);
+    }
+    memcpy(e->shown, e->buf, e->len);
+    e->shown_len = e->len;
+    e->shown_pos = e->pos;
+    e->redraw = e->clear = false;
+}
+
+/* Make room for a line of len bytes (and its newline and NUL) in buf,
+ * and in the copies of it, shown and typed.
+ *
+ * Returns false if there is not enough memory.
+ */
+static bool reserve(struct editor *e, size_t len) {
+    size_t size = e->size ? e->size : MAX_INPUT;
+    char *p;
+
+    if (len + 2 <= e->size && e->shown && e->typed) {
+        return true;
+    }
+    while (len + 2 > size) {
+        size *= 2;
+    }
+    // Each is at least size once they all are
+    if ((p = realloc(e->buf, size)) == NULL) {
+        return false;
+    }
+    e->buf = p;  // The caller's buffer is now this one
+    if ((p = realloc(e->shown, size)) == NULL) {
+        return false;
+    }
+    e->shown = p;
+    if ((p = realloc(e->typed, size)) == NULL) {
+        return false;
+    }
+    e->typed = p;
+    e->size = size;
+    return true;
+}
+
+/* Replace the line with text (len bytes), the cursor at its end. */
+static void set_line(struct editor *e, const char *text, size_t len) {
+    if (!reserve(e, len)) {
+        return;
+    }
+    memcpy(e->buf, text, len);
+    e->len = e->pos = len;
+}
+
+/* Insert text (len bytes) at the cursor, if there is memory for it. */
+static void insert(struct editor *e, const char *text, size_t len) {
+    if (!reserve(e, e->len + len)) {
+        return;
+    }
+    memmove(e->buf + e->pos + len, e->buf + e->pos, e->len - e->pos);
+    memcpy(e->buf + e->pos, text, len);
+    e->len += len;
+    e->pos += len;
+}
+
+/* Delete the bytes from start up to the cursor. */
+static void delete_before(struct editor *e, size_t start) {
+    memmove(e->buf + start, e->buf + e->pos, e->len - e->pos);
+    e->len -= e->pos - start;
+    e->pos = start;
+}
+
+/* Step back (dir 1) or forward (-1) through the history. */
+static void recall(struct editor *e, int dir) {
+    const char *line;
+
+    if (e->back + dir == 0) {
+        e->back = 0;
+        set_line(e, e->typed, e->typed_len);
+        return;
+    }
+    line = history_line(e->back + dir);
+    if (line == NULL) {
+        return;
+    }
+    if (e->back == 0) {
+        memcpy(e->typed, e->buf, e->len);
+        e->typed_len = e->len;
+    }
+    e->back += dir;
+    set_line(e, line, strlen(line));
+}
+
+/* Complete the word before the cursor.  With list, the candidates are
+ * listed if there is nothing to add.
+ */
+static void complete(struct editor *e, bool list) {
+    char text[PATH_MAX];
+    int count;
+
+    count = complete_word(e->buf, e->pos, text, sizeof(text), -1);
+    if (text[0] != '\0') {
+        insert(e, text, strlen(text));
+    } else if (count > 1 && list) {
+        // The listing starts below the line, which is then drawn again
+        e->pos = e->len;
+        draw(e);
+        write(STDOUT_FILENO, "\n", 1);
+        complete_word(e->buf, e->len, text, sizeof(text), STDOUT_FILENO);
+        e->redraw = true;
+    }
+}
+
+/* Handle one key.
+ *
+ * Returns 1 once the line is finished, -1 at the end of input, else 0.
+ */
+static int handle_key(struct editor *e, int key, bool tabbed) {
+    size_t start;
+
+    switch (key) {
+        case '\r':
+        case '\n':
+            e->pos = e->len;
+            return 1;
+        case KEY_CTRL('D'):
+            if (e->len == 0) {
+                return -1;
+            }
+            /* fall through */
+        case KEY_DELETE:
+            if (e->pos < e->len) {
+                e->pos++;
+                delete_before(e, e->pos - 1);
+            }
+            break;
+        case KEY_BACKSPACE:
+        case KEY_CTRL('H'):
+            if (e->pos > 0) {
+                delete_before(e, e->pos - 1);
+            }
+            break;
+        case KEY_LEFT:
+        case KEY_CTRL('B'):
+            if (e->pos > 0) {
+                e->pos--;
+            }
+            break;
+        case KEY_RIGHT:
+        case KEY_CTRL('F'):
+            if (e->pos < e->len) {
+                e->pos++;
+            }
+            break;
+        case KEY_HOME:
+        case KEY_CTRL('A'):
+            e->pos = 0;
+            break;
+        case KEY_END:
+        case KEY_CTRL('E'):
+            e->pos = e->len;
+            break;
+        case KEY_UP:
+        case KEY_CTRL('P'):
+            recall(e, 1);
+            break;
+        case KEY_DOWN:
+        case KEY_CTRL('N'):
+            recall(e, -1);
+            break;
+        case KEY_CTRL('K'):
+            e->len = e->pos;
+            break;
+        case KEY_CTRL('U'):
+            delete_before(e, 0);
+            break;
+        case KEY_CTRL('W'):
+            start = e->pos;
+            while (start > 0 && e->buf[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && e->buf[start - 1] != ' ') {
+                start--;
+            }
+            delete_before(e, start);
+            break;
+        case KEY_CTRL('L'):
+            e->redraw = e->clear = true;
+            break;
+        case '\t':
+            complete(e, tabbed);
+            break;
+        default:
+            if (key >= ' ' && key < KEY_BACKSPACE) {
+                char c = key;
+                insert(e, &c, 1);
+            } else if (key > KEY_BACKSPACE && key < 256) {
+                char c = key;  // Part of a UTF-8 character
+                insert(e, &c, 1);
+            }
+    }
+    return 0;
+}
+
+/* Can lines from fd be edited (is it a terminal)? */
+bool edit_available(int fd) {
+    return isatty(fd);
+}
+
+/* Write prompt, then read and edit one line from the terminal fd into
+ * *buf (*size bytes), as read_line() does: the buffer grows as the
+ * line does, so a line may be any length.
+ *
+ * Returns the number of bytes read (with the newline), 0 at the end of
+ * input (^D on an empty line), or -errno on failure.
+ */
+int edit_line(int fd, const char *prompt, char **buf, size_t *size) {
+    struct editor *e;
+    struct termios saved, raw;
+    bool tabbed = false;  // The last key was Tab
+    int rv = 0;
+
+    if (tcgetattr(fd, &saved) < 0) {
+        write(STDOUT_FILENO, prompt, strlen(prompt));
+        return read_line(fd, buf, size);
+    }
+    raw = saved;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    e = calloc(1, sizeof(struct editor));
+    if (e) {
+        e->buf = *buf;
+        e->size = *size;
+    }
+    if (e == NULL || !reserve(e, 0) || tcsetattr(fd, TCSADRAIN, &raw) < 0) {
+        if (e) {
+            *buf = e->buf;
+            *size = e->size;
+            free(e->shown);
+            free(e->typed);
+        }
+        free(e);
+        write(STDOUT_FILENO, prompt, strlen(prompt));
+        return read_line(fd, buf, size);
+    }
+    e->prompt = prompt;
+    e->redraw = true;
+
+    for (;;) {
+        int key;
+
+        // Draw once the keys typed so far are all handled
+        if (e->redraw || !input_waiting(fd)) {
+            draw(e);
+        }
+        key = read_key(fd);
+        if (key < 0) {
+            rv = key == -1 ? (int)e->len : key;
+            break;
+        }
+        rv = handle_key(e, key, tabbed);
+        if (rv != 0) {
+            draw(e);
+            write(STDOUT_FILENO, "\n", 1);
+            rv = rv > 0 ? (int)e->len : 0;
+            if (rv > 0) {
+                e->buf[e->len] = '\n';
+                rv++;
+            }
+            break;
+        }
+        tabbed = key == '\t';
+    }
+
+    tcsetattr(fd, TCSADRAIN, &saved);
+    e->buf[rv > 0 ? rv : 0] = '\0';
+    *buf = e->buf;
+    *size = e->size;
+    free(e->shown);
+    free(e->typed);
+    free(e);
+    return rv;
+}
@@ -6,6 +6,10 @@
  * This starter code is fully optional and you may not require it or need to modify it
  * unless you wish to tackle a challenge problem involving the history.
  *
+ * Lines typed at the terminal are kept in memory, in a ring of the
+ * last HISTORY_SIZE, for the line editor to recall (see edit.c).  The
+ * saved history is only loaded when the history is first used, so a
+ * shell that never reads a line from the terminal never loads it.
  */
 
 #include <stdlib.h>
@@ -14,20 +18,67 @@
 #include <fcntl.h>
 #include "thsh.h"
 
+#define HISTORY_SIZE 1000
+
+static char *history[HISTORY_SIZE];
+static int history_count;  // Lines ever added; the newest is count - 1
+static bool loaded;
+
+// Load the saved history, the first time the history is used
+static void load_once(void) {
+  if (!loaded) {
+    loaded = true;
+    deferred_phase(DEFER_HISTORY, load_history);
+  }
+}
 
 /* Add a line to the history
  */
 void add_history_line(char *line) {
-  // Your code here (maybe)
+  size_t len = strcspn(line, "\n");
+  const char *last = history_line(1);
+  char *copy;
+
+  // Blank lines, and the same line again, are not worth recalling
+  if (len == 0 || (last && strlen(last) == len && memcmp(last, line, len) == 0)) {
+    return;
+  }
+  copy = strndup(line, len);
+  if (copy == NULL) {
+    return;
+  }
+  free(history[history_count % HISTORY_SIZE]);
+  history[history_count++ % HISTORY_SIZE] = copy;
+}
+
+/* The line added back lines ago (1 is the newest), or NULL if there is
+ * none that old.
+ */
+const char *history_line(int back) {
+  load_once();
+  if (back < 1 || back > history_count || back > HISTORY_SIZE) {
+    return NULL;
+  }
+  return history[(history_count - back) % HISTORY_SIZE];
 }
 
 void clear_history(void) {
-  // Your code here (maybe)
+  load_once();  // Or it would come back later
+  for (int i = 0; i < HISTORY_SIZE; i++) {
+    free(history[i]);
+    history[i] = NULL;
+  }
+  history_count = 0;
 }
 
 
 void print_history(int stdout) {
-  // Your code here (maybe)
+  load_once();
+  int first = history_count > HISTORY_SIZE ? history_count - HISTORY_SIZE : 0;
+
+  for (int i = first; i < history_count; i++) {
+    dprintf(stdout, "%5d  %s\n", i + 1, history[i % HISTORY_SIZE]);
+  }
 }
 
 
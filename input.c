@@ -0,0 +1,226 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file reads a script named on the command line ("thsh script").
+ * A regular file is mapped whole, and each line is handed to the
+ * parser as a slice of the mapping, so the script is never copied: a
+ * generated script of several gigabytes costs no more than the pages
+ * the kernel reads in for it.  A construct that spans lines (an if,
+ * while or for, or a line ending in a backslash) is the same slice,
+ * extended over the lines that follow.
+ *
+ * The mapping is private and writable, so the parser may still write
+ * into a line (only the pages it touches are copied).  Once the shell
+ * is well past a region of the file, the region is dropped from the
+ * mapping, so the shell does not grow with the script.
+ *
+ * Anything that cannot be mapped (a pipe, a terminal, an empty file)
+ * is read as a stream instead, in blocks, into a buffer that holds
+ * the current slice and whatever has been read past it.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Bytes read from a stream at a time
+#define INPUT_BLOCK 65536
+
+// How far behind the current line the mapping is dropped
+#define INPUT_DROP (64UL << 20)
+
+struct input {
+    int fd;
+    char *data;      // The mapping, or the stream's buffer
+    size_t size;     // Bytes in data
+    size_t cap;      // Stream: bytes allocated for data
+    bool mapped;
+    bool eof;        // Stream: read() has returned 0
+    size_t start;    // The current slice
+    size_t end;
+    size_t dropped;  // Mapping: bytes before this have been dropped
+};
+
+/* Open the script at path.
+ *
+ * Returns 0 and sets *ip on success, -errno on failure.
+ */
+int input_open(struct input **ip, const char *path) {
+    struct input *in;
+    struct stat st;
+    int rv;
+
+    in = calloc(1, sizeof(struct input));
+    if (in == NULL) {
+        return -ENOMEM;
+    }
+    in->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in->fd < 0 || fstat(in->fd, &st) < 0) {
+        goto fail;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uintmax_t)st.st_size <= SIZE_MAX) {
+        in->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, in->fd, 0);
+        if (in->data != MAP_FAILED) {
+            in->mapped = true;
+            in->size = st.st_size;
+            madvise(in->data, in->size, MADV_SEQUENTIAL);
+            *ip = in;
+            return 0;
+        }
+    }
+
+    // Read it as a stream
+    in->cap = INPUT_BLOCK;
+    in->data = malloc(in->cap);
+    if (in->data == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    *ip = in;
+    return 0;
+
+fail:
+    rv = -errno;
+    if (in->fd >= 0) {
+        close(in->fd);
+    }
+    free(in);
+    return rv;
+}
+
+/* Read another block of a stream into its buffer, after moving the
+ * current slice (and what follows it) to the front.
+ *
+ * Returns the number of bytes read, 0 at the end, or -errno.
+ */
+static int read_block(struct input *in) {
+    ssize_t n;
+
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, in->size - in->start);
+        in->size -= in->start;
+        in->end -= in->start;
+        in->start = 0;
+    }
+    if (in->cap - in->size < INPUT_BLOCK) {
+        char *bigger = realloc(in->data, in->cap * 2);
+        if (bigger == NULL) {
+            return -ENOMEM;
+        }
+        in->data = bigger;
+        in->cap *= 2;
+    }
+    do {
+        n = read(in->fd, in->data + in->size, in->cap - in->size);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return -errno;
+    }
+    in->eof = n == 0;
+    in->size += n;
+    return n;
+}
+
+/* Extend the current slice through the end of the next line.
+ *
+ * Returns the slice's length, or -errno.
+ */
+static int extend(struct input *in) {
+    size_t scanned = in->end;
+    char *nl;
+
+    while ((nl = memchr(in->data + scanned, '\n', in->size - scanned)) ==
+           NULL) {
+        size_t moved = in->start;
+        int rv;
+
+        scanned = in->size;
+        if (in->mapped || in->eof) {
+            break;  // The last line has no newline
+        }
+        rv = read_block(in);
+        if (rv < 0) {
+            return rv;
+        }
+        scanned -= moved - in->start;
+    }
+    in->end = nl ? (size_t)(nl - in->data) + 1 : in->size;
+    if (in->end - in->start > INT_MAX) {
+        return -E2BIG;
+    }
+    return in->end - in->start;
+}
+
+/* Start a new slice with the next line of the script, and set *line to
+ * it.  The slice is good until the next call.
+ *
+ * Returns its length (including the newline), 0 at the end of the
+ * script, or -errno.
+ */
+int input_next(struct input *in, char **line) {
+    int rv;
+
+    in->start = in->end;
+    if (in->mapped && in->start - in->dropped >= 2 * INPUT_DROP) {
+        size_t upto =
+            (in->start - INPUT_DROP) & ~(size_t)(getpagesize() - 1);
+        madvise(in->data + in->dropped, upto - in->dropped, MADV_DONTNEED);
+        in->dropped = upto;
+    }
+
+    if (!in->mapped && in->start == in->size && !in->eof) {
+        rv = read_block(in);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    if (in->start == in->size) {
+        return 0;
+    }
+    rv = extend(in);
+    *line = in->data + in->start;
+    return rv;
+}
+
+/* Extend the current slice over the next line of the script (which
+ * continues it), and set *line to it, as it may have moved.
+ *
+ * Returns its new length, 0 if the script has ended, or -errno.
+ */
+int input_more(struct input *in, char **line) {
+    int rv;
+
+    if (!in->mapped && in->end == in->size && !in->eof) {
+        rv = read_block(in);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    if (in->end == in->size) {
+        return 0;
+    }
+    rv = extend(in);
+    *line = in->data + in->start;
+    return rv;
+}
+
+void input_close(struct input *in) {
+    if (in == NULL) {
+        return;
+    }
+    if (in->mapped) {
+        munmap(in->data, in->size);
+    } else {
+        free(in->data);
+    }
+    close(in->fd);
+    free(in);
+}
@@ -4,15 +4,34 @@
  * jobs and job control.
  */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "thsh.h"
 
 static char **path_table;
+static char *path_string;  // PATH, until path_table is built from it
+static bool use_pathdb;    // Consult the on-disk path cache
+
+static int build_path_table(void);
+
+static void free_path_table(char **table) {
+    for (int i = 0; table && table[i]; i++) {
+        free(table[i]);
+    }
+    free(table);
+}
 
 typedef struct {
     int length;
@@ -45,15 +64,58 @@ int init_path(void) {
     if (path_cpy == NULL) {
         return EXIT_FAILURE;
     }
+    if (set_path(path_cpy) || build_path_table()) {
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+static void clear_path_cache(void);
 
-    char *path = strdup(path_cpy);
+/* Replace PATH with path (which may be NULL, for an empty table), and
+ * forget where commands were found.  Called whenever PATH is set.
+ *
+ * The table itself is only built, as init_path() describes, when a
+ * command is first looked up, so a shell that runs no programs (or
+ * sets PATH several times first) never splits it.
+ *
+ * Returns 0 on success, -errno on failure (the old path is kept).
+ */
+int set_path(const char *path_cpy) {
+    char *path = strdup(path_cpy ? path_cpy : "");
     if (path == NULL) {
-        return EXIT_FAILURE;
+        return -ENOMEM;
     }
-    path_table = (char **)malloc(sizeof(char *) * 2);
-    if (path_table == NULL) {
+
+    // What was found on the old path is no use now
+    pathdb_close();
+    free(path_string);
+    path_string = path;
+    free_path_table(path_table);
+    path_table = NULL;
+    clear_path_cache();
+    complete_path_changed();
+    return 0;
+}
+
+/* Split the PATH last given to set_path() into path_table, if that has
+ * not been done yet, and check the on-disk path cache against it (see
+ * load_path_cache()).
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int build_path_table(void) {
+    if (path_table) {
+        return 0;
+    }
+    char *path = strdup(path_string ? path_string : "");
+    if (path == NULL) {
+        return -ENOMEM;
+    }
+    char **table = (char **)malloc(sizeof(char *) * 2);
+    if (table == NULL) {
         free(path);
-        return EXIT_FAILURE;
+        return -ENOMEM;
     }
 
     int ind = 0;
@@ -61,39 +123,52 @@ int init_path(void) {
     char *temp = strtok(path, ":");
 
     while (temp != NULL) {
-        if (ind >= cSize) {
+        // Leave room for the NULL at the end
+        if (ind + 1 >= cSize) {
             cSize *= 2;
-            char **new_table = realloc(path_table, sizeof(char *) * cSize);
+            char **new_table = realloc(table, sizeof(char *) * cSize);
             if (new_table == NULL) {
-                free(path_table);
+                table[ind] = NULL;
+                free_path_table(table);
                 free(path);
-                return EXIT_FAILURE;
+                return -ENOMEM;
             }
-            path_table = new_table;
+            table = new_table;
         }
-        path_table[ind] = strdup(temp);
+        table[ind] = strdup(temp);
         ind++;
         temp = strtok(NULL, ":");
     }
-    if (ind >= cSize) {
-        char **new_table = realloc(path_table, sizeof(char *) * (cSize + 1));
-        if (new_table == NULL) {
-            free(path_table);
-            free(path);
-            return -1;
-        }
-        path_table = new_table;
-    }
-    path_table[ind] = NULL;
+    table[ind] = NULL;
     free(path);
+    path_table = table;
 
+    // Without it, commands are just searched for as usual
+    if (use_pathdb) {
+        pathdb_open(path_table);
+    }
     return 0;
 }
 
+/* The path table, built if need be, for completion (see complete.c).
+ * It is freed when PATH is next set.
+ *
+ * Returns it, or NULL if it could not be built.
+ */
+char **get_path_table(void) {
+    if (deferred_phase(DEFER_PATH, build_path_table) < 0) {
+        return NULL;
+    }
+    return path_table;
+}
+
 /* Debug helper function that just prints
  * the path table out.
  */
 void print_path_table() {
+    if (path_string) {
+        deferred_phase(DEFER_PATH, build_path_table);
+    }
     if (path_table == NULL) {
         printf("XXXXXXX Path Table Not Initialized XXXXX\n");
         return;
@@ -111,17 +186,258 @@ void print_path_table() {
 //     print_path_table();
 // }
 
+// Commands already found on the path, so each is only searched for once
+#define PATH_CACHE_SIZE 256
+
+struct path_entry {
+    char *name;  // As typed, e.g., "ls"
+    char *path;  // Where it was found, e.g., "/usr/bin/ls"
+    struct path_entry *next;
+};
+
+static struct path_entry *path_cache[PATH_CACHE_SIZE];
+
+static void clear_path_cache(void) {
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        while (path_cache[i]) {
+            struct path_entry *e = path_cache[i];
+            path_cache[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+static unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h % PATH_CACHE_SIZE;
+}
+
+/* Use the on-disk path cache (see pathdb.c) left by earlier shells,
+ * if it is still valid for the path table.  It is checked when the
+ * table is built, on the first lookup.
+ */
+void load_path_cache(void) {
+    use_pathdb = true;
+    if (path_table) {
+        pathdb_open(path_table);
+    }
+}
+
+/* Add the commands this shell found by searching PATH to the on-disk
+ * path cache, for later shells.  Called at exit.
+ */
+void save_path_cache(void) {
+    char *names[256], *paths[256];
+    int n = 0;
+
+    for (int i = 0; i < PATH_CACHE_SIZE && n < 256; i++) {
+        for (struct path_entry *e = path_cache[i]; e && n < 256; e = e->next) {
+            names[n] = e->name;
+            paths[n++] = e->path;
+        }
+    }
+    pathdb_save(names, paths, n);
+}
+
+/* Search the path for the executable name, consulting the caches
+ * first: this shell's, then the one on disk.
+ *
+ * Returns a malloc'd path, or NULL with *err set to -errno.
+ */
+static char *find_command(const char *name, int *err) {
+    struct path_entry **bucket = &path_cache[hash_name(name)];
+    char *cmd = NULL;
+
+    for (struct path_entry *e = *bucket; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            metric_add(METRIC_PATH_HITS, 1);
+            metric_add(METRIC_JOB_ALLOCS, 1);
+            metric_add(METRIC_JOB_BYTES, strlen(e->path) + 1);
+            cmd = strdup(e->path);
+            *err = cmd ? 0 : -ENOMEM;
+            return cmd;
+        }
+    }
+    metric_add(METRIC_PATH_MISSES, 1);
+
+    *err = deferred_phase(DEFER_PATH, build_path_table);
+    if (*err < 0) {
+        return NULL;
+    }
+
+    // Found by an earlier shell?
+    const char *saved = pathdb_lookup(name);
+    if (saved) {
+        metric_add(METRIC_PATH_DB_HITS, 1);
+        metric_add(METRIC_JOB_ALLOCS, 1);
+        metric_add(METRIC_JOB_BYTES, strlen(saved) + 1);
+        cmd = strdup(saved);
+        *err = cmd ? 0 : -ENOMEM;
+        return cmd;
+    }
+
+    for (int i = 0; path_table[i] != NULL; i++) {
+        // Calculate required buffer size
+        size_t path_len = strlen(path_table[i]) + strlen(name) + 2;
+        char *tmp = malloc(path_len);
+
+        if (!tmp) {
+            *err = -ENOMEM;
+            return NULL;
+        }
+        metric_add(METRIC_JOB_ALLOCS, 1);
+        metric_add(METRIC_JOB_BYTES, path_len);
+
+        // Build path safely
+        snprintf(tmp, path_len, "%s/%s", path_table[i], name);
+
+        // Check if executable exists and is accessible
+        metric_add(METRIC_ACCESS_CALLS, 1);
+        if (access(tmp, X_OK) == 0) {
+            cmd = tmp;
+            break;
+        }
+
+        free(tmp);
+    }
+    if (cmd == NULL) {
+        *err = -ENOENT;
+        return NULL;
+    }
+
+    // Failing to remember it only costs a search next time
+    struct path_entry *e = malloc(sizeof(struct path_entry));
+    if (e && (e->name = strdup(name)) && (e->path = strdup(cmd))) {
+        e->next = *bucket;
+        *bucket = e;
+    } else if (e) {
+        free(e->name);
+        free(e);
+    }
+    *err = 0;
+    return cmd;
+}
+
+// Capacity requested for inter-stage pipes; 0 keeps the kernel default
+static int default_pipe_size = 0;
+
+/* Create a pipe to connect two pipeline stages.
+ *
+ * Both ends are close-on-exec, so a stage only keeps the ends that
+ * run_command() dup2()s onto its stdin and stdout.
+ *
+ * size is the capacity to request with F_SETPIPE_SZ, or 0 to use the
+ * shell-wide default set with set_pipe_size().  The kernel rounds this
+ * up to a power-of-two number of pages.  Sizes are checked with
+ * probe_pipe_size() when they are set, so a refused default (e.g., the
+ * user's pipe pages have run out since) just keeps the kernel's
+ * capacity, while a refused size for this pipeline is an error.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int create_pipe(int pipefd[2], int size) {
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -errno;
+    }
+
+    if (size > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, size) < 0) {
+        int rv = -errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return rv;
+    }
+    if (size == 0 && default_pipe_size > 0) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, default_pipe_size);
+    }
+
+    return 0;
+}
+
+/* Find the capacity the kernel grants a pipe when size is asked for
+ * (0: the kernel default), on a scratch pipe, without setting anything.
+ *
+ * Returns the capacity on success, -errno if size would be refused.
+ */
+int probe_pipe_size(int size) {
+    int pipefd[2];
+    int rv;
+
+    if (size < 0) {
+        return -EINVAL;
+    }
+
+    if (pipe(pipefd) < 0) {
+        return -errno;
+    }
+    if (size > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, size) < 0) {
+        rv = -errno;
+    } else {
+        rv = fcntl(pipefd[1], F_GETPIPE_SZ);
+        if (rv < 0) {
+            rv = -errno;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return rv;
+}
+
+/* Set the shell-wide default capacity of inter-stage pipes.
+ *
+ * size is in bytes; 0 restores the kernel default.  The size is tried
+ * on a scratch pipe first, so that a value the kernel will not grant
+ * is reported here rather than ignored on every pipeline.
+ *
+ * Returns the capacity the kernel actually grants on success,
+ * -errno on failure.
+ */
+int set_pipe_size(int size) {
+    int rv = probe_pipe_size(size);
+
+    if (rv > 0) {
+        default_pipe_size = size;
+    }
+    return rv;
+}
+
+/* Returns the shell-wide default pipe capacity, 0 meaning the
+ * kernel default.
+ */
+int get_pipe_size(void) { return default_pipe_size; }
+
 static int job_counter = 0;
 
 struct kiddo {
-    int pid;
-    struct kiddo *next;  // Linked list of sibling processes
+    int pid;                // 0 if this stage is a builtin on a thread
+    pthread_t thread;       // Thread running the builtin stage
+    _Atomic pid_t tid;      // Its kernel thread id, once it is running
+    _Atomic bool done;      // Set when the thread has finished
+    struct timespec start;  // When it was started (CLOCK_MONOTONIC)
+    struct rusage ru;       // Filled in when it is reaped
+    struct kiddo *next;     // Linked list of sibling processes
+};
+
+// What a builtin stage thread needs; freed by the thread
+struct stage_args {
+    stage_func func;
+    char **args;
+    struct stream in;
+    struct stream out;
+    struct kiddo *kiddo;  // Where the thread leaves its resource usage
 };
 
 // A job consists of a unique numeric ID and
 // one or more processes
 struct job {
     int id;
+    int cpu;                // CPU to pin processes to, -1 = any
+    struct watchdog *watchdog;  // Enforces its deadline, NULL = none
+    const struct job_limits *limits;  // For its processes, NULL = none
     struct kiddo *kidlets;  // Linked list of child processes
     struct job *next;       // Linked list of active jobs
 };
@@ -136,7 +452,12 @@ static struct job *jobbies = NULL;
 int create_job(void) {
     struct job *tmp;
     struct job *j = malloc(sizeof(struct job));
+    metric_add(METRIC_JOB_ALLOCS, 1);
+    metric_add(METRIC_JOB_BYTES, sizeof(struct job));
     j->id = ++job_counter;
+    j->cpu = -1;
+    j->watchdog = NULL;
+    j->limits = NULL;
     j->kidlets = NULL;
     j->next = NULL;
     if (jobbies) {
@@ -176,12 +497,157 @@ static struct job *find_job(int job_id, bool remove) {
     return NULL;
 }
 
+/* Pin the processes (or builtin stage thread) that run_command()
+ * starts for this job to one CPU, or to any CPU if cpu is -1.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int set_job_cpu(int job_id, int cpu) {
+    struct job *s = find_job(job_id, false);
+    if (s == NULL) {
+        return -EINVAL;
+    }
+    if (cpu >= CPU_SETSIZE) {
+        return -EINVAL;
+    }
+    s->cpu = cpu;
+    return 0;
+}
+
+/* Put the processes that run_command() starts for this job under the
+ * watchdog w (see watchdog.c): in its process group, and killed at its
+ * deadline.  Such a job runs no builtin stage threads.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int set_job_watchdog(int job_id, struct watchdog *w) {
+    struct job *s = find_job(job_id, false);
+    if (s == NULL) {
+        return -EINVAL;
+    }
+    s->watchdog = w;
+    return 0;
+}
+
+/* Apply the limits l (see limits.c), which must outlive the job, to
+ * the processes that run_command() starts for this job.  Such a job
+ * runs no builtin stage threads.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int set_job_limits(int job_id, const struct job_limits *l) {
+    struct job *s = find_job(job_id, false);
+    if (s == NULL) {
+        return -EINVAL;
+    }
+    s->limits = l && l->set ? l : NULL;
+    return 0;
+}
+
+/* Thread body for a builtin pipeline stage.
+ *
+ * The thread owns the stage's two streams and closes them when the
+ * builtin finishes, so that the next stage sees end of input (and the
+ * previous one EPIPE, if the builtin stopped reading early).  Its exit
+ * code is handed back to wait_on_job() through pthread_join().
+ */
+static void *stage_thread(void *arg) {
+    struct stage_args *sa = arg;
+    struct kiddo *k = sa->kiddo;
+
+    k->tid = gettid();
+    trace_event(TRACE_STAGE, 'B', sa->args[0], 0, 0);
+    int rv = sa->func(sa->args, &sa->in, &sa->out);
+    trace_event(TRACE_STAGE, 'E', sa->args[0], rv, 0);
+
+    stream_close(&sa->in);
+    stream_close(&sa->out);
+    getrusage(RUSAGE_THREAD, &k->ru);
+    k->done = true;
+    free(sa);
+    return (void *)(long)rv;
+}
+
+/* Start the builtin stage func on a thread, as part of job job_id.
+ *
+ * in and out are the stage's input and output streams (descriptors, or
+ * rings shared with adjacent builtin stages); they are copied, and the
+ * thread takes them over.  If the thread cannot be started, they are
+ * closed here instead.
+ *
+ * SIGPIPE is blocked on the thread, so that writing to a pipe whose
+ * reader has exited fails with EPIPE rather than killing the shell.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int run_stage(stage_func func, char *args[MAX_ARGS], struct stream *in,
+              struct stream *out, int job_id) {
+    struct job *s = find_job(job_id, false);
+    struct kiddo *k = malloc(sizeof(struct kiddo));
+    struct stage_args *sa = malloc(sizeof(struct stage_args));
+    pthread_attr_t attr;
+    sigset_t block, old;
+    int rv = -ENOMEM;
+
+    if (s == NULL) {
+        rv = -EINVAL;
+    }
+    if (s == NULL || k == NULL || sa == NULL) {
+        goto fail;
+    }
+    metric_add(METRIC_JOB_ALLOCS, 2);
+    metric_add(METRIC_JOB_BYTES,
+               sizeof(struct kiddo) + sizeof(struct stage_args));
+    sa->func = func;
+    sa->args = args;
+    sa->in = *in;
+    sa->out = *out;
+    sa->kiddo = k;
+    k->tid = 0;
+    k->done = false;
+    clock_gettime(CLOCK_MONOTONIC, &k->start);
+
+    pthread_attr_init(&attr);
+    if (s->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(s->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    rv = -pthread_create(&k->thread, &attr, stage_thread, sa);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (rv) {
+        goto fail;
+    }
+
+    k->pid = 0;
+    k->next = s->kidlets;
+    s->kidlets = k;
+    return 0;
+
+fail:
+    free(k);
+    free(sa);
+    stream_close(in);
+    stream_close(out);
+    return rv;
+}
+
 /* Given the command listed in args,
  * try to execute it and create a job structure.
  *
  * This function does NOT wait on the child to complete,
  * nor does it return an exit code from the child.
  *
+ * If the command is a builtin that can run as a pipeline stage
+ * (see stage.c), it runs on a thread in the shell instead, and that
+ * thread takes over stdin and stdout.
+ *
  * If the first argument starts with a '.'
  * or a '/', it is an absolute path and can
  * execute as-is.
@@ -197,63 +663,99 @@ static struct job *find_job(int job_id, bool remove) {
  * stdout is a file handle to be used for standard out.
  *
  * If stdin and stdout are not 0 and 1, respectively, they will be
- * closed in the parent process before this function returns.
+ * closed in the parent process before this function returns, whether
+ * or not the child could be started.
  *
  * job_id is the job_id allocated in create_job
  *
- * Returns 0 on success, -errno on failure to create the child.
+ * The child reports an execve() failure down a close-on-exec pipe,
+ * which the parent reads until the child has either exec'd (closing
+ * it) or sent the errno; the failed child is then reaped here, so the
+ * caller sees the exact error before it starts any later stage.
+ *
+ * Returns 0 on success, -errno on failure to create the child or to
+ * execute the command.
  *
  */
 int run_command(char *args[MAX_ARGS], int stdin, int stdout, int job_id) {
     /* Lab 2: Your code here */
-    int rv = 0;
+    char *cmd = NULL;
+    char **envp;
+    int exec_status[2];
+    int rv = 0, err;
+
     struct job *s = find_job(job_id, false);
-    if (s == NULL) {
-        return -errno;
+    if (s == NULL || args[0] == NULL) {
+        rv = -EINVAL;
+        goto out;
     }
-    extern char **environ;
-    if (args[0] == NULL) {
-        return -errno;
+
+    stage_func func =
+        s->watchdog || s->limits ? NULL : find_stage_builtin(args);
+    if (func != NULL) {
+        struct stream in, out;
+        stream_init_fd(&in, stdin, false);
+        stream_init_fd(&out, stdout, true);
+        return run_stage(func, args, &in, &out, job_id);
     }
-    char *cmd = NULL;
-    if (args[0] == "/" || args[0] == ".") {
+
+    trace_event(TRACE_LOOKUP, 'B', args[0], 0, 0);
+    if (args[0][0] == '/' || args[0][0] == '.') {
         cmd = strdup(args[0]);
+        rv = cmd ? 0 : -ENOMEM;
     } else {
-        int i = 0;
-        while (path_table[i] != NULL) {
-            // Calculate required buffer size
-            size_t path_len = strlen(path_table[i]) + strlen(args[0]) + 2;
-            char *tmp = malloc(path_len);
-
-            if (!tmp) {
-                return -ENOMEM;
-            }
-
-            // Build path safely
-            snprintf(tmp, path_len, "%s/%s", path_table[i], args[0]);
-
-            // Check if executable exists and is accessible
-            if (access(tmp, X_OK) == 0) {
-                cmd = strdup(tmp);
-                free(tmp);
-                break;
-            }
-
-            free(tmp);
-            i++;
-        }
+        cmd = find_command(args[0], &rv);
     }
+    trace_event(TRACE_LOOKUP, 'E', args[0], -rv, 0);
     if (cmd == NULL) {
-        return -ENOENT;
+        goto out;
     }
 
+    // Built in the parent, so it is only rebuilt when it changes
+    envp = get_envp();
+    struct kiddo *k = (struct kiddo *)malloc(sizeof(struct kiddo));
+    if (envp == NULL || k == NULL) {
+        free(k);
+        rv = -ENOMEM;
+        goto out;
+    }
+    metric_add(METRIC_JOB_ALLOCS, 1);
+    metric_add(METRIC_JOB_BYTES, sizeof(struct kiddo));
+    if (pipe2(exec_status, O_CLOEXEC) < 0) {
+        rv = -errno;
+        free(k);
+        goto out;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &k->start);
+
+    trace_event(TRACE_FORK, 'B', args[0], 0, 0);
+    metric_add(METRIC_FORKS, 1);
     pid_t pid = fork();
 
     if (pid < 0) {
-        return -errno;
+        rv = -errno;
+        trace_event(TRACE_FORK, 'E', args[0], rv, 0);
+        close(exec_status[0]);
+        close(exec_status[1]);
+        free(k);
+        goto out;
     }
 
     if (pid == 0) {
+        if (s->watchdog) {
+            watchdog_child(s->watchdog);
+        }
+        // Rather than run unconstrained
+        if (s->limits && apply_limits(s->limits) < 0) {
+            _exit(126);
+        }
+        if (s->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(s->cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+
         if (stdin != STDIN_FILENO) {
             dup2(stdin, STDIN_FILENO);
             close(stdin);
@@ -264,25 +766,114 @@ int run_command(char *args[MAX_ARGS], int stdin, int stdout, int job_id) {
             close(stdout);
         }
 
-        execve(cmd, args, environ);
-        _exit(-errno);
+        // Only the parent traces and counts: the child just reports
+        execve(cmd, args, envp);
+        err = errno;
+        write(exec_status[1], &err, sizeof(err));
+        _exit(127);
     }
+    trace_event(TRACE_FORK, 'E', args[0], pid, 0);
+    close(exec_status[1]);
 
-    free(cmd);
+    // Nothing to read (end of file) once the child has exec'd
+    while ((rv = read(exec_status[0], &err, sizeof(err))) < 0 &&
+           errno == EINTR) {
+    }
+    close(exec_status[0]);
+    if (rv == sizeof(err)) {
+        trace_event(TRACE_EXEC_FAIL, 'i', cmd, err, 0);
+        metric_add(METRIC_EXEC_FAILURES, 1);
+        waitpid(pid, NULL, 0);
+        free(k);
+        rv = -err;
+        goto out;
+    }
+    trace_event(TRACE_EXEC, 'i', cmd, 0, 0);
+    rv = 0;
+
+    // Without a pidfd, it is just waited on without a deadline
+    if (s->watchdog) {
+        watchdog_add(s->watchdog, pid);
+    }
 
-    struct kiddo *k = (struct kiddo *)malloc(sizeof(struct kiddo));
     k->pid = pid;
     k->next = s->kidlets;
     s->kidlets = k;
 
+out:
+    free(cmd);
     if (stdin != STDIN_FILENO) close(stdin);
     if (stdout != STDOUT_FILENO) close(stdout);
 
-    // Suppress the compiler warning that find_job is not used in the starer
-    // code. You may remove this line if/when you use find_job in your code.
-    //(void)&find_job;
+    return rv;
+}
 
-    return 0;
+/* Find the task running a job's first stage, for profiling it through
+ * /proc.  *thread is set if it is a builtin stage thread in the shell,
+ * in which case the id is a thread id (0 if it has not started yet).
+ *
+ * Returns the process or thread id, or -EINVAL if there is no such job.
+ */
+pid_t job_task(int job_id, bool *thread) {
+    struct job *s = find_job(job_id, false);
+    struct kiddo *k;
+
+    if (s == NULL || s->kidlets == NULL) {
+        return -EINVAL;
+    }
+    for (k = s->kidlets; k->next; k = k->next)
+        ;
+    *thread = k->pid == 0;
+    return k->pid ? k->pid : k->tid;
+}
+
+/* Check, without reaping anything, whether every process and thread of
+ * a job has finished.
+ */
+bool job_finished(int job_id) {
+    struct job *s = find_job(job_id, false);
+
+    for (struct kiddo *k = s ? s->kidlets : NULL; k; k = k->next) {
+        if (k->pid == 0) {
+            if (!k->done) {
+                return false;
+            }
+        } else {
+            siginfo_t info = {0};
+            if (waitid(P_PID, k->pid, &info, WEXITED | WNOHANG | WNOWAIT) ==
+                    0 &&
+                info.si_pid == 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void timeval_add(struct timeval *sum, const struct timeval *tv) {
+    sum->tv_sec += tv->tv_sec;
+    sum->tv_usec += tv->tv_usec;
+    if (sum->tv_usec >= 1000000) {
+        sum->tv_sec++;
+        sum->tv_usec -= 1000000;
+    }
+}
+
+/* Add the resource usage ru into sum.  Counters add up; the maximum
+ * resident set size is the largest of the two.
+ */
+void rusage_add(struct rusage *sum, const struct rusage *ru) {
+    timeval_add(&sum->ru_utime, &ru->ru_utime);
+    timeval_add(&sum->ru_stime, &ru->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss) {
+        sum->ru_maxrss = ru->ru_maxrss;
+    }
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_inblock += ru->ru_inblock;
+    sum->ru_oublock += ru->ru_oublock;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
 }
 
 /* Wait for the job to complete and free internal bookkeeping
@@ -299,26 +890,82 @@ int run_command(char *args[MAX_ARGS], int stdin, int stdout, int job_id) {
  * Returns zero on success, -errno on error.
  */
 int wait_on_job(int job_id, int *exit_code) {
+    return wait_on_job_stats(job_id, exit_code, NULL);
+}
+
+/* Like wait_on_job(), but also reports what the job cost in *stats
+ * (if not NULL): the resource usage of its processes from wait4()
+ * (for a builtin stage thread, its own getrusage(RUSAGE_THREAD)),
+ * summed, and the time from starting the first one to reaping the
+ * last.
+ *
+ * Returns zero on success, -errno on error.  The job is freed either
+ * way: after a wait4() error, the rest of its stages are still reaped.
+ */
+int wait_on_job_stats(int job_id, int *exit_code, struct job_stats *stats) {
     struct job *s = find_job(job_id, true);
+    struct job_stats st;
+    bool started = false;
+    int err = 0;
+
     if (s == NULL) {
-        return -errno;
+        return -EINVAL;
     }
+    memset(&st, 0, sizeof(st));
 
     int last_status = 0;
     while (s->kidlets != NULL) {
+        struct kiddo *k = s->kidlets;
+        struct timespec wait_start, wait_end;
         int status;
-        pid_t res = waitpid(s->kidlets->pid, &status, 0);
-        if (res < 0) {
-            return -errno;
+
+        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+        if (k->pid == 0) {
+            void *rv;
+            pthread_join(k->thread, &rv);
+            status = W_EXITCODE((int)(long)rv & 0xff, 0);
+        } else {
+            // Until it exits, stopping it at the deadline
+            if (s->watchdog) {
+                watchdog_wait(s->watchdog, k->pid);
+            }
+            if (wait4(k->pid, &status, 0, &k->ru) < 0) {
+                err = err ? err : -errno;
+                s->kidlets = k->next;
+                free(k);
+                continue;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &wait_end);
+        metric_wait(&wait_start, &wait_end);
+        trace_event(TRACE_REAP, 'i', NULL, k->pid ? k->pid : k->tid, status);
+
+        if (!started || k->start.tv_sec < st.start.tv_sec ||
+            (k->start.tv_sec == st.start.tv_sec &&
+             k->start.tv_nsec < st.start.tv_nsec)) {
+            st.start = k->start;
+            started = true;
         }
+        rusage_add(&st.ru, &k->ru);
 
         last_status = status;
-        struct kiddo *next = s->kidlets->next;
-        free(s->kidlets);
-        s->kidlets = next;
+        s->kidlets = k->next;
+        free(k);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &st.end);
+    if (!started) {
+        st.start = st.end;  // Nothing was started
     }
 
-    *exit_code = last_status;
     free(s);
+    if (err) {
+        return err;
+    }
+    if (exit_code) {
+        *exit_code = last_status;
+    }
+    if (stats) {
+        *stats = st;
+    }
     return 0;
-}
\ No newline at end of file
+}
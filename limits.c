@@ -0,0 +1,278 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements resource limits and priorities for pipelines:
+ * "limit -t 60 -v 2G -N 10 cmd | ..." caps the CPU time and address
+ * space of each of the pipeline's processes, and lowers their priority,
+ * so that a runaway stage cannot starve the other jobs the shell runs.
+ * "limit ..." on its own sets shell-wide defaults, which every later
+ * pipeline gets unless it overrides them.
+ *
+ *   -t secs     CPU seconds (RLIMIT_CPU), then SIGXCPU
+ *   -v bytes    address space (RLIMIT_AS), e.g., 512M or 2G
+ *   -n count    open files (RLIMIT_NOFILE)
+ *   -u count    processes of the user (RLIMIT_NPROC)
+ *   -N nice     nice value, -20 (highest priority) to 19
+ *   -I class    I/O class: idle, be[:level] or rt[:level], level 0-7
+ *
+ * A count may be "unlimited".  Limits are set as both the soft and
+ * hard limit, so a process cannot raise them again (the hard CPU limit
+ * is a second later, so SIGXCPU comes first).  They are applied
+ * in the child, between fork() and execve() (see run_command()); a
+ * child that cannot apply them reports why and exits with status 126
+ * rather than run unconstrained.  Stages are not run as builtin
+ * threads under limits, since they would apply to the whole shell.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// What a struct job_limits sets
+#define LIMIT_CPU (1 << 0)
+#define LIMIT_AS (1 << 1)
+#define LIMIT_NOFILE (1 << 2)
+#define LIMIT_NPROC (1 << 3)
+#define LIMIT_NICE (1 << 4)
+#define LIMIT_IO (1 << 5)
+
+// From linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static const char *io_classes[] = {"none", "rt", "be", "idle"};
+
+static struct job_limits default_limits;
+
+struct rlimit_opt {
+    char opt;
+    unsigned bit;
+    int resource;
+    const char *name;
+    size_t offset;  // Of the value in struct job_limits
+};
+
+static const struct rlimit_opt rlimit_opts[] = {
+    {'t', LIMIT_CPU, RLIMIT_CPU, "cpu", offsetof(struct job_limits, cpu)},
+    {'v', LIMIT_AS, RLIMIT_AS, "as", offsetof(struct job_limits, as)},
+    {'n', LIMIT_NOFILE, RLIMIT_NOFILE, "nofile",
+     offsetof(struct job_limits, nofile)},
+    {'u', LIMIT_NPROC, RLIMIT_NPROC, "nproc",
+     offsetof(struct job_limits, nproc)},
+    {0, 0, 0, NULL, 0}};
+
+static rlim_t *limit_value(struct job_limits *l, const struct rlimit_opt *o) {
+    return (rlim_t *)((char *)l + o->offset);
+}
+
+/* Parse a count such as "64", "512M" or "unlimited".
+ *
+ * Returns 0 and sets *val on success, -EINVAL if it is malformed.
+ */
+static int parse_count(const char *str, rlim_t *val) {
+    unsigned long long n;
+    char *end;
+
+    if (strcmp(str, "unlimited") == 0) {
+        *val = RLIM_INFINITY;
+        return 0;
+    }
+    if (*str < '0' || *str > '9') {
+        return -EINVAL;
+    }
+    n = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'k':
+        case 'K':
+            n <<= 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            n <<= 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            n <<= 30;
+            end++;
+            break;
+    }
+    if (*end != '\0') {
+        return -EINVAL;
+    }
+    *val = n;
+    return 0;
+}
+
+/* Parse an I/O class, "idle", "be[:level]" or "rt[:level]".
+ *
+ * Returns 0 on success, -EINVAL if it is malformed.
+ */
+static int parse_io_class(const char *str, int *class, int *level) {
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t)(colon - str) : strlen(str);
+
+    *level = 4;  // The kernel's default within a class
+    for (*class = 1; *class < 4; ++*class) {
+        if (strlen(io_classes[*class]) == len &&
+            strncmp(str, io_classes[*class], len) == 0) {
+            break;
+        }
+    }
+    if (*class == 4) {
+        return -EINVAL;
+    }
+    if (colon) {
+        char *end;
+        *level = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || *level < 0 || *level > 7) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* Parse the limit options at the start of args (after "limit") into *l,
+ * stopping at the first word that is not one.
+ *
+ * Returns the number of words parsed, or -EINVAL (after reporting it)
+ * if an option is malformed.
+ */
+int parse_limits(char **args, struct job_limits *l) {
+    int n = 0;
+
+    while (args[n] && args[n][0] == '-' && args[n][1] != '\0' &&
+           args[n][2] == '\0') {
+        const struct rlimit_opt *o;
+        char opt = args[n][1];
+        char *arg = args[n + 1], *end;
+
+        if (arg == NULL) {
+            break;
+        }
+        for (o = rlimit_opts; o->opt && o->opt != opt; o++) {
+        }
+        if (o->opt) {
+            if (parse_count(arg, limit_value(l, o)) < 0) {
+                dprintf(2, "limit: %s: invalid %s limit\n", arg, o->name);
+                return -EINVAL;
+            }
+            l->set |= o->bit;
+        } else if (opt == 'N') {
+            l->nice = strtol(arg, &end, 10);
+            if (end == arg || *end != '\0' || l->nice < -20 || l->nice > 19) {
+                dprintf(2, "limit: %s: invalid nice value\n", arg);
+                return -EINVAL;
+            }
+            l->set |= LIMIT_NICE;
+        } else if (opt == 'I') {
+            if (parse_io_class(arg, &l->io_class, &l->io_level) < 0) {
+                dprintf(2, "limit: %s: invalid I/O class\n", arg);
+                return -EINVAL;
+            }
+            l->set |= LIMIT_IO;
+        } else {
+            break;
+        }
+        n += 2;
+    }
+    return n;
+}
+
+/* Set *l to the shell-wide defaults, overridden by whatever over sets.
+ */
+void merge_limits(struct job_limits *l, const struct job_limits *over) {
+    *l = default_limits;
+    for (const struct rlimit_opt *o = rlimit_opts; o->opt; o++) {
+        if (over->set & o->bit) {
+            *limit_value(l, o) = *limit_value((struct job_limits *)over, o);
+        }
+    }
+    if (over->set & LIMIT_NICE) {
+        l->nice = over->nice;
+    }
+    if (over->set & LIMIT_IO) {
+        l->io_class = over->io_class;
+        l->io_level = over->io_level;
+    }
+    l->set |= over->set;
+}
+
+/* Add the limits l sets to the shell-wide defaults; with l NULL, clear
+ * them.
+ */
+void set_default_limits(const struct job_limits *l) {
+    if (l == NULL) {
+        memset(&default_limits, 0, sizeof(default_limits));
+        return;
+    }
+    merge_limits(&default_limits, l);
+}
+
+/* Print the shell-wide defaults to fd. */
+void print_limits(int fd) {
+    struct job_limits *l = &default_limits;
+
+    if (l->set == 0) {
+        dprintf(fd, "limit: none\n");
+        return;
+    }
+    for (const struct rlimit_opt *o = rlimit_opts; o->opt; o++) {
+        if (l->set & o->bit) {
+            rlim_t val = *limit_value(l, o);
+            if (val == RLIM_INFINITY) {
+                dprintf(fd, "%-7s unlimited\n", o->name);
+            } else {
+                dprintf(fd, "%-7s %llu\n", o->name, (unsigned long long)val);
+            }
+        }
+    }
+    if (l->set & LIMIT_NICE) {
+        dprintf(fd, "%-7s %d\n", "nice", l->nice);
+    }
+    if (l->set & LIMIT_IO) {
+        dprintf(fd, "%-7s %s:%d\n", "io", io_classes[l->io_class],
+                l->io_level);
+    }
+}
+
+/* Apply l to the calling process.  Called in the child, before
+ * execve().
+ *
+ * Returns 0 on success, -errno (after reporting it) on failure.
+ */
+int apply_limits(const struct job_limits *l) {
+    for (const struct rlimit_opt *o = rlimit_opts; o->opt; o++) {
+        if (l->set & o->bit) {
+            rlim_t val = *limit_value((struct job_limits *)l, o);
+            struct rlimit rl = {val, val};
+            if (o->resource == RLIMIT_CPU && val != RLIM_INFINITY) {
+                rl.rlim_max = val + 1;
+            }
+            if (setrlimit(o->resource, &rl) < 0) {
+                int rv = -errno;
+                dprintf(2, "limit: %s: %s\n", o->name, strerror(-rv));
+                return rv;
+            }
+        }
+    }
+    if ((l->set & LIMIT_NICE) && setpriority(PRIO_PROCESS, 0, l->nice) < 0) {
+        int rv = -errno;
+        dprintf(2, "limit: nice: %s\n", strerror(-rv));
+        return rv;
+    }
+    if ((l->set & LIMIT_IO) &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                l->io_class << IOPRIO_CLASS_SHIFT | l->io_level) < 0) {
+        int rv = -errno;
+        dprintf(2, "limit: io: %s\n", strerror(-rv));
+        return rv;
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the shell's always-on counters, reported by
+ * the "stats" builtin.  Each counter is a relaxed atomic add, cheap
+ * enough to leave on every hot path; builtin stage threads count
+ * concurrently with the shell.
+ *
+ * The counters live in shared anonymous memory, so that a forked copy
+ * of the shell running a substitution (see subst.c) counts into them
+ * too.
+ *
+ * Output is one "name value" line per counter, plus a cumulative
+ * histogram of how long the shell waited on each stage (in the style
+ * of a Prometheus text exposition, so a scraper can read it as is).
+ * "stats -o file -i secs" rewrites the file every secs seconds from a
+ * background thread, replacing it atomically so a reader never sees a
+ * partial dump.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Wait latency buckets: up to 1us, 2us, 4us, ... 2^(N-2)us, and more
+#define WAIT_BUCKETS 28
+
+struct metrics {
+    _Atomic unsigned long counters[METRIC_COUNT];
+    _Atomic unsigned long waits[WAIT_BUCKETS];
+    _Atomic unsigned long wait_us;  // Sum of all waits
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+    [METRIC_LINES] = "lines_parsed",
+    [METRIC_TOKENS] = "tokens",
+    [METRIC_PARSE_ALLOCS] = "parse_allocs",
+    [METRIC_PARSE_BYTES] = "parse_alloc_bytes",
+    [METRIC_JOB_ALLOCS] = "job_allocs",
+    [METRIC_JOB_BYTES] = "job_alloc_bytes",
+    [METRIC_PATH_HITS] = "path_cache_hits",
+    [METRIC_PATH_MISSES] = "path_cache_misses",
+    [METRIC_ACCESS_CALLS] = "access_calls",
+    [METRIC_FORKS] = "forks",
+    [METRIC_EXEC_FAILURES] = "exec_failures",
+    [METRIC_ENVP_BUILDS] = "envp_builds",
+    [METRIC_SUBSTITUTIONS] = "substitutions",
+    [METRIC_CACHE_HITS] = "cache_hits",
+    [METRIC_CACHE_MISSES] = "cache_misses",
+    [METRIC_PATH_DB_HITS] = "path_db_hits",
+    [METRIC_TIMEOUTS] = "timeouts",
+};
+
+// Until metrics_init(), or if it fails, the counters are private
+static struct metrics local_metrics;
+static struct metrics *metrics = &local_metrics;
+
+// Periodic dump settings, shared with the dump thread
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+static char *dump_path;
+static double dump_interval;
+static bool dump_running;
+
+/* Move the counters into shared memory, so forked copies of the shell
+ * can count too.  Called once, at startup; calling it again does
+ * nothing.
+ *
+ * Returns 0 on success, -errno on failure (counting still works).
+ */
+int metrics_init(void) {
+    if (metrics != &local_metrics) {
+        return 0;
+    }
+    struct metrics *m = mmap(NULL, sizeof(struct metrics),
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        return -errno;
+    }
+    memcpy(m, metrics, sizeof(*m));
+    metrics = m;
+    return 0;
+}
+
+void metric_add(enum metric_id id, unsigned long n) {
+    atomic_fetch_add_explicit(&metrics->counters[id], n,
+                              memory_order_relaxed);
+}
+
+/* Count one wait on a stage, from start to end (CLOCK_MONOTONIC). */
+void metric_wait(const struct timespec *start, const struct timespec *end) {
+    long us = (end->tv_sec - start->tv_sec) * 1000000 +
+              (end->tv_nsec - start->tv_nsec) / 1000;
+    int b = 0;
+
+    while (b < WAIT_BUCKETS - 1 && us > (1l << b)) {
+        b++;
+    }
+    atomic_fetch_add_explicit(&metrics->waits[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->wait_us, us > 0 ? us : 0,
+                              memory_order_relaxed);
+}
+
+void metrics_reset(void) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        atomic_store(&metrics->counters[i], 0);
+    }
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+        atomic_store(&metrics->waits[i], 0);
+    }
+    atomic_store(&metrics->wait_us, 0);
+}
+
+/* Write every counter to fd, one per line. */
+void print_metrics(int fd) {
+    unsigned long total = 0;
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        dprintf(fd, "thsh_%s %lu\n", metric_names[i],
+                atomic_load(&metrics->counters[i]));
+    }
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+        unsigned long n = atomic_load(&metrics->waits[i]);
+        total += n;
+        if (n == 0 && i < WAIT_BUCKETS - 1) {
+            continue;  // Cumulative, so empty buckets add nothing
+        }
+        if (i < WAIT_BUCKETS - 1) {
+            dprintf(fd, "thsh_wait_us_bucket{le=\"%ld\"} %lu\n", 1l << i,
+                    total);
+        } else {
+            dprintf(fd, "thsh_wait_us_bucket{le=\"+Inf\"} %lu\n", total);
+        }
+    }
+    dprintf(fd, "thsh_wait_us_sum %lu\n", atomic_load(&metrics->wait_us));
+    dprintf(fd, "thsh_wait_us_count %lu\n", total);
+}
+
+/* Replace the file at path with a dump of the counters.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int write_metrics(const char *path) {
+    char tmp[PATH_MAX];
+    int fd, rv = 0;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -ENAMETOOLONG;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    print_metrics(fd);
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        rv = -errno;
+        unlink(tmp);
+    }
+    return rv;
+}
+
+static void *dump_thread(void *arg) {
+    pthread_mutex_lock(&dump_lock);
+    while (dump_path) {
+        struct timespec when;
+
+        write_metrics(dump_path);
+        clock_gettime(CLOCK_REALTIME, &when);
+        when.tv_sec += (long)dump_interval;
+        when.tv_nsec += (dump_interval - (long)dump_interval) * 1e9;
+        if (when.tv_nsec >= 1000000000) {
+            when.tv_sec++;
+            when.tv_nsec -= 1000000000;
+        }
+        // Woken early if the settings change
+        pthread_cond_timedwait(&dump_cond, &dump_lock, &when);
+    }
+    dump_running = false;
+    pthread_mutex_unlock(&dump_lock);
+    return NULL;
+}
+
+/* Write the counters to path every interval seconds, from a background
+ * thread; a NULL path stops it.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int set_metrics_dump(const char *path, double interval) {
+    char *copy = NULL;
+    int rv = 0;
+
+    if (path && (copy = strdup(path)) == NULL) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&dump_lock);
+    free(dump_path);
+    dump_path = copy;
+    dump_interval = interval;
+    if (copy && !dump_running) {
+        pthread_t thread;
+        sigset_t all, old;
+
+        // Leave signals to the shell's own thread
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        rv = -pthread_create(&thread, NULL, dump_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (rv == 0) {
+            pthread_detach(thread);
+            dump_running = true;
+        } else {
+            free(dump_path);
+            dump_path = NULL;
+        }
+    }
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&dump_lock);
+    return rv;
+}
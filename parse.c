@@ -79,6 +79,42 @@ int read_one_line(int input_fd, char *buf, size_t size) {
     return count;
 }
 
+/* As read_one_line(), but into *buf (*size bytes, from malloc(), or
+ * NULL), which grows as needed, so that a line may be any length.
+ * Like read_one_line(), it reads a byte at a time, so as not to take
+ * input meant for the commands that follow.
+ *
+ * Returns the length of the line (with its newline), 0 at the end of
+ * the input, or -errno.
+ */
+int read_line(int input_fd, char **buf, size_t *size) {
+    size_t count = 0;
+
+    for (;;) {
+        ssize_t rv;
+
+        if (count + 2 > *size) {
+            size_t bigger = *size ? *size * 2 : MAX_INPUT;
+            char *grown = realloc(*buf, bigger);
+            if (grown == NULL) {
+                return -ENOMEM;
+            }
+            *buf = grown;
+            *size = bigger;
+        }
+        rv = read(input_fd, *buf + count, 1);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        } else if (rv < 0) {
+            return -errno;
+        } else if (rv == 0 || (*buf)[count++] == '\n') {
+            break;
+        }
+    }
+    (*buf)[count] = '\0';
+    return count > INT_MAX ? -E2BIG : (int)count;
+}
+
 /* Challenge: Check is a file matches a glob.
  *
  * This function takes in a simple file glob (such as '*.c')
@@ -133,6 +169,178 @@ static int expand_glob(char *glob, char **buf, size_t *bufsize,
     return rv;
 }
 
+/* The length of the command substitution "$(...)" at the start of p
+ * (len bytes), through its matching ')'.  Parentheses inside quotes
+ * or nested substitutions, or escaped, do not end it.
+ *
+ * Its '$' may have been parsed into QUOTED_SUBST.
+ *
+ * Returns the length, or 0 if p does not start a substitution or it
+ * is not closed within len bytes.
+ */
+size_t subst_length(const char *p, size_t len) {
+    int depth = 0;
+
+    if (len < 2 || (p[0] != '$' && p[0] != QUOTED_SUBST) || p[1] != '(') {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        size_t q = quote_length(p + i, len - i);
+        if (q > 0) {
+            i += q - 1;
+        } else if (p[i] == '(') {
+            depth++;
+        } else if (p[i] == ')' && --depth == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* The length of the quoted string ('...' or "...") or the backslash
+ * escape at the start of p (len bytes), through its closing quote or
+ * escaped character.  Inside double quotes, a backslash escapes the
+ * next character, and a command substitution may hold quotes of its
+ * own; inside single quotes, nothing is special.
+ *
+ * Returns the length (len, if it is not closed), or 0 if p does not
+ * start one.
+ */
+size_t quote_length(const char *p, size_t len) {
+    size_t i, sub;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (p[0] == '\\') {
+        return len < 2 ? 1 : 2;
+    }
+    if (p[0] == '\'') {
+        const char *close = memchr(p + 1, '\'', len - 1);
+        return close ? (size_t)(close - p) + 1 : len;
+    }
+    if (p[0] != '"') {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if (p[i] == '"') {
+            return i + 1;
+        } else if (p[i] == '\\') {
+            i++;
+        } else if ((sub = subst_length(p + i, len - i)) > 0) {
+            i += sub - 1;
+        }
+    }
+    return len;
+}
+
+// A backslash just before a newline joins the two lines
+static bool is_continuation(const char *p, size_t len) {
+    return len >= 2 && p[0] == '\\' && p[1] == '\n';
+}
+
+/* Does the line (length bytes in buf) end inside quotes, or in a
+ * backslash, so that the next line continues it?  A backslash that is
+ * itself escaped does not count, and neither does a quote in a comment.
+ */
+bool line_continues(const char *buf, size_t length) {
+    size_t n = 0, q;
+
+    for (size_t i = 0; i < length && buf[i] != '#'; i++) {
+        if (is_continuation(buf + i, length - i)) {
+            i++;
+        } else if ((q = quote_length(buf + i, length - i)) > 0) {
+            // Unclosed, it runs to the end
+            if (buf[i] != '\\' && i + q == length &&
+                (q < 2 || buf[length - 1] != buf[i])) {
+                return true;
+            }
+            i += q - 1;
+        }
+    }
+    if (length < 2 || buf[length - 1] != '\n') {
+        return false;
+    }
+    while (n < length - 1 && buf[length - 2 - n] == '\\') {
+        n++;
+    }
+    return n % 2 == 1;
+}
+
+// Count a word about to be copied out of the line
+static void count_token(size_t len) {
+    metric_add(METRIC_TOKENS, 1);
+    metric_add(METRIC_PARSE_ALLOCS, 1);
+    metric_add(METRIC_PARSE_BYTES, len + 1);
+}
+
+// Append c to the word being compacted at *w, writing only if it
+// changes the line (so a mapped script is not copied needlessly)
+static void put(char **w, char c) {
+    if (**w != c) {
+        **w = c;
+    }
+    (*w)++;
+}
+
+/* Copy the quoted string or escape at the start of p (len bytes, see
+ * quote_length()) to *w, without its quotes and backslashes.  A quoted
+ * '$' becomes QUOTED_DOLLAR, so it is not expanded; a substitution
+ * inside double quotes is kept whole, to be run when it is expanded,
+ * but its '$' becomes QUOTED_SUBST, so its output is not split.
+ *
+ * Returns the number of bytes of p used, or -EINVAL if it is not
+ * closed.
+ */
+static ssize_t unquote(char *p, size_t len, char **w) {
+    size_t n = quote_length(p, len), i, sub;
+    char quote = p[0];  // The word may be compacted over it
+
+    if (quote == '\\') {
+        if (n == 2) {
+            put(w, p[1] == '$' ? QUOTED_DOLLAR : p[1]);
+        } else {
+            put(w, '\\');  // Nothing left to escape
+        }
+        return n;
+    }
+    if (n < 2 || p[n - 1] != quote) {
+        return -EINVAL;
+    }
+    for (i = 1; i < n - 1; i++) {
+        if (quote == '\'') {
+            put(w, p[i] == '$' ? QUOTED_DOLLAR : p[i]);
+        } else if (p[i] == '\\' && p[i + 1] != '\0' &&
+                   strchr("$`\"\\\n", p[i + 1])) {
+            i++;
+            if (p[i] != '\n') {
+                put(w, p[i] == '$' ? QUOTED_DOLLAR : p[i]);
+            }
+        } else if ((sub = subst_length(p + i, n - 1 - i)) > 0) {
+            put(w, QUOTED_SUBST);
+            for (size_t j = 1; j < sub; j++) {
+                put(w, p[i + j]);
+            }
+            i += sub - 1;
+        } else {
+            put(w, p[i]);
+        }
+    }
+    // ...or if the last quote was escaped
+    return i == n - 1 ? (ssize_t)n : -EINVAL;
+}
+
+// Free the words parsed so far, after an error
+static int parse_failed(char *commands[MAX_PIPELINE][MAX_ARGS], int rv) {
+    for (int i = 0; i < MAX_PIPELINE && commands[i][0]; i++) {
+        for (int j = 0; j < MAX_ARGS && commands[i][j]; j++) {
+            free(commands[i][j]);
+            commands[i][j] = NULL;
+        }
+    }
+    return rv;
+}
+
 /* Parse one line of input.
  *
  * This function should populate a two-dimensional array of commands
@@ -169,7 +377,19 @@ static int expand_glob(char *glob, char **buf, size_t *bufsize,
  * commands[1] = ['\0']
  *
  * This function should ignore anything after the '#' character, as
- * this is a comment.
+ * this is a comment.  A backslash just before a newline is dropped
+ * with it, so the next line continues the word (or line).
+ *
+ * Quoting follows POSIX: a backslash makes the next character
+ * literal; nothing is special between single quotes; and between
+ * double quotes, only "$(...)" and a backslash before '$', '`', '"',
+ * '\\' or a newline are.  For instance, "echo 'a  b'\\ c" parses as
+ * ["echo", "a  b c"].  Each word is compacted in place in inbuf as its
+ * quotes and backslashes are dropped, then copied out once, so a word
+ * may be as long as the line.  A quoted '$' is left as QUOTED_DOLLAR,
+ * which expansion turns back into a '$' (see vars.c), and the '$' of a
+ * double-quoted "$(...)" as QUOTED_SUBST, whose output expansion does
+ * not split.
  *
  * Finally, the command should identify file redirection characters ('<' and
  * '>'). The string right after these tokens should be returned using the
@@ -190,9 +410,13 @@ static int expand_glob(char *glob, char **buf, size_t *bufsize,
  * You do not need to handle redirection of other handles (e.g., "foo 2>&1
  * out.txt").
  *
- * inbuf: a NULL-terminated buffer of input.
+ * A command substitution, "$(...)", is kept whole as (part of) one
+ * word, whatever it contains; it is run when the word is expanded (see
+ * vars.c).  One that is not closed on the line is an error.
+ *
+ * inbuf: a buffer of input, which need not be NULL-terminated.
  *        This buffer may be changed by the function
- *        (e.g., changing some characters to \0).
+ *        (e.g., compacting a quoted word).
  *
  * length: the length of the string in inbuf.  Should be
  *         less than the size of inbuf.
@@ -220,122 +444,110 @@ int parse_line(char *inbuf, size_t length,
     // code. It is only here for a challenge problem, and this line may be
     // ignored. You may remove this line if/when you use expand_glob in your
     // code.
+    (void)&expand_glob;
 
     int ind = 0;
     int arg = 0;
-    char *temp = (char *)malloc(sizeof(char) * 1024);
-    if (temp == NULL) {
-        perror("malloc");
-        return -errno;
-    }
+    // The word being read, compacted in place: it starts at word, and
+    // its next character goes at w (never past the one being read)
+    char *word = NULL, *w = NULL;
+    char **redirect = NULL;  // The word is this file, not an argument
 
     if (length == 0) {
         return -1;
     }
 
-    temp[0] = '\0';
+    for (size_t i = 0; i <= length; i++) {
+        char c = i < length ? inbuf[i] : '\0';
 
-    for (int i = 0; i < length; i++) {
-        // printf("%c\n", inbuf[i]);
-        // Logic if char is pipe;
-        if (inbuf[i] == '#') {
-            break;  // Ignore anything after the '#' character
-        } else if (inbuf[i] == '|') {
-            // Check if there was command before pipe, if not, throw error
-            if (temp != NULL && strlen(temp) > 0) {
-                commands[ind][arg] = strdup(temp);
-                if (commands[ind][arg] == NULL) {
-                    perror("strdup");
-                    free(temp);
-                    return -errno;
-                }
-                commands[ind][++arg] =
-                    '\0';  // Null-terminate the current command
-                arg = 0;
-                ind += 1;
-                temp[0] = '\0';  // Clear temp for the next command
-            } else if (i != 0) {
-                commands[ind][++arg] = '\0';
-                arg = 0;
-                ind += 1;
-                temp[0] = '\0';
+        if (c == '\\' && i + 1 < length && inbuf[i + 1] == '\n') {
+            i++;  // Dropped, joining the lines
+            continue;
+        }
+        if (c == '\\' || c == '\'' || c == '"') {
+            if (word == NULL) {
+                word = w = inbuf + i;
             }
-        } else if (inbuf[i] == '>' || inbuf[i] == '<') {
-            if (strlen(temp) > 0) {
-                commands[ind][arg] = strdup(temp);
-                if (commands[ind][arg] == NULL) {
-                    perror("strdup");
-                    free(temp);
-                    return -errno;
-                }
-                commands[ind][++arg] = '\0';
-                arg = 0;
-                ind += 1;
-                temp[0] = '\0';
+            ssize_t n = unquote(inbuf + i, length - i, &w);
+            if (n < 0) {
+                return parse_failed(commands, n);
             }
-            // Sets temp to file input or output
-            char sign = inbuf[i];
-            i++;
-            while (i < length && (inbuf[i] == ' ' || inbuf[i] == '\t')) {
-                i++;
+            i += n - 1;
+            continue;
+        }
+        if (c == '$' && i + 1 < length && inbuf[i + 1] == '(') {
+            size_t n = subst_length(inbuf + i, length - i);
+            if (n == 0) {
+                return parse_failed(commands, -EINVAL);
             }
-            int j = 0;
-            while (i < length && inbuf[i] != ' ' && inbuf[i] != '\t' &&
-                   inbuf[i] != '\n') {
-                temp[j++] = inbuf[i++];
+            if (word == NULL) {
+                word = w = inbuf + i;
             }
-            temp[j] = '\0';
-            // Sets input or output
-            if (sign == '>') {
-                *outfile = strdup(temp);
-                if (*outfile == NULL) {
-                    perror("strdup");
-                    free(temp);
-                    return -errno;
-                }
-            } else {
-                *infile = strdup(temp);
-                if (*infile == NULL) {
-                    perror("strdup");
-                    free(temp);
-                    return -errno;
-                }
+            for (size_t j = 0; j < n; j++) {
+                put(&w, inbuf[i + j]);
             }
-            temp[0] = '\0';
-
-        } else if (inbuf[i] == ' ' || inbuf[i] == '\n') {
-            if (strlen(temp) > 0) {
-                commands[ind][arg] = strdup(temp);
-                if (commands[ind][arg] == NULL) {
-                    perror("strdup");
-                    free(temp);
-                    return -errno;
-                }
-                arg++;
-                temp[0] = '\0';
+            i += n - 1;
+            continue;
+        }
+        if (c != ' ' && c != '\t' && c != '\n' && c != '|' && c != '<' &&
+            c != '>' && c != '#' && c != '\0') {
+            if (word == NULL) {
+                word = w = inbuf + i;
             }
-        } else {
-            size_t len = strlen(temp);
-            temp[len] = inbuf[i];
-            temp[len + 1] = '\0';
+            put(&w, c);
+            continue;
         }
-    }
 
-    if (strlen(temp) > 0) {
-        commands[ind][arg] = strdup(temp);
-        if (commands[ind][arg] == NULL) {
-            perror("strdup");
-            free(temp);
-            return -errno;
+        // The end of a word
+        if (word) {
+            char *copy = strndup(word, w - word);
+            if (copy == NULL) {
+                return parse_failed(commands, -ENOMEM);
+            }
+            count_token(w - word);
+            if (redirect) {
+                free(*redirect);
+                *redirect = copy;
+                redirect = NULL;
+            } else if (arg == MAX_ARGS - 1) {
+                free(copy);
+                return parse_failed(commands, -E2BIG);
+            } else {
+                commands[ind][arg++] = copy;
+                commands[ind][arg] = NULL;
+            }
+            word = NULL;
         }
-        commands[ind][++arg] = '\0';
-    }
 
-    commands[ind + 1][0] = '\0';
+        if (c == '|' || c == '<' || c == '>' || c == '#' || c == '\0') {
+            // A redirection needs its file, and a stage its command
+            if (redirect || (c == '|' && arg == 0)) {
+                return parse_failed(commands, -EINVAL);
+            }
+        }
+        if (c == '|') {
+            if (ind == MAX_PIPELINE - 2) {
+                return parse_failed(commands, -E2BIG);
+            }
+            ind++;
+            arg = 0;
+        } else if (c == '<') {
+            redirect = infile;
+        } else if (c == '>') {
+            redirect = outfile;
+        } else if (c == '#' || c == '\0') {
+            break;  // Ignore anything after the '#' character
+        }
+    }
 
-    free(temp);
+    // "ls |" is missing a stage, but "" or a comment is just empty
+    if (arg == 0 && ind > 0) {
+        return parse_failed(commands, -EINVAL);
+    }
+    commands[ind + (arg > 0)][0] = NULL;
+    metric_add(METRIC_LINES, 1);
 
-    return ind + 1;
+    return arg > 0 ? ind + 1 : 0;
 }
 
 // int main() {
@@ -377,4 +589,91 @@ int parse_line(char *inbuf, size_t length,
 //     }
 
 //     return 0;
-// }
\ No newline at end of file
+// }
+
+/* Split a line into a list of pipelines joined by ';', '&&' and '||',
+ * without copying it.  Each item records the operator joining it to
+ * the one before (LIST_SEQ for the first) and where its text lies in
+ * inbuf, ready to be handed to parse_line().
+ *
+ * Operators that are quoted or escaped, or inside a command
+ * substitution, and anything after a '#', are left alone.
+ * A trailing ';' is allowed, but an empty pipeline between operators
+ * (or before or after '&&' / '||') is an error.
+ *
+ * Returns the number of items (0 for a blank line), or -EINVAL on a
+ * syntax error, or -E2BIG if there are more than MAX_LIST.
+ */
+int parse_list(char *inbuf, size_t length, struct list_item items[MAX_LIST]) {
+    int n = 0;
+    size_t start = 0, i, q;
+    enum list_op op = LIST_SEQ;
+    bool blank = true;  // Nothing but spaces since the last operator
+
+    for (i = 0; i <= length; i++) {
+        char c = i < length ? inbuf[i] : '\0';
+        int oplen = 0;
+        enum list_op next = LIST_SEQ;
+
+        if (is_continuation(inbuf + i, length - i)) {
+            i++;  // Like a space
+            continue;
+        }
+        if ((q = quote_length(inbuf + i, length - i)) > 0) {
+            i += q - 1;  // Unclosed; left for parse_line to reject
+            blank = false;
+            continue;
+        }
+        if (c == '$' && i + 1 < length && inbuf[i + 1] == '(') {
+            size_t n = subst_length(inbuf + i, length - i);
+            i += n ? n - 1 : 0;  // Unclosed; left for parse_line to reject
+            blank = false;
+            continue;
+        }
+        if (c == '#' || c == '\0') {
+            length = i;
+        } else if (c == ';') {
+            oplen = 1;
+        } else if (c == '&' && i + 1 < length && inbuf[i + 1] == '&') {
+            oplen = 2;
+            next = LIST_AND;
+        } else if (c == '|' && i + 1 < length && inbuf[i + 1] == '|') {
+            oplen = 2;
+            next = LIST_OR;
+        } else {
+            if (c != ' ' && c != '\t' && c != '\n') {
+                blank = false;
+            }
+            continue;
+        }
+
+        // End of an item
+        if (blank) {
+            // Only "cmd ;" at the very end may leave nothing behind
+            if (n > 0 && op == LIST_SEQ && oplen == 0) {
+                break;
+            }
+            if (n > 0 || oplen > 0) {
+                return -EINVAL;
+            }
+            break;  // Blank line
+        }
+        if (n == MAX_LIST) {
+            return -E2BIG;
+        }
+        items[n].op = op;
+        items[n].start = inbuf + start;
+        items[n].length = i - start;
+        n++;
+
+        if (oplen == 0) {
+            break;
+        }
+        op = next;
+        i += oplen - 1;
+        start = i + 1;
+        blank = true;
+    }
+
+    return n;
+}
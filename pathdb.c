@@ -0,0 +1,341 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the on-disk copy of the path cache (see
+ * find_command() in jobs.c), so that a new shell can run its first
+ * commands without searching PATH for them.  Our job runner starts
+ * many short-lived shells, each of which would otherwise probe every
+ * PATH directory with access() for each command it runs.
+ *
+ * The file, "paths" in the cache directory (see cache_dir()), is
+ * mapped read-only and looked up in place, without being loaded:
+ *
+ *   header:  "THSHPDB1", number of PATH directories, number of slots,
+ *            file size
+ *   dirs:    per PATH directory, its mtime and the offset of its name
+ *   slots:   an open-addressed hash table of (name, path) offsets,
+ *            0 for an empty slot
+ *   strings: NUL-terminated names and paths
+ *
+ * It is only used if it was written for the same PATH, and no PATH
+ * directory has changed (been modified, e.g., by installing a program)
+ * since: a new program earlier in PATH could shadow a cached one.
+ * Adding or removing an entry in a directory updates its mtime, so
+ * checking these costs one stat() per directory, rather than an
+ * access() per directory per command.
+ *
+ * When the shell exits, the commands it found by searching are added
+ * to the file, which is rewritten and renamed into place.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+#define PATHDB_MAGIC "THSHPDB1"
+#define PATHDB_FILE "paths"
+
+struct pathdb_header {
+    char magic[8];
+    uint32_t ndirs;
+    uint32_t nslots;  // A power of two
+    uint32_t size;
+    uint32_t unused;
+};
+
+struct pathdb_dir {
+    int64_t sec, nsec;  // mtime, or 0 if it did not exist
+    uint32_t name;
+    uint32_t unused;
+};
+
+struct pathdb_slot {
+    uint32_t name, path;
+};
+
+// The mapped file, if it is valid for the path table
+static char *map;
+static size_t map_size;
+
+// The path table and its mtimes when the file was checked
+static char **dirs;
+static int ndirs;
+static struct timespec *mtimes;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+static struct pathdb_header *header(void) {
+    return (struct pathdb_header *)map;
+}
+
+static struct pathdb_dir *dir_table(void) {
+    return (struct pathdb_dir *)(map + sizeof(struct pathdb_header));
+}
+
+static struct pathdb_slot *slot_table(void) {
+    return (struct pathdb_slot *)(dir_table() + header()->ndirs);
+}
+
+static int file_path(char path[PATH_MAX]) {
+    char dir[PATH_MAX];
+    int rv = cache_dir(dir);
+
+    if (rv < 0) {
+        return rv;
+    }
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, PATHDB_FILE) >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+void pathdb_close(void) {
+    if (map) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+    free(mtimes);
+    mtimes = NULL;
+    dirs = NULL;
+    ndirs = 0;
+}
+
+/* Is the mapped file one written for the path table as it is now? */
+static bool map_valid(void) {
+    struct pathdb_header *h = header();
+    struct pathdb_dir *d;
+
+    if (map_size < sizeof(*h) ||
+        memcmp(h->magic, PATHDB_MAGIC, sizeof(h->magic)) != 0 ||
+        h->size != map_size || h->ndirs != ndirs || h->nslots == 0 ||
+        (h->nslots & (h->nslots - 1)) != 0 ||
+        sizeof(*h) + h->ndirs * sizeof(struct pathdb_dir) +
+                (size_t)h->nslots * sizeof(struct pathdb_slot) >
+            map_size ||
+        map[map_size - 1] != '\0') {
+        return false;  // Every offset in range is then NUL-terminated
+    }
+    d = dir_table();
+    for (int i = 0; i < ndirs; i++) {
+        if (d[i].name >= map_size || strcmp(map + d[i].name, dirs[i]) != 0 ||
+            d[i].sec != mtimes[i].tv_sec || d[i].nsec != mtimes[i].tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Map the file for the path table table (NULL-terminated), if there is
+ * one and it is still valid.  The table must outlive the mapping.
+ *
+ * Returns 0 if the file was mapped, -errno if not (the shell just
+ * searches PATH as usual).
+ */
+int pathdb_open(char **table) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, rv;
+
+    pathdb_close();
+    while (table[ndirs]) {
+        ndirs++;
+    }
+    mtimes = calloc(ndirs ? ndirs : 1, sizeof(struct timespec));
+    if (mtimes == NULL) {
+        ndirs = 0;
+        return -ENOMEM;
+    }
+    dirs = table;
+    for (int i = 0; i < ndirs; i++) {
+        if (stat(dirs[i], &st) == 0) {
+            mtimes[i] = st.st_mtim;
+        }
+    }
+
+    rv = file_path(path);
+    if (rv < 0) {
+        return rv;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        rv = st.st_size == 0 ? -EINVAL : -errno;
+        close(fd);
+        return rv;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return -errno;
+    }
+    map_size = st.st_size;
+    if (!map_valid()) {
+        munmap(map, map_size);
+        map = NULL;
+        return -ESTALE;
+    }
+    return 0;
+}
+
+/* Look name up in the mapped file.
+ *
+ * Returns where it was found, or NULL if it is not there.
+ */
+const char *pathdb_lookup(const char *name) {
+    struct pathdb_slot *slots;
+    uint32_t mask;
+
+    if (map == NULL) {
+        return NULL;
+    }
+    slots = slot_table();
+    mask = header()->nslots - 1;
+    for (uint32_t i = hash_name(name) & mask, n = 0; n <= mask;
+         i = (i + 1) & mask, n++) {
+        if (slots[i].name == 0 || slots[i].name >= map_size ||
+            slots[i].path >= map_size) {
+            break;
+        }
+        if (strcmp(map + slots[i].name, name) == 0) {
+            return map + slots[i].path;
+        }
+    }
+    return NULL;
+}
+
+/* Add a string to the buffer being written at *len.  Returns its
+ * offset.
+ */
+static uint32_t add_string(char *buf, size_t *len, const char *s) {
+    uint32_t off = *len;
+    size_t n = strlen(s) + 1;
+
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return off;
+}
+
+static void add_entry(char *buf, size_t *len, struct pathdb_slot *slots,
+                      uint32_t nslots, const char *name, const char *path) {
+    uint32_t i = hash_name(name) & (nslots - 1);
+
+    while (slots[i].name != 0) {
+        i = (i + 1) & (nslots - 1);
+    }
+    slots[i].name = add_string(buf, len, name);
+    slots[i].path = add_string(buf, len, path);
+}
+
+/* Rewrite the file with the n commands in names, found at paths,
+ * along with those already in it.  Nothing is written if n is 0, or if
+ * the path table has changed since pathdb_open().
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int pathdb_save(char **names, char **paths, int n) {
+    struct pathdb_header h = {.ndirs = ndirs};
+    struct pathdb_slot *slots;
+    struct pathdb_dir *d;
+    char path[PATH_MAX], tmp[PATH_MAX], *buf;
+    uint32_t old_slots = map ? header()->nslots : 0;
+    size_t size, len;
+    int total = n, fd, rv;
+
+    if (n == 0 || mtimes == NULL) {
+        return 0;
+    }
+    rv = file_path(path);
+    if (rv < 0) {
+        return rv;
+    }
+
+    // Keep the table at most half full
+    size = sizeof(h) + ndirs * sizeof(*d);
+    for (uint32_t i = 0; i < old_slots; i++) {
+        struct pathdb_slot *s = &slot_table()[i];
+        if (s->name) {
+            total++;
+            size += strlen(map + s->name) + strlen(map + s->path) + 2;
+        }
+    }
+    for (h.nslots = 16; h.nslots < 2 * (uint32_t)total; h.nslots *= 2) {
+    }
+    size += h.nslots * sizeof(*slots);
+    for (int i = 0; i < ndirs; i++) {
+        size += strlen(dirs[i]) + 1;
+    }
+    for (int i = 0; i < n; i++) {
+        size += strlen(names[i]) + strlen(paths[i]) + 2;
+    }
+    if (size > UINT32_MAX) {
+        return -E2BIG;
+    }
+
+    buf = calloc(1, size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(h.magic, PATHDB_MAGIC, sizeof(h.magic));
+    h.size = size;
+    memcpy(buf, &h, sizeof(h));
+    d = (struct pathdb_dir *)(buf + sizeof(h));
+    slots = (struct pathdb_slot *)(d + ndirs);
+    len = (char *)(slots + h.nslots) - buf;
+
+    for (int i = 0; i < ndirs; i++) {
+        d[i].sec = mtimes[i].tv_sec;
+        d[i].nsec = mtimes[i].tv_nsec;
+        d[i].name = add_string(buf, &len, dirs[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        add_entry(buf, &len, slots, h.nslots, names[i], paths[i]);
+    }
+    for (uint32_t i = 0; i < old_slots; i++) {
+        struct pathdb_slot *s = &slot_table()[i];
+        if (s->name) {
+            add_entry(buf, &len, slots, h.nslots, map + s->name,
+                      map + s->path);
+        }
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid()) >=
+        (int)sizeof(tmp)) {
+        free(buf);
+        return -ENAMETOOLONG;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(buf);
+        return -errno;
+    }
+    if (write(fd, buf, size) != (ssize_t)size) {
+        rv = errno ? -errno : -EIO;
+    }
+    if (close(fd) < 0 && rv == 0) {
+        rv = -errno;
+    }
+    if (rv == 0 && rename(tmp, path) < 0) {
+        rv = -errno;
+    }
+    if (rv < 0) {
+        unlink(tmp);
+    }
+    free(buf);
+    return rv;
+}
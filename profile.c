@@ -0,0 +1,371 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the pipeline profiler behind the "profile"
+ * prefix.  While the pipeline runs, the shell samples every stage
+ * every few milliseconds:
+ *
+ *  - /proc/<pid>/stat for its state and CPU time,
+ *  - /proc/<pid>/io for the bytes it has read and written,
+ *  - the fill level of its input and output pipes (FIONREAD against
+ *    F_GETPIPE_SZ), or rings, for builtin stages.
+ *
+ * A stage that is asleep with an empty input is charged with waiting
+ * on its producer; one asleep with a full output is charged with
+ * waiting on its consumer.  The stage that is rarely waiting on
+ * either is the choke point.
+ *
+ * Builtin stages are threads in the shell, so they are found under
+ * /proc/self/task/<tid> instead.  A thread's entry disappears as soon
+ * as it exits, so its figures are as of the last sample before that.
+ *
+ * It also implements --startup-profile, which times each phase of the
+ * shell's own startup.  Work put off until first needed (finding the
+ * directory, splitting PATH, loading the history) is listed as
+ * deferred, and timed whenever it does first run.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// How often to sample the stages
+#define SAMPLE_NS (10 * 1000 * 1000)
+
+// What we know about one stage so far
+struct stage_profile {
+    double cpu;            // CPU seconds (user + sys)
+    unsigned long rchar;   // Bytes read, by system calls
+    unsigned long wchar;   // Bytes written, by system calls
+    size_t ring_in;        // Bytes consumed from an input ring
+    size_t ring_out;       // Bytes produced into an output ring
+    double empty_wait;     // Seconds asleep with nothing to read
+    double full_wait;      // Seconds asleep with no room to write
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read a small /proc file into buf.
+ *
+ * Returns the length read, or -errno on failure.
+ */
+static int read_proc(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0) {
+        return -errno;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -errno;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* Read the state letter and CPU seconds out of a stat file.
+ *
+ * Returns the state (e.g., 'R', 'S'), or 0 if the task is gone.
+ */
+static char read_stat(const char *dir, double *cpu) {
+    static long ticks;
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+    char state;
+
+    if (ticks == 0) {
+        ticks = sysconf(_SC_CLK_TCK);
+    }
+    snprintf(path, sizeof(path), "%s/stat", dir);
+    if (read_proc(path, buf, sizeof(buf)) <= 0) {
+        return 0;
+    }
+
+    // The command name may contain spaces; fields resume after the ')'
+    char *p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2,
+                            "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                            "%lu %lu",
+                            &state, &utime, &stime) != 3) {
+        return 0;
+    }
+    *cpu = (double)(utime + stime) / ticks;
+    return state;
+}
+
+static void read_io(const char *dir, struct stage_profile *prof) {
+    char path[64], buf[512];
+    char *p;
+
+    if (snprintf(path, sizeof(path), "%s/io", dir) >= (int)sizeof(path) ||
+        read_proc(path, buf, sizeof(buf)) <= 0) {
+        return;
+    }
+    if ((p = strstr(buf, "rchar: "))) {
+        prof->rchar = strtoul(p + 7, NULL, 10);
+    }
+    if ((p = strstr(buf, "wchar: "))) {
+        prof->wchar = strtoul(p + 7, NULL, 10);
+    }
+}
+
+/* How full a pipe is: fd is a descriptor for it in the task's own
+ * descriptor table (a process's 0 or 1), or in the shell's (a builtin
+ * stage thread's).  A process's pipe is opened through /proc just for
+ * the check, and closed again so as not to hold it open.
+ *
+ * Returns the bytes buffered and sets *size to the capacity, or
+ * returns -1 if the fill level is unknown.
+ */
+static int pipe_fill(pid_t pid, bool thread, int fd, int *size) {
+    char path[64];
+    int n = -1;
+
+    if (!thread) {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+        fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+    *size = fcntl(fd, F_GETPIPE_SZ);
+    if (*size < 0 || ioctl(fd, FIONREAD, &n) < 0) {
+        n = -1;
+    }
+    if (!thread) {
+        close(fd);
+    }
+    return n;
+}
+
+/* Take one sample of stage p, charging any waiting to the dt seconds
+ * since the last sample.
+ */
+static void sample(struct stage_probe *p, struct stage_profile *prof,
+                   double dt) {
+    char dir[64];
+    bool thread;
+    pid_t pid = job_task(p->job_id, &thread);
+    size_t written, read, size;
+    bool empty = false, full = false;
+    double cpu;
+    int cap, fill;
+
+    // Ring counts outlive the stage, so they are always current
+    if (p->in_ring) {
+        ring_stats(p->in_ring, &written, &read, &size);
+        prof->ring_in = read;
+        empty = written == read;
+    }
+    if (p->out_ring) {
+        ring_stats(p->out_ring, &written, &read, &size);
+        prof->ring_out = written;
+        full = written - read == size;
+    }
+
+    if (pid <= 0) {
+        return;
+    }
+    if (thread) {
+        snprintf(dir, sizeof(dir), "/proc/self/task/%d", pid);
+    } else {
+        snprintf(dir, sizeof(dir), "/proc/%d", pid);
+    }
+
+    char state = read_stat(dir, &cpu);
+    if (state == 0) {
+        return;
+    }
+    prof->cpu = cpu;
+    read_io(dir, prof);
+
+    if (p->in_fd >= 0) {
+        empty = pipe_fill(pid, thread, p->in_fd, &cap) == 0;
+    }
+    if (p->out_fd >= 0) {
+        fill = pipe_fill(pid, thread, p->out_fd, &cap);
+        // Writers block once there is not a page's worth of room left
+        full = fill >= 0 && fill + PIPE_BUF > cap;
+    }
+
+    if (state == 'S' || state == 'D') {
+        if (empty) {
+            prof->empty_wait += dt;
+        } else if (full) {
+            prof->full_wait += dt;
+        }
+    }
+}
+
+static void print_report(int fd, struct stage_probe probes[],
+                         struct stage_profile profs[], int nstages,
+                         double elapsed, bool final) {
+    dprintf(fd, "profile %s %.3fs:\n", final ? "finished after" : "at",
+            elapsed);
+    dprintf(fd, "%-6s %9s %13s %13s %10s %10s  %s\n", "stage", "cpu",
+            "bytes in", "bytes out", "in wait", "out wait", "command");
+    for (int i = 0; i < nstages; i++) {
+        struct stage_profile *prof = &profs[i];
+        char cmd[40];
+        int len = 0;
+
+        cmd[0] = '\0';
+        for (int j = 0; probes[i].args[j] && len < (int)sizeof(cmd); j++) {
+            len += snprintf(cmd + len, sizeof(cmd) - len, "%s%s",
+                            j ? " " : "", probes[i].args[j]);
+        }
+        dprintf(fd, "%-6d %9.3f %13lu %13lu %10.3f %10.3f  %s\n", i,
+                prof->cpu, prof->rchar + prof->ring_in,
+                prof->wchar + prof->ring_out, prof->empty_wait,
+                prof->full_wait, cmd);
+    }
+}
+
+/* Sample the stages of a running pipeline until all of them have
+ * finished (without reaping them), then print a report on stderr.
+ *
+ * probes describes each stage; see struct stage_probe.
+ *
+ * interval: if positive, also print a report every interval seconds
+ * while the pipeline runs.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int profile_pipeline(struct stage_probe probes[], int nstages,
+                     double interval) {
+    struct stage_profile *profs = calloc(nstages, sizeof(*profs));
+    struct timespec pause = {0, SAMPLE_NS};
+    double start = now(), last = start, next_report = start + interval;
+    bool finished = false;
+
+    if (profs == NULL) {
+        return -ENOMEM;
+    }
+
+    while (!finished) {
+        double t = now();
+
+        // Check before sampling, so the last sample sees the final counts
+        finished = true;
+        for (int i = 0; i < nstages; i++) {
+            finished &= job_finished(probes[i].job_id);
+        }
+        for (int i = 0; i < nstages; i++) {
+            sample(&probes[i], &profs[i], t - last);
+        }
+        last = t;
+
+        if (interval > 0 && t >= next_report && !finished) {
+            print_report(STDERR_FILENO, probes, profs, nstages, t - start,
+                         false);
+            next_report += interval;
+        }
+        if (!finished) {
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    print_report(STDERR_FILENO, probes, profs, nstages, now() - start, true);
+    free(profs);
+    return 0;
+}
+
+// --startup-profile: how long each phase of startup takes
+static bool startup_profile;
+static bool startup_reported;  // The report is done; deferred phases follow
+static struct timespec startup_last;
+static double startup_skip;  // Deferred phases run since startup_last
+static double startup_total;
+
+static const char *deferred_names[DEFER_COUNT] = {
+    [DEFER_CWD] = "init_cwd",
+    [DEFER_PATH] = "path table",
+    [DEFER_HISTORY] = "load_history",
+};
+static bool deferred_run[DEFER_COUNT];
+
+/* Start reporting the phases of startup, which began at start (a
+ * CLOCK_MONOTONIC time).
+ */
+void startup_profile_begin(const struct timespec *start) {
+    startup_profile = true;
+    startup_last = *start;
+}
+
+/* Report that the startup phase name has finished, and how long it
+ * took (since the last one, or main()).  A NULL name ends the report,
+ * listing the deferred phases (see deferred_phase()) not yet run.
+ */
+void startup_phase(const char *name) {
+    struct timespec now;
+    double us;
+
+    if (!startup_profile) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - startup_last.tv_sec) * 1e6 +
+         (now.tv_nsec - startup_last.tv_nsec) / 1e3 - startup_skip;
+    startup_last = now;
+    startup_skip = 0;
+    startup_total += us;
+    if (name) {
+        dprintf(2, "startup: %-16s %9.1f us\n", name, us);
+        return;
+    }
+    dprintf(2, "startup: %-16s %9.1f us\n", "total", startup_total);
+    for (int i = 0; i < DEFER_COUNT; i++) {
+        if (!deferred_run[i]) {
+            dprintf(2, "startup: %-16s  deferred\n", deferred_names[i]);
+        }
+    }
+    startup_profile = false;
+    startup_reported = true;
+}
+
+/* Run fn, the startup work id that was put off until it was needed,
+ * and with --startup-profile, report how long it took the first time:
+ * as a phase of its own if startup is still being reported, or after
+ * the report (which listed it as deferred) if not.
+ *
+ * Returns what fn returns.
+ */
+int deferred_phase(enum deferred_phase id, int (*fn)(void)) {
+    struct timespec start, end;
+    double us;
+    int rv;
+
+    if (deferred_run[id] || !(startup_profile || startup_reported)) {
+        deferred_run[id] = true;
+        return fn();
+    }
+    deferred_run[id] = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rv = fn();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    us = (end.tv_sec - start.tv_sec) * 1e6 +
+         (end.tv_nsec - start.tv_nsec) / 1e3;
+    if (startup_profile) {
+        // A phase of its own, so not also part of the one it ran in
+        startup_skip += us;
+        startup_total += us;
+        dprintf(2, "startup: %-16s %9.1f us\n", deferred_names[id], us);
+    } else {
+        dprintf(2, "startup: %-16s %9.1f us (deferred)\n",
+                deferred_names[id], us);
+    }
+    return rv;
+}
@@ -0,0 +1,289 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements recording a session (thsh -w file) and
+ * replaying it (thsh -R file), so that shell changes can be measured
+ * against real command streams rather than synthetic loops.
+ *
+ * A recording is a text file with one command line per record:
+ *
+ *   <start>\t<duration>\t<status>\t<cwd>\t<line>\n
+ *
+ * where start is when the line began running, in nanoseconds since
+ * the session started, duration is how long it took in nanoseconds,
+ * and status is what the shell reported for it (-errno for a line
+ * that could not be parsed or expanded).  The line comes last
+ * so that it may contain tabs; a command spanning several lines (e.g.,
+ * a loop) is one record, with its newlines (and backslashes) escaped
+ * as "\n" (and "\\").
+ *
+ * Replay drives each line back through the shell's own parse and run
+ * path (the same one the interactive loop uses), from the recorded
+ * directory, either at the recorded pace or as fast as possible, and
+ * reports each line's recorded and replayed time on stderr.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+static int record_fd = -1;
+static struct timespec record_epoch;
+
+// The line being run: when it started, and from where
+static struct timespec record_start_time;
+static char record_cwd[PATH_MAX];
+static char *record_copy;  // As it was before it was parsed
+static int record_length;
+
+static long long ns_between(const struct timespec *start,
+                            const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000ll +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+/* Start recording every command line to the file at path.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int record_open(const char *path) {
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (record_fd < 0) {
+        return -errno;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &record_epoch);
+    return 0;
+}
+
+/* Note that a command line is about to run, if recording. */
+void record_start(void) {
+    if (record_fd < 0) {
+        return;
+    }
+    if (getcwd(record_cwd, sizeof(record_cwd)) == NULL) {
+        strcpy(record_cwd, ".");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &record_start_time);
+}
+
+/* Note the command line (length bytes) about to be run, if recording.
+ * It is copied, as parsing it compacts its quoted words in place (see
+ * parse_line()).
+ */
+void record_text(const char *line, int length) {
+    char *copy;
+
+    if (record_fd < 0) {
+        return;
+    }
+    copy = realloc(record_copy, length > 0 ? length : 1);
+    if (copy == NULL) {
+        record_length = 0;
+        return;
+    }
+    memcpy(copy, line, length);
+    record_copy = copy;
+    record_length = length;
+}
+
+/* Record the command line given to record_text(), which just finished
+ * with the given status, if recording.
+ */
+void record_line(int status) {
+    struct timespec end;
+    const char *line = record_copy;
+    int length = record_length;
+
+    if (record_fd < 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    while (length > 0 && line[length - 1] == '\n') {
+        length--;
+    }
+    dprintf(record_fd, "%lld\t%lld\t%d\t%s\t",
+            ns_between(&record_epoch, &record_start_time),
+            ns_between(&record_start_time, &end), status, record_cwd);
+    for (int i = 0; i < length; i++) {
+        if (line[i] == '\n') {
+            dprintf(record_fd, "\\n");
+        } else if (line[i] == '\\') {
+            dprintf(record_fd, "\\\\");
+        } else {
+            dprintf(record_fd, "%c", line[i]);
+        }
+    }
+    dprintf(record_fd, "\n");
+}
+
+void record_close(void) {
+    if (record_fd >= 0) {
+        close(record_fd);
+        record_fd = -1;
+    }
+    free(record_copy);
+    record_copy = NULL;
+}
+
+/* Parse one record, in place.  The cwd and line are left pointing into
+ * rec, which is NUL-terminated at the end of the line.
+ *
+ * Returns 0 on success, -EINVAL if the record is malformed.
+ */
+static int parse_record(char *rec, long long *start, long long *duration,
+                        int *status, char **cwd, char **line) {
+    char *p = rec, *tab;
+
+    if (sscanf(p, "%lld\t%lld\t%d\t", start, duration, status) != 3) {
+        return -EINVAL;
+    }
+    for (int i = 0; i < 3; i++) {
+        p = strchr(p, '\t');
+        if (p == NULL) {
+            return -EINVAL;
+        }
+        p++;
+    }
+    tab = strchr(p, '\t');
+    if (tab == NULL) {
+        return -EINVAL;
+    }
+    *tab = '\0';
+    *cwd = p;
+    *line = tab + 1;
+
+    // Undo the escaping of newlines and backslashes
+    char *in = *line, *out = *line;
+    while (*in) {
+        if (in[0] == '\\' && (in[1] == 'n' || in[1] == '\\')) {
+            *out++ = in[1] == 'n' ? '\n' : '\\';
+            in += 2;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    return 0;
+}
+
+/* Move to dir if the shell is not there already, as cd would. */
+static void replay_cwd(const char *dir) {
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) && strcmp(cwd, dir) == 0) {
+        return;
+    }
+    if (chdir(dir) < 0) {
+        dprintf(2, "replay: cd %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    init_cwd();
+}
+
+/* Replay the recording at path through run, which parses and runs one
+ * line (see thsh.c).  With fast, lines run back to back; otherwise
+ * each starts at its recorded offset from the start of the replay.
+ *
+ * Returns 0 on success, -errno if the recording cannot be read.
+ */
+int replay(const char *path, bool fast,
+           int (*run)(char *line, int length, int *status)) {
+    struct timespec epoch, start, end;
+    long long recorded_total = 0, replayed_total = 0;
+    int lines = 0, mismatches = 0;
+    struct stat st;
+    char *map, *rec, *next;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -errno;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    // Private, so records can be split up in place
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+               0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+
+    dprintf(2, "%5s %12s %12s %7s %6s  %s\n", "line", "recorded ms",
+            "replayed ms", "ratio", "status", "command");
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+
+    for (rec = map; rec < map + st.st_size; rec = next) {
+        long long offset, duration, took;
+        int status, replayed = 0;
+        char *cwd, *line, *cmd;
+
+        next = memchr(rec, '\n', map + st.st_size - rec);
+        if (next == NULL) {
+            break;  // Truncated last record
+        }
+        *next++ = '\0';
+        if (parse_record(rec, &offset, &duration, &status, &cwd, &line) < 0) {
+            dprintf(2, "replay: skipping malformed record %d\n", lines + 1);
+            continue;
+        }
+        lines++;
+
+        if (!fast) {
+            struct timespec when = epoch;
+            when.tv_sec += offset / 1000000000;
+            when.tv_nsec += offset % 1000000000;
+            if (when.tv_nsec >= 1000000000) {
+                when.tv_sec++;
+                when.tv_nsec -= 1000000000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+        }
+        replay_cwd(cwd);
+
+        // The parser is handed a copy with its newline, as if just read
+        int length = asprintf(&cmd, "%s\n", line);
+        if (length < 0) {
+            munmap(map, st.st_size);
+            return -ENOMEM;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int rv = run(cmd, length, &replayed);
+        if (rv < 0) {
+            replayed = rv;  // Not parsed or expanded; recorded as such
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free(cmd);
+        trace_flush();
+
+        took = ns_between(&start, &end);
+        recorded_total += duration;
+        replayed_total += took;
+        mismatches += replayed != status;
+        // Only the first line of a multi-line command
+        dprintf(2, "%5d %12.3f %12.3f %7.2f %6s  %.*s\n", lines,
+                duration / 1e6, took / 1e6,
+                duration ? (double)took / duration : 0.0,
+                replayed == status ? "same" : "DIFF",
+                (int)strcspn(line, "\n"), line);
+    }
+
+    dprintf(2, "%5d %12.3f %12.3f %7.2f %6d  total (status differs)\n",
+            lines, recorded_total / 1e6, replayed_total / 1e6,
+            recorded_total ? (double)replayed_total / recorded_total : 0.0,
+            mismatches);
+    munmap(map, st.st_size);
+    return 0;
+}
@@ -0,0 +1,241 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements a single-producer, single-consumer byte ring
+ * that connects two adjacent builtin pipeline stages (both threads in
+ * the shell), so bytes move between them without a kernel pipe.
+ *
+ * The producer only ever advances tail and the consumer only ever
+ * advances head, so neither side takes a lock.  Each side keeps a
+ * private copy of the other's index and only reloads it when the ring
+ * looks full (or empty), which keeps the two cache lines from bouncing
+ * on every call.
+ *
+ * A side that finds the ring empty (or full) spins briefly and then
+ * sleeps on a futex.  The other side bumps a sequence word and only
+ * makes the wake-up system call if a sleeper has announced itself, so
+ * a ring that never runs dry costs no system calls at all.
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Polls of an empty/full ring before going to sleep
+#define SPIN_LIMIT 200
+
+#define CACHE_LINE 64
+
+struct ring {
+    // Producer side
+    _Alignas(CACHE_LINE) _Atomic size_t tail;  // Total bytes written
+    size_t head_cache;                         // Producer's view of head
+    _Atomic uint32_t tail_seq;  // Bumped on publish, consumer sleeps here
+    _Atomic int reader_waiting;
+    _Atomic bool closed;  // Producer is done
+
+    // Consumer side
+    _Alignas(CACHE_LINE) _Atomic size_t head;  // Total bytes consumed
+    size_t tail_cache;                         // Consumer's view of tail
+    _Atomic uint32_t head_seq;  // Bumped on consume, producer sleeps here
+    _Atomic int writer_waiting;
+    _Atomic bool abandoned;  // Consumer is done
+
+    // Shared, read-only after creation
+    _Alignas(CACHE_LINE) size_t size;  // Power of two
+    char *data;
+};
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t val) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Sleep on seq until ready() holds, announcing ourselves in *waiting.
+ *
+ * The waker updates its index, bumps seq and then checks *waiting; we
+ * read seq, set *waiting and then re-check.  Either we see the update,
+ * or the waker sees *waiting and the bumped seq makes FUTEX_WAIT return
+ * at once, so no wake-up is lost.
+ */
+static void ring_sleep(struct ring *r, _Atomic uint32_t *seq,
+                       _Atomic int *waiting,
+                       bool (*ready)(struct ring *r)) {
+    for (int spins = 0; !ready(r); spins++) {
+        if (spins < SPIN_LIMIT) {
+            sched_yield();
+            continue;
+        }
+        uint32_t val = atomic_load(seq);
+        atomic_store(waiting, 1);
+        if (!ready(r)) {
+            futex_wait(seq, val);
+        }
+        atomic_store(waiting, 0);
+    }
+}
+
+static bool readable(struct ring *r) {
+    return atomic_load(&r->tail) != atomic_load_explicit(
+                                        &r->head, memory_order_relaxed) ||
+           atomic_load(&r->closed);
+}
+
+static bool writable(struct ring *r) {
+    return atomic_load(&r->tail) - atomic_load(&r->head) < r->size ||
+           atomic_load(&r->abandoned);
+}
+
+/* Allocate a ring holding at least size bytes (rounded up to a power
+ * of two).
+ *
+ * Returns NULL on failure.
+ */
+struct ring *ring_create(size_t size) {
+    struct ring *r = aligned_alloc(CACHE_LINE, sizeof(struct ring));
+    size_t cap = 4096;
+
+    if (r == NULL) {
+        return NULL;
+    }
+    while (cap < size) {
+        cap <<= 1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->size = cap;
+    r->data = malloc(cap);
+    if (r->data == NULL) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Free a ring once both of its ends are closed. */
+void ring_free(struct ring *r) {
+    if (r) {
+        free(r->data);
+        free(r);
+    }
+}
+
+/* Wait until there is something to read, then return a pointer to the
+ * oldest unread bytes in *data.  Nothing is consumed until
+ * ring_consume(), so the caller may work on the bytes in place.
+ *
+ * Returns the number of contiguous readable bytes (which may be fewer
+ * than are buffered, when the data wraps), or 0 at end of input.
+ */
+size_t ring_peek(struct ring *r, char **data) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (r->tail_cache == head) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (r->tail_cache == head) {
+            ring_sleep(r, &r->tail_seq, &r->reader_waiting, readable);
+            r->tail_cache =
+                atomic_load_explicit(&r->tail, memory_order_acquire);
+            if (r->tail_cache == head) {
+                return 0;  // Closed and drained
+            }
+        }
+    }
+
+    size_t off = head & (r->size - 1);
+    size_t len = r->tail_cache - head;
+    if (len > r->size - off) {
+        len = r->size - off;
+    }
+    *data = r->data + off;
+    return len;
+}
+
+/* Release n bytes returned by ring_peek() back to the producer. */
+void ring_consume(struct ring *r, size_t n) {
+    atomic_store_explicit(
+        &r->head, atomic_load_explicit(&r->head, memory_order_relaxed) + n,
+        memory_order_release);
+    atomic_fetch_add(&r->head_seq, 1);
+    if (atomic_load(&r->writer_waiting)) {
+        futex_wake(&r->head_seq);
+    }
+}
+
+/* Copy len bytes into the ring, waiting for space as needed.
+ *
+ * Returns 0 on success, or -EPIPE if the consumer has gone away.
+ */
+int ring_write(struct ring *r, const char *data, size_t len) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    while (len > 0) {
+        if (atomic_load_explicit(&r->abandoned, memory_order_relaxed)) {
+            return -EPIPE;
+        }
+        if (tail - r->head_cache == r->size) {
+            r->head_cache =
+                atomic_load_explicit(&r->head, memory_order_acquire);
+            if (tail - r->head_cache == r->size) {
+                ring_sleep(r, &r->head_seq, &r->writer_waiting, writable);
+                r->head_cache =
+                    atomic_load_explicit(&r->head, memory_order_acquire);
+                continue;
+            }
+        }
+
+        size_t off = tail & (r->size - 1);
+        size_t n = r->size - (tail - r->head_cache);
+        if (n > r->size - off) {
+            n = r->size - off;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(r->data + off, data, n);
+        data += n;
+        len -= n;
+        tail += n;
+
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        atomic_fetch_add(&r->tail_seq, 1);
+        if (atomic_load(&r->reader_waiting)) {
+            futex_wake(&r->tail_seq);
+        }
+    }
+    return 0;
+}
+
+/* A snapshot of how many bytes have gone into and out of the ring so
+ * far, and how many it can hold; for profiling.
+ */
+void ring_stats(struct ring *r, size_t *written, size_t *read,
+                size_t *size) {
+    *read = atomic_load(&r->head);
+    *written = atomic_load(&r->tail);
+    *size = r->size;
+}
+
+/* The producer is done; the consumer sees end of input once drained. */
+void ring_close_write(struct ring *r) {
+    atomic_store(&r->closed, true);
+    atomic_fetch_add(&r->tail_seq, 1);
+    futex_wake(&r->tail_seq);
+}
+
+/* The consumer is done; further writes fail with -EPIPE. */
+void ring_close_read(struct ring *r) {
+    atomic_store(&r->abandoned, true);
+    atomic_fetch_add(&r->head_seq, 1);
+    futex_wake(&r->head_seq);
+}
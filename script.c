@@ -0,0 +1,529 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the shell's control-flow constructs:
+ *
+ *   if list; then list; [elif list; then list;]... [else list;] fi
+ *   while list; do list; done
+ *   for name [in word...]; do list; done
+ *
+ * where a list is one or more pipelines (or nested constructs) joined
+ * by ';', newlines, '&&' and '||'.
+ *
+ * A construct is parsed once into a tree whose leaves are pipelines
+ * already split into words by parse_line(), so a loop body is not
+ * re-tokenized on each iteration.  Variables in the words are only
+ * expanded as each pipeline runs (see vars.c), and a for loop binds
+ * its variable to each word in turn without copying it.
+ *
+ * Keywords are only recognized as the first word of a command.
+ */
+
+#include <stdlib.h>
+
+#include "thsh.h"
+
+enum node_type { NODE_PIPELINE, NODE_IF, NODE_WHILE, NODE_FOR };
+
+struct node {
+    enum node_type type;
+    enum list_op op;    // How it is joined to the node before it
+    struct node *next;  // The next node in its list
+
+    char *(*commands)[MAX_ARGS];  // Pipeline: parsed words
+    struct node *cond;            // If, while: the condition
+    struct node *body;            // If: then; while, for: the body
+    struct node *orelse;          // If: else (or a nested if, for elif)
+    char *var;                    // For: the variable
+    char **words;                 // For: the words, NULL-terminated
+};
+
+struct cursor {
+    char *p;
+    char *end;
+    bool dry;  // Only check the syntax; the words are not parsed
+};
+
+static int parse_list_until(struct cursor *cur, const char *stop[],
+                            struct node **list);
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Characters that end a word outside quotes
+static bool is_break(char c) {
+    return is_space(c) || c == '\n' || c == ';' || c == '&' || c == '|' ||
+           c == '#';
+}
+
+// A backslash-newline at the cursor, which joins two lines
+static bool at_continuation(struct cursor *cur) {
+    return cur->end - cur->p >= 2 && cur->p[0] == '\\' && cur->p[1] == '\n';
+}
+
+/* Skip spaces, and also newlines, ';' and comments if sep is set. */
+static void skip(struct cursor *cur, bool sep) {
+    while (cur->p < cur->end) {
+        char c = *cur->p;
+        if (at_continuation(cur)) {
+            cur->p += 2;
+        } else if (c == '#') {
+            while (cur->p < cur->end && *cur->p != '\n') {
+                cur->p++;
+            }
+        } else if (is_space(c) || (sep && (c == '\n' || c == ';'))) {
+            cur->p++;
+        } else {
+            break;
+        }
+    }
+}
+
+/* The length of the unquoted word at the cursor (0 if there is none).
+ * A command substitution in it counts as part of the word.
+ */
+static size_t word_len(struct cursor *cur) {
+    size_t n = 0;
+    while (cur->p + n < cur->end && !is_break(cur->p[n]) &&
+           cur->p[n] != '\'' && cur->p[n] != '"') {
+        size_t sub = subst_length(cur->p + n, cur->end - cur->p - n);
+        n += sub ? sub : 1;
+    }
+    return n;
+}
+
+/* Is the word at the cursor the keyword kw? */
+static bool at_keyword(struct cursor *cur, const char *kw) {
+    size_t n = word_len(cur);
+    return n == strlen(kw) && strncmp(cur->p, kw, n) == 0 &&
+           (cur->p + n == cur->end || is_break(cur->p[n]));
+}
+
+static bool at_any(struct cursor *cur, const char *words[]) {
+    for (int i = 0; words && words[i]; i++) {
+        if (at_keyword(cur, words[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Consume the keyword kw, which must be next (after any separators).
+ *
+ * Returns 0, -EAGAIN if the input ends first, or -EINVAL.
+ */
+static int expect(struct cursor *cur, const char *kw) {
+    skip(cur, true);
+    if (cur->p == cur->end) {
+        return -EAGAIN;
+    }
+    if (!at_keyword(cur, kw)) {
+        return -EINVAL;
+    }
+    cur->p += strlen(kw);
+    return 0;
+}
+
+/* Free a list of nodes and everything under them. */
+void free_script(struct node *list) {
+    while (list) {
+        struct node *next = list->next;
+
+        if (list->commands) {
+            for (int i = 0; i < MAX_PIPELINE; i++) {
+                for (int j = 0; j < MAX_ARGS; j++) {
+                    free(list->commands[i][j]);
+                }
+            }
+            free(list->commands);
+        }
+        free_script(list->cond);
+        free_script(list->body);
+        free_script(list->orelse);
+        free(list->var);
+        for (int i = 0; list->words && list->words[i]; i++) {
+            free(list->words[i]);
+        }
+        free(list->words);
+        free(list);
+        list = next;
+    }
+}
+
+/* Move the cursor to the end of a pipeline: the next ';', newline,
+ * '&&', '||' or comment that is not quoted or escaped (or inside a
+ * command substitution).
+ */
+static void skip_pipeline(struct cursor *cur) {
+    size_t n;
+
+    for (; cur->p < cur->end; cur->p++) {
+        char c = *cur->p;
+        if (at_continuation(cur)) {
+            cur->p++;
+        } else if ((n = quote_length(cur->p, cur->end - cur->p)) > 0 ||
+                   (n = subst_length(cur->p, cur->end - cur->p)) > 0) {
+            cur->p += n - 1;
+        } else if (c == ';' || c == '\n' || c == '#' ||
+                   (c == '&' && cur->p + 1 < cur->end && cur->p[1] == '&') ||
+                   (c == '|' && cur->p + 1 < cur->end && cur->p[1] == '|')) {
+            break;
+        }
+    }
+}
+
+/* Parse a pipeline, up to its end (see skip_pipeline()), into its
+ * words.
+ */
+static int parse_pipeline(struct cursor *cur, struct node *node) {
+    char *start = cur->p;
+    char scratch[MAX_INPUT];
+    char *infile = NULL, *outfile = NULL;
+
+    skip_pipeline(cur);
+    node->type = NODE_PIPELINE;
+    if (cur->dry) {
+        return 0;
+    }
+    node->commands = calloc(MAX_PIPELINE, sizeof(*node->commands));
+    if (node->commands == NULL) {
+        return -ENOMEM;
+    }
+    int rv = parse_line(start, cur->p - start, node->commands, &infile,
+                        &outfile, scratch, sizeof(scratch));
+    free(infile);
+    free(outfile);
+    return rv < 0 ? rv : 0;
+}
+
+/* Parse the rest of an if (or elif), through its "fi". */
+static int parse_if(struct cursor *cur, struct node *node) {
+    static const char *then_stop[] = {"then", NULL};
+    static const char *body_stop[] = {"elif", "else", "fi", NULL};
+    static const char *else_stop[] = {"fi", NULL};
+    int rv;
+
+    node->type = NODE_IF;
+    if ((rv = parse_list_until(cur, then_stop, &node->cond)) < 0 ||
+        (rv = expect(cur, "then")) < 0 ||
+        (rv = parse_list_until(cur, body_stop, &node->body)) < 0) {
+        return rv;
+    }
+
+    if (at_keyword(cur, "elif")) {
+        cur->p += 4;
+        node->orelse = calloc(1, sizeof(struct node));
+        if (node->orelse == NULL) {
+            return -ENOMEM;
+        }
+        return parse_if(cur, node->orelse);  // Its fi is ours too
+    }
+    if (at_keyword(cur, "else")) {
+        cur->p += 4;
+        if ((rv = parse_list_until(cur, else_stop, &node->orelse)) < 0) {
+            return rv;
+        }
+    }
+    return expect(cur, "fi");
+}
+
+static int parse_while(struct cursor *cur, struct node *node) {
+    static const char *do_stop[] = {"do", NULL};
+    static const char *done_stop[] = {"done", NULL};
+    int rv;
+
+    node->type = NODE_WHILE;
+    if ((rv = parse_list_until(cur, do_stop, &node->cond)) < 0 ||
+        (rv = expect(cur, "do")) < 0 ||
+        (rv = parse_list_until(cur, done_stop, &node->body)) < 0) {
+        return rv;
+    }
+    return expect(cur, "done");
+}
+
+static int parse_for(struct cursor *cur, struct node *node) {
+    static const char *done_stop[] = {"done", NULL};
+    int rv;
+    size_t n;
+
+    node->type = NODE_FOR;
+    skip(cur, false);
+    n = word_len(cur);
+    if (cur->p == cur->end) {
+        return -EAGAIN;
+    }
+    if (!valid_name(cur->p, n) || (node->var = strndup(cur->p, n)) == NULL) {
+        return -EINVAL;
+    }
+    cur->p += n;
+
+    node->words = calloc(MAX_ARGS, sizeof(char *));
+    if (node->words == NULL) {
+        return -ENOMEM;
+    }
+    skip(cur, false);
+    if (at_keyword(cur, "in")) {
+        // The words are split (and unquoted) as a command's would be
+        char *commands[MAX_PIPELINE][MAX_ARGS] = {{NULL}};
+        char scratch[MAX_INPUT];
+        char *infile = NULL, *outfile = NULL;
+        char *start = cur->p += 2;
+
+        skip_pipeline(cur);
+        if (!cur->dry) {
+            rv = parse_line(start, cur->p - start, commands, &infile,
+                            &outfile, scratch, sizeof(scratch));
+            bool redirected = infile || outfile;
+            free(infile);
+            free(outfile);
+            memcpy(node->words, commands[0], sizeof(commands[0]));
+            if (rv < 0) {
+                return rv;
+            }
+            // e.g., "for x in a | b"
+            if (rv > 1 || redirected) {
+                for (int i = 1; i < rv; i++) {
+                    for (int j = 0; commands[i][j]; j++) {
+                        free(commands[i][j]);
+                    }
+                }
+                return -EINVAL;
+            }
+        }
+    }
+
+    if ((rv = expect(cur, "do")) < 0 ||
+        (rv = parse_list_until(cur, done_stop, &node->body)) < 0) {
+        return rv;
+    }
+    return expect(cur, "done");
+}
+
+/* Parse one command (a pipeline or a construct) into node. */
+static int parse_command(struct cursor *cur, struct node *node) {
+    if (at_keyword(cur, "if")) {
+        cur->p += 2;
+        return parse_if(cur, node);
+    } else if (at_keyword(cur, "while")) {
+        cur->p += 5;
+        return parse_while(cur, node);
+    } else if (at_keyword(cur, "for")) {
+        cur->p += 3;
+        return parse_for(cur, node);
+    }
+    return parse_pipeline(cur, node);
+}
+
+/* Parse a list of commands, up to (but not including) one of the
+ * keywords in stop, or to the end of the input if stop is NULL.
+ *
+ * Returns 0, -EAGAIN if the input ends before a stop keyword (more
+ * lines are needed), or -errno on a syntax error.
+ */
+static int parse_list_until(struct cursor *cur, const char *stop[],
+                            struct node **list) {
+    struct node **tail = list;
+    enum list_op op = LIST_SEQ;
+
+    *list = NULL;
+    for (;;) {
+        // After && or ||, a command must follow (possibly on a new line)
+        skip(cur, op == LIST_SEQ);
+        while (op != LIST_SEQ && cur->p < cur->end && *cur->p == '\n') {
+            cur->p++;
+            skip(cur, false);
+        }
+        if (cur->p == cur->end) {
+            return stop || op != LIST_SEQ ? -EAGAIN : 0;
+        }
+        if (at_any(cur, stop)) {
+            // An empty list, or a dangling operator, is an error
+            return *list == NULL || op != LIST_SEQ ? -EINVAL : 0;
+        }
+
+        struct node *node = calloc(1, sizeof(struct node));
+        if (node == NULL) {
+            return -ENOMEM;
+        }
+        node->op = op;
+        *tail = node;
+        tail = &node->next;
+
+        int rv = parse_command(cur, node);
+        if (rv < 0) {
+            return rv;
+        }
+
+        skip(cur, false);
+        op = LIST_SEQ;
+        if (cur->end - cur->p >= 2 && strncmp(cur->p, "&&", 2) == 0) {
+            op = LIST_AND;
+            cur->p += 2;
+        } else if (cur->end - cur->p >= 2 && strncmp(cur->p, "||", 2) == 0) {
+            op = LIST_OR;
+            cur->p += 2;
+        } else if (cur->p < cur->end && *cur->p != ';' && *cur->p != '\n') {
+            return -EINVAL;  // e.g., "fi | cat"
+        }
+    }
+}
+
+/* Does any command in text start with if, while or for, so that it
+ * needs parse_script() rather than parse_list()?
+ */
+bool is_script(char *text, size_t length) {
+    static const char *keywords[] = {"if", "while", "for", NULL};
+    struct cursor cur = {text, text + length, true};
+    size_t q;
+
+    skip(&cur, true);
+    if (at_any(&cur, keywords)) {
+        return true;
+    }
+    for (; cur.p < cur.end; cur.p++) {
+        char c = *cur.p;
+        if (at_continuation(&cur)) {
+            cur.p++;
+        } else if ((q = quote_length(cur.p, cur.end - cur.p)) > 0) {
+            cur.p += q - 1;
+        } else if (c == '#') {
+            skip(&cur, false);
+            cur.p--;
+        } else if (c == ';' || c == '\n' || c == '&' || c == '|') {
+            // A new command may start after an operator
+            cur.p++;
+            skip(&cur, true);
+            while (cur.p < cur.end && (*cur.p == '&' || *cur.p == '|')) {
+                cur.p++;
+                skip(&cur, true);
+            }
+            if (at_any(&cur, keywords)) {
+                return true;
+            }
+            cur.p--;
+        } else {
+            // Skip the rest of this word
+            size_t n = word_len(&cur);
+            cur.p += n ? n - 1 : 0;
+        }
+    }
+    return false;
+}
+
+/* Parse length bytes of text (one or more lines) into a tree.
+ *
+ * Returns 0 and sets *tree (NULL for a blank input), -EAGAIN if a
+ * construct is still open at the end of text, or -errno on a syntax
+ * error.
+ */
+int parse_script(char *text, size_t length, struct node **tree) {
+    struct cursor cur = {text, text + length, true};
+    int rv;
+
+    // parse_line() compacts quoted words in text as it goes, so text is
+    // only parsed for real once it is known to be complete: until then,
+    // the caller tries it again with more lines
+    rv = parse_list_until(&cur, NULL, tree);
+    free_script(*tree);
+    *tree = NULL;
+    if (rv == 0) {
+        cur = (struct cursor){text, text + length, false};
+        rv = parse_list_until(&cur, NULL, tree);
+    }
+    if (rv < 0) {
+        free_script(*tree);
+        *tree = NULL;
+    }
+    return rv;
+}
+
+/* Run a list of nodes, calling run for each pipeline.
+ *
+ * Returns 0 with the last command's return value in *status, or
+ * -errno if a pipeline could not be run at all.
+ */
+int run_script(struct node *list, run_func run, int *status) {
+    int rv = 0;
+
+    for (struct node *n = list; n && rv >= 0; n = n->next) {
+        if ((n->op == LIST_AND && *status != 0) ||
+            (n->op == LIST_OR && *status == 0)) {
+            continue;
+        }
+
+        switch (n->type) {
+            case NODE_PIPELINE:
+                rv = run(n->commands, status);
+                break;
+
+            case NODE_IF:
+                rv = run_script(n->cond, run, status);
+                if (rv < 0) {
+                    break;
+                }
+                if (*status == 0) {
+                    rv = run_script(n->body, run, status);
+                } else if (n->orelse) {
+                    rv = run_script(n->orelse, run, status);
+                } else {
+                    *status = 0;
+                }
+                break;
+
+            case NODE_WHILE: {
+                int last = 0;
+                while ((rv = run_script(n->cond, run, status)) >= 0 &&
+                       *status == 0) {
+                    rv = run_script(n->body, run, &last);
+                    if (rv < 0) {
+                        break;
+                    }
+                }
+                *status = last;
+                break;
+            }
+
+            case NODE_FOR: {
+                char *buf = NULL, *word;
+                size_t size = 0;
+                struct var *v = find_var(n->var, true);
+
+                if (v == NULL) {
+                    rv = -ENOMEM;
+                    break;
+                }
+                *status = 0;
+                for (int i = 0; n->words[i] && rv >= 0; i++) {
+                    // Each word is expanded as its turn comes, which may
+                    // move buf, so the variable holds a copy meanwhile
+                    if (unbind_var(v) < 0) {
+                        rv = -ENOMEM;
+                        break;
+                    }
+                    int fields = expand_word(n->words[i], &buf, &size, 0,
+                                             &word);
+                    rv = fields < 0 ? fields : 0;
+                    if (rv < 0) {
+                        dprintf(2, "Expansion error.  Cannot run loop: %s\n",
+                                strerror(-rv));
+                    }
+                    for (int f = 0; f < fields && rv >= 0; f++) {
+                        bind_var(v, word);
+                        rv = run_script(n->body, run, status);
+                        word += strlen(word) + 1;
+                    }
+                }
+                // The variable outlives buf and the tree
+                if (unbind_var(v) < 0) {
+                    rv = -ENOMEM;
+                }
+                free(buf);
+                break;
+            }
+        }
+        if (n->type != NODE_PIPELINE) {
+            set_last_status(*status);  // For "$?"
+        }
+    }
+    return rv;
+}
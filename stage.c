@@ -0,0 +1,1339 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements builtin commands that can run as pipeline
+ * stages (e.g., "cat big.log | grep x").  Unlike the builtins in
+ * builtin.c, these do not need the whole line to themselves:
+ * run_command() starts them on a thread inside the shell instead of
+ * forking a child, and they move data between their stdin and stdout
+ * like any other stage.
+ *
+ * A stage reads and writes through a struct stream, which is either a
+ * file descriptor or, between two adjacent builtin stages, a ring
+ * buffer shared by the two threads (see ring.c).  Filters read lines
+ * in place out of the stream's buffer (or the ring itself) when they
+ * can, and only copy a line that straddles the end of the buffer.
+ *
+ * cat and tee only shovel bytes around, so when both of their ends are
+ * descriptors they ask the kernel to do it (copy_file_range, splice,
+ * tee, sendfile) and only fall back to a read/write loop through a
+ * user-space buffer when the descriptors involved do not support that.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Most bytes asked of the kernel per copy call
+#define COPY_CHUNK (1 << 20)
+
+// Size of the user-space buffer for the read/write fallback
+#define BUF_SIZE (64 << 10)
+
+struct stage_builtin {
+    const char *cmd;
+    stage_func func;
+    // Returns true if the builtin handles these arguments; if not, the
+    // external program of the same name runs instead.  NULL = always.
+    bool (*usable)(char *args[MAX_ARGS]);
+};
+
+static bool is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static bool is_regular(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// splice() refuses to write to these
+static bool is_append(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_APPEND);
+}
+
+/* Write all of buf to fd, retrying short writes.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copy everything from in to out through a user-space buffer.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int copy_rw(int in, int out) {
+    char *buf = malloc(BUF_SIZE);
+    int rv = 0;
+
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    for (;;) {
+        ssize_t n = read(in, buf, BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            rv = n < 0 ? -errno : 0;
+            break;
+        }
+        rv = write_all(out, buf, n);
+        if (rv) {
+            break;
+        }
+    }
+    free(buf);
+    return rv;
+}
+
+/* Copy everything from in to out without bringing the bytes into user
+ * space, if the kernel can do it for this pair of descriptors:
+ *
+ *  - copy_file_range between two regular files (may share extents),
+ *  - splice when either end is a pipe,
+ *  - sendfile from a regular file to anything else.
+ *
+ * A method that is refused on its first call (EINVAL, EXDEV, ...) has
+ * not moved any data, so we just try the next one, ending with a
+ * read/write loop.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int copy_fd(int in, int out) {
+    ssize_t n;
+    bool moved;
+
+    if (is_regular(in) && is_regular(out)) {
+        moved = false;
+        while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0) {
+            moved = true;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (moved) {
+            return -errno;
+        }
+    }
+
+    if (is_pipe(in) || is_pipe(out)) {
+        moved = false;
+        while ((n = splice(in, NULL, out, NULL, COPY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+               (n < 0 && errno == EINTR)) {
+            moved |= n > 0;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (moved) {
+            return -errno;
+        }
+    }
+
+    if (is_regular(in)) {
+        moved = false;
+        while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0) {
+            moved = true;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (moved) {
+            return -errno;
+        }
+    }
+
+    return copy_rw(in, out);
+}
+
+/* Set up s to read (output = false) or write a descriptor. */
+void stream_init_fd(struct stream *s, int fd, bool output) {
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->output = output;
+}
+
+/* Set up s as the producer (output = true) or consumer end of a ring. */
+void stream_init_ring(struct stream *s, struct ring *ring, bool output) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->ring = ring;
+    s->output = output;
+}
+
+/* Wait for input and return a pointer to the unread bytes in *data.
+ * They stay put until stream_consume(), so callers can parse in place.
+ *
+ * Returns the number of bytes available, 0 at end of input, or -errno.
+ */
+static ssize_t stream_peek(struct stream *s, char **data) {
+    if (s->ring) {
+        return ring_peek(s->ring, data);
+    }
+
+    if (s->start == s->end) {
+        ssize_t n;
+
+        if (s->buf == NULL && (s->buf = malloc(BUF_SIZE)) == NULL) {
+            return -ENOMEM;
+        }
+        do {
+            n = read(s->fd, s->buf, BUF_SIZE);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return n < 0 ? -errno : 0;
+        }
+        s->start = 0;
+        s->end = n;
+    }
+
+    *data = s->buf + s->start;
+    return s->end - s->start;
+}
+
+/* Mark n bytes returned by stream_peek() as read. */
+static void stream_consume(struct stream *s, size_t n) {
+    if (s->ring) {
+        ring_consume(s->ring, n);
+    } else {
+        s->start += n;
+    }
+}
+
+/* Write out whatever stream_write() has buffered.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int stream_flush(struct stream *s) {
+    int rv = 0;
+
+    if (s->ring == NULL && s->end > 0) {
+        rv = write_all(s->fd, s->buf, s->end);
+        s->end = 0;
+    }
+    return rv;
+}
+
+/* Write len bytes to s.  Descriptor output is batched into BUF_SIZE
+ * writes; ring output goes straight into the ring.
+ *
+ * Returns 0 on success, -errno (e.g., -EPIPE) on failure.
+ */
+static int stream_write(struct stream *s, const char *data, size_t len) {
+    if (s->ring) {
+        return ring_write(s->ring, data, len);
+    }
+
+    if (s->end + len > BUF_SIZE) {
+        int rv = stream_flush(s);
+        if (rv) {
+            return rv;
+        }
+        if (len >= BUF_SIZE) {
+            return write_all(s->fd, data, len);
+        }
+    }
+    if (s->buf == NULL && (s->buf = malloc(BUF_SIZE)) == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(s->buf + s->end, data, len);
+    s->end += len;
+    return 0;
+}
+
+/* Flush and close a stage's end of a stream.  The shell's own stdin and
+ * stdout stay open.  Closing the last reference to a pipe or ring is
+ * what lets the neighboring stage see end of input (or EPIPE).
+ */
+void stream_close(struct stream *s) {
+    if (s->output) {
+        stream_flush(s);
+    }
+    if (s->ring) {
+        if (s->output) {
+            ring_close_write(s->ring);
+        } else {
+            ring_close_read(s->ring);
+        }
+    } else if (s->fd != STDIN_FILENO && s->fd != STDOUT_FILENO) {
+        close(s->fd);
+    }
+    free(s->buf);
+    s->buf = NULL;
+}
+
+/* Copy everything from in to out, without a kernel round trip in
+ * either direction when both ends are descriptors (see copy_fd()).
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int copy_stream(struct stream *in, struct stream *out) {
+    char *data;
+    ssize_t n;
+    int rv;
+
+    if (in->ring == NULL && in->start == in->end && out->ring == NULL) {
+        rv = stream_flush(out);
+        return rv ? rv : copy_fd(in->fd, out->fd);
+    }
+
+    while ((n = stream_peek(in, &data)) > 0) {
+        rv = stream_write(out, data, n);
+        if (rv) {
+            return rv;
+        }
+        stream_consume(in, n);
+    }
+    return n < 0 ? n : 0;
+}
+
+// Reads a stream line by line
+struct line_reader {
+    struct stream *in;
+    size_t pending;  // Length of the last line handed out in place
+    char *line;      // Assembles lines that straddle a buffer boundary
+    size_t len;
+    size_t cap;
+};
+
+static int append_line(struct line_reader *lr, const char *data, size_t n) {
+    if (lr->len + n > lr->cap) {
+        size_t cap = lr->cap ? lr->cap : 256;
+        while (cap < lr->len + n) {
+            cap *= 2;
+        }
+        char *line = realloc(lr->line, cap);
+        if (line == NULL) {
+            return -ENOMEM;
+        }
+        lr->line = line;
+        lr->cap = cap;
+    }
+    memcpy(lr->line + lr->len, data, n);
+    lr->len += n;
+    return 0;
+}
+
+/* Read the next line from lr->in, including its newline (the last line
+ * of the input may lack one).  *line stays valid until the next call.
+ * A line that is contiguous in the stream's buffer is returned in
+ * place; only one that straddles the end of the buffer is copied.
+ *
+ * Returns the length of the line, 0 at end of input, or -errno.
+ */
+static ssize_t next_line(struct line_reader *lr, char **line) {
+    if (lr->pending) {
+        stream_consume(lr->in, lr->pending);
+        lr->pending = 0;
+    }
+    lr->len = 0;
+
+    for (;;) {
+        char *data;
+        ssize_t n = stream_peek(lr->in, &data);
+        if (n < 0) {
+            return n;
+        }
+        if (n == 0) {
+            *line = lr->line;
+            return lr->len;
+        }
+
+        char *nl = memchr(data, '\n', n);
+        size_t take = nl ? nl - data + 1 : (size_t)n;
+        if (nl && lr->len == 0) {
+            *line = data;
+            lr->pending = take;
+            return take;
+        }
+        if (append_line(lr, data, take)) {
+            return -ENOMEM;
+        }
+        stream_consume(lr->in, take);
+        if (nl) {
+            *line = lr->line;
+            return lr->len;
+        }
+    }
+}
+
+static void free_line_reader(struct line_reader *lr) {
+    if (lr->pending) {
+        stream_consume(lr->in, lr->pending);
+    }
+    free(lr->line);
+}
+
+/* Write a line, supplying the newline if it is the unterminated last
+ * line of the input.
+ */
+static int write_line(struct stream *out, const char *line, size_t len) {
+    int rv = stream_write(out, line, len);
+    if (rv == 0 && (len == 0 || line[len - 1] != '\n')) {
+        rv = stream_write(out, "\n", 1);
+    }
+    return rv;
+}
+
+/* Report a stage failure, staying quiet about a reader that went away
+ * (an external program would have died of SIGPIPE).
+ *
+ * Returns the exit code for the stage.
+ */
+static int stage_error(const char *cmd, int err) {
+    if (err != -EPIPE) {
+        dprintf(2, "%s: %s\n", cmd, strerror(-err));
+    }
+    return err == -EPIPE ? 0 : 1;
+}
+
+/* Parse a non-negative count for an option like "-n 5".
+ *
+ * Returns 0 on success, -EINVAL if str is not a count.
+ */
+static int parse_count(const char *str, long *count) {
+    char *end;
+
+    if (str == NULL || *str < '0' || *str > '9') {
+        return -EINVAL;
+    }
+    *count = strtol(str, &end, 10);
+    return *end == '\0' ? 0 : -EINVAL;
+}
+
+/* cat only handles file operands (and "-"); any option (-n, -A, ...)
+ * is left to the real one.
+ */
+static bool cat_usable(char *args[MAX_ARGS]) {
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Builtin cat: concatenate the named files (or stdin, also for "-")
+ * onto stdout.
+ *
+ * Returns 0 on success, 1 if any file could not be copied.
+ */
+static int stage_cat(char *args[MAX_ARGS], struct stream *in,
+                     struct stream *out) {
+    int rv = 0;
+
+    if (args[1] == NULL) {
+        rv = copy_stream(in, out);
+        return rv ? stage_error("cat", rv) : 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        struct stream file;
+        struct stream *src = in;
+        int err;
+
+        if (strcmp(args[i], "-") != 0) {
+            int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                dprintf(2, "cat: %s: %s\n", args[i], strerror(errno));
+                rv = 1;
+                continue;
+            }
+            stream_init_fd(&file, fd, false);
+            src = &file;
+        }
+
+        err = copy_stream(src, out);
+        if (src != in) {
+            stream_close(src);
+        }
+        if (err == -EPIPE) {
+            break;
+        }
+        if (err) {
+            dprintf(2, "cat: %s: %s\n", args[i], strerror(-err));
+            rv = 1;
+        }
+    }
+
+    return rv;
+}
+
+/* Move exactly len bytes from the pipe in to out with splice().
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int splice_all(int in, int out, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Zero-copy tee: stdin is a pipe, and every sink is a pipe or a
+ * regular file.
+ *
+ * Each round, tee(2) duplicates up to one pipe's worth of stdin into
+ * stdout (if it is a pipe) or into an empty scratch pipe, so the same
+ * count n lands in every sink, and only then are those n bytes
+ * consumed from stdin.  The scratch pipe is at least as large as
+ * stdin, so duplicating n bytes into it never comes up short.
+ *
+ * Returns 0 on success, 1 if splice() was refused (EINVAL) before any
+ * sink was written to, so the caller can fall back to tee_rw(), or
+ * -errno on failure.
+ */
+static int tee_splice(int stdin, int sinks[], int nsinks) {
+    int scratch[2];
+    int devnull;
+    int chunk = fcntl(stdin, F_GETPIPE_SZ);
+    bool moved = false;
+    int rv = 0;
+
+    if (chunk < 0) {
+        return -errno;
+    }
+    if (pipe2(scratch, O_CLOEXEC) < 0) {
+        return -errno;
+    }
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull < 0 || fcntl(scratch[1], F_SETPIPE_SZ, chunk) < chunk) {
+        rv = -errno;
+        goto out;
+    }
+
+    for (;;) {
+        ssize_t n = 0;
+        int first = 0;
+
+        if (is_pipe(sinks[0])) {
+            n = tee(stdin, sinks[0], chunk, 0);
+            first = 1;
+        } else {
+            n = tee(stdin, scratch[1], chunk, 0);
+            if (n > 0) {
+                rv = splice_all(scratch[0], sinks[0], n);
+                first = 1;
+                if (rv == -EINVAL && !moved) {
+                    rv = 1;  // Nothing has been written anywhere yet
+                    break;
+                }
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            rv = n < 0 ? -errno : rv;
+            break;
+        }
+        moved = true;
+
+        for (int i = first; i < nsinks && !rv; i++) {
+            ssize_t m = tee(stdin, scratch[1], n, 0);
+            if (m != n) {
+                rv = m < 0 ? -errno : -EIO;
+                break;
+            }
+            rv = splice_all(scratch[0], sinks[i], n);
+        }
+        if (!rv) {
+            rv = splice_all(stdin, devnull, n);
+        }
+        if (rv) {
+            break;
+        }
+    }
+
+out:
+    if (devnull >= 0) {
+        close(devnull);
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    return rv;
+}
+
+/* Plain tee through a user-space buffer.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int tee_rw(int stdin, int sinks[], int nsinks) {
+    char *buf = malloc(BUF_SIZE);
+    int rv = 0;
+
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    for (;;) {
+        ssize_t n = read(stdin, buf, BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            rv = n < 0 ? -errno : 0;
+            break;
+        }
+        for (int i = 0; i < nsinks && !rv; i++) {
+            rv = write_all(sinks[i], buf, n);
+        }
+        if (rv) {
+            break;
+        }
+    }
+    free(buf);
+    return rv;
+}
+
+/* tee when either end is a ring: bytes are written to the files
+ * straight out of the input buffer.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int tee_stream(struct stream *in, struct stream *out, int files[],
+                      int nfiles) {
+    char *data;
+    ssize_t n;
+
+    while ((n = stream_peek(in, &data)) > 0) {
+        int rv = stream_write(out, data, n);
+        for (int i = 0; i < nfiles && !rv; i++) {
+            rv = write_all(files[i], data, n);
+        }
+        if (rv) {
+            return rv;
+        }
+        stream_consume(in, n);
+    }
+    return n < 0 ? n : 0;
+}
+
+/* tee only handles a leading "-a" and file operands; other options
+ * (-i, -p, --append, ...) are left to the real one.
+ */
+static bool tee_usable(char *args[MAX_ARGS]) {
+    int i = args[1] && strcmp(args[1], "-a") == 0 ? 2 : 1;
+
+    for (; args[i] != NULL; i++) {
+        if (args[i][0] == '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Builtin tee: copy stdin to stdout and to each named file.
+ * "-a" appends to the files instead of truncating them.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int stage_tee(char *args[MAX_ARGS], struct stream *in,
+                     struct stream *out) {
+    int sinks[MAX_ARGS];
+    int nsinks = 0;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    bool fds = in->ring == NULL && out->ring == NULL;
+    bool spliceable = fds && is_pipe(in->fd);
+    int i = 1;
+    int rv = 0;
+    int err;
+
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        // splice() refuses O_APPEND files
+        spliceable = false;
+        i++;
+    }
+
+    sinks[nsinks++] = out->fd;
+    spliceable &= is_pipe(out->fd) ||
+                  (is_regular(out->fd) && !is_append(out->fd));
+    for (; args[i] != NULL; i++) {
+        int fd = open(args[i], flags, 0666);
+        if (fd < 0) {
+            dprintf(2, "tee: %s: %s\n", args[i], strerror(errno));
+            rv = 1;
+            continue;
+        }
+        spliceable &= is_regular(fd);
+        sinks[nsinks++] = fd;
+    }
+
+    if (!fds) {
+        err = tee_stream(in, out, sinks + 1, nsinks - 1);
+    } else {
+        err = spliceable ? tee_splice(in->fd, sinks, nsinks) : 1;
+        if (err == 1) {
+            err = tee_rw(in->fd, sinks, nsinks);  // Not spliceable after all
+        }
+    }
+    if (err) {
+        rv |= stage_error("tee", err);
+    }
+
+    for (i = 1; i < nsinks; i++) {
+        close(sinks[i]);
+    }
+    return rv;
+}
+
+struct head_opts {
+    long count;
+    bool bytes;  // -c: count bytes rather than lines
+};
+
+static int parse_head(char *args[MAX_ARGS], struct head_opts *o) {
+    o->count = 10;
+    o->bytes = false;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-n") == 0 || strcmp(args[i], "-c") == 0) {
+            o->bytes = args[i][1] == 'c';
+            if (parse_count(args[++i], &o->count)) {
+                return -EINVAL;
+            }
+        } else if (args[i][0] == '-' && parse_count(args[i] + 1, &o->count) == 0) {
+            o->bytes = false;
+        } else {
+            return -EINVAL;  // Options we do not know, or file operands
+        }
+    }
+    return 0;
+}
+
+static bool head_usable(char *args[MAX_ARGS]) {
+    struct head_opts o;
+    return parse_head(args, &o) == 0;
+}
+
+/* Builtin head: copy the first N lines (-n N, -N) or bytes (-c N) of
+ * stdin.  Stopping early closes stdin, so the stage feeding it gets
+ * EPIPE instead of producing the rest.
+ */
+static int stage_head(char *args[MAX_ARGS], struct stream *in,
+                      struct stream *out) {
+    struct head_opts o;
+    ssize_t n = 0;
+    int rv = 0;
+
+    parse_head(args, &o);
+
+    if (o.bytes) {
+        char *data;
+        while (o.count > 0 && (n = stream_peek(in, &data)) > 0) {
+            if (n > o.count) {
+                n = o.count;
+            }
+            rv = stream_write(out, data, n);
+            if (rv) {
+                break;
+            }
+            stream_consume(in, n);
+            o.count -= n;
+        }
+    } else {
+        struct line_reader lr = {.in = in};
+        char *line;
+        while (o.count > 0 && (n = next_line(&lr, &line)) > 0) {
+            rv = stream_write(out, line, n);
+            if (rv) {
+                break;
+            }
+            o.count--;
+        }
+        free_line_reader(&lr);
+    }
+
+    if (rv == 0 && n < 0) {
+        rv = n;
+    }
+    return rv ? stage_error("head", rv) : 0;
+}
+
+struct tail_opts {
+    long count;
+    bool from;  // -n +N: start at line N rather than keep the last N
+};
+
+static int parse_tail(char *args[MAX_ARGS], struct tail_opts *o) {
+    o->count = 10;
+    o->from = false;
+    for (int i = 1; args[i] != NULL; i++) {
+        const char *num = NULL;
+        if (strcmp(args[i], "-n") == 0) {
+            num = args[++i];
+        } else if (args[i][0] == '-') {
+            num = args[i] + 1;
+        } else {
+            return -EINVAL;
+        }
+        if (num != NULL && *num == '+') {
+            o->from = true;
+            num++;
+        } else {
+            o->from = false;
+        }
+        if (parse_count(num, &o->count)) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static bool tail_usable(char *args[MAX_ARGS]) {
+    struct tail_opts o;
+    return parse_tail(args, &o) == 0;
+}
+
+/* Builtin tail: copy the last N lines (-n N, -N) of stdin, or
+ * everything from line N on (-n +N).
+ */
+static int stage_tail(char *args[MAX_ARGS], struct stream *in,
+                      struct stream *out) {
+    struct tail_opts o;
+    struct line_reader lr = {.in = in};
+    struct {
+        char *data;
+        size_t len;
+    } *keep = NULL;
+    long next = 0;  // Total lines read; line i lives in keep[i % count]
+    char *line;
+    ssize_t n;
+    int rv = 0;
+
+    parse_tail(args, &o);
+
+    if (o.from) {
+        while ((n = next_line(&lr, &line)) > 0) {
+            if (++next >= o.count && (rv = stream_write(out, line, n))) {
+                break;
+            }
+        }
+        goto out;
+    }
+
+    if (o.count > 0 && (keep = calloc(o.count, sizeof(*keep))) == NULL) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    while ((n = next_line(&lr, &line)) > 0 && o.count > 0) {
+        long slot = next++ % o.count;
+        if (keep[slot].len < (size_t)n) {
+            char *data = realloc(keep[slot].data, n);
+            if (data == NULL) {
+                rv = -ENOMEM;
+                goto out;
+            }
+            keep[slot].data = data;
+        }
+        memcpy(keep[slot].data, line, n);
+        keep[slot].len = n;
+    }
+    if (n >= 0) {
+        long first = next > o.count ? next - o.count : 0;
+        for (long i = first; i < next && !rv; i++) {
+            rv = stream_write(out, keep[i % o.count].data,
+                              keep[i % o.count].len);
+        }
+    }
+
+out:
+    for (long i = 0; keep && i < o.count; i++) {
+        free(keep[i].data);
+    }
+    free(keep);
+    free_line_reader(&lr);
+    if (rv == 0 && n < 0) {
+        rv = n;
+    }
+    return rv ? stage_error("tail", rv) : 0;
+}
+
+struct wc_opts {
+    bool lines, words, bytes;
+};
+
+static int parse_wc(char *args[MAX_ARGS], struct wc_opts *o) {
+    memset(o, 0, sizeof(*o));
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            return -EINVAL;
+        }
+        for (char *c = args[i] + 1; *c; c++) {
+            if (*c == 'l') {
+                o->lines = true;
+            } else if (*c == 'w') {
+                o->words = true;
+            } else if (*c == 'c') {
+                o->bytes = true;
+            } else {
+                return -EINVAL;
+            }
+        }
+    }
+    if (!o->lines && !o->words && !o->bytes) {
+        o->lines = o->words = o->bytes = true;
+    }
+    return 0;
+}
+
+static bool wc_usable(char *args[MAX_ARGS]) {
+    struct wc_opts o;
+    return parse_wc(args, &o) == 0;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Builtin wc: count the lines, words and/or bytes (-l, -w, -c) of
+ * stdin, formatted like coreutils wc does for a pipe.
+ */
+static int stage_wc(char *args[MAX_ARGS], struct stream *in,
+                    struct stream *out) {
+    struct wc_opts o;
+    long counts[3] = {0, 0, 0};
+    bool shown[3];
+    bool in_word = false;
+    char *data;
+    ssize_t n;
+    char buf[64];
+    int len = 0;
+
+    parse_wc(args, &o);
+
+    while ((n = stream_peek(in, &data)) > 0) {
+        counts[2] += n;
+        if (o.words) {
+            for (ssize_t i = 0; i < n; i++) {
+                bool blank = is_blank(data[i]);
+                counts[1] += !blank && !in_word;
+                in_word = !blank;
+                counts[0] += data[i] == '\n';
+            }
+        } else {
+            for (char *p = data; (p = memchr(p, '\n', data + n - p)); p++) {
+                counts[0]++;
+            }
+        }
+        stream_consume(in, n);
+    }
+    if (n < 0) {
+        return stage_error("wc", n);
+    }
+
+    shown[0] = o.lines;
+    shown[1] = o.words;
+    shown[2] = o.bytes;
+    int nshown = shown[0] + shown[1] + shown[2];
+    for (int i = 0; i < 3; i++) {
+        if (shown[i]) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%*ld",
+                            len ? " " : "", nshown > 1 ? 7 : 0, counts[i]);
+        }
+    }
+    buf[len++] = '\n';
+
+    int rv = stream_write(out, buf, len);
+    return rv ? stage_error("wc", rv) : 0;
+}
+
+struct grep_opts {
+    const char *pattern;
+    bool invert;  // -v
+    bool count;   // -c
+    bool number;  // -n
+};
+
+static int parse_grep(char *args[MAX_ARGS], struct grep_opts *o) {
+    bool fixed = false;
+    int i;
+
+    memset(o, 0, sizeof(*o));
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char *c = args[i] + 1; *c; c++) {
+            if (*c == 'F') {
+                fixed = true;
+            } else if (*c == 'v') {
+                o->invert = true;
+            } else if (*c == 'c') {
+                o->count = true;
+            } else if (*c == 'n') {
+                o->number = true;
+            } else {
+                return -EINVAL;
+            }
+        }
+    }
+
+    // Exactly one pattern, read from stdin
+    if (args[i] == NULL || args[i + 1] != NULL) {
+        return -EINVAL;
+    }
+    o->pattern = args[i];
+
+    // Without -F, a pattern with no special characters still matches
+    // itself, so the builtin can take it too.
+    if (!fixed && strpbrk(o->pattern, "\\.[]*^$") != NULL) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static bool grep_usable(char *args[MAX_ARGS]) {
+    struct grep_opts o;
+    return parse_grep(args, &o) == 0;
+}
+
+/* Builtin grep -F: copy the lines of stdin that contain the fixed
+ * string (-v: that do not), optionally numbered (-n) or just counted
+ * (-c).
+ *
+ * Returns 0 if any line was selected, 1 if none were, 2 on error.
+ */
+static int stage_grep(char *args[MAX_ARGS], struct stream *in,
+                      struct stream *out) {
+    struct grep_opts o;
+    struct line_reader lr = {.in = in};
+    size_t plen;
+    long lineno = 0, matched = 0;
+    char *line;
+    ssize_t n;
+    int rv = 0;
+
+    parse_grep(args, &o);
+    plen = strlen(o.pattern);
+
+    while ((n = next_line(&lr, &line)) > 0) {
+        size_t len = line[n - 1] == '\n' ? n - 1 : n;
+        bool hit = memmem(line, len, o.pattern, plen) != NULL;
+
+        lineno++;
+        if (hit == o.invert) {
+            continue;
+        }
+        matched++;
+        if (o.count) {
+            continue;
+        }
+        if (o.number) {
+            char num[32];
+            int nlen = snprintf(num, sizeof(num), "%ld:", lineno);
+            rv = stream_write(out, num, nlen);
+        }
+        if (rv == 0) {
+            rv = write_line(out, line, n);
+        }
+        if (rv) {
+            break;
+        }
+    }
+    free_line_reader(&lr);
+
+    if (rv == 0 && n < 0) {
+        rv = n;
+    }
+    if (rv == 0 && o.count) {
+        char num[32];
+        int nlen = snprintf(num, sizeof(num), "%ld\n", matched);
+        rv = stream_write(out, num, nlen);
+    }
+    if (rv) {
+        return stage_error("grep", rv) ? 2 : 0;
+    }
+    return matched ? 0 : 1;
+}
+
+struct sort_opts {
+    bool reverse;  // -r
+    bool numeric;  // -n
+};
+
+static int parse_sort(char *args[MAX_ARGS], struct sort_opts *o) {
+    memset(o, 0, sizeof(*o));
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            return -EINVAL;
+        }
+        for (char *c = args[i] + 1; *c; c++) {
+            if (*c == 'r') {
+                o->reverse = true;
+            } else if (*c == 'n') {
+                o->numeric = true;
+            } else {
+                return -EINVAL;
+            }
+        }
+    }
+    return 0;
+}
+
+/* sort compares by the locale's collation order, which we only match
+ * in the C locale (byte order; C.UTF-8 sorts the same way).
+ */
+static bool sort_usable(char *args[MAX_ARGS]) {
+    const char *vars[] = {"LC_ALL", "LC_COLLATE", "LANG"};
+    struct sort_opts o;
+
+    for (int i = 0; i < 3; i++) {
+        const char *val = get_var(vars[i]);
+        if (val != NULL && *val != '\0') {
+            if (strcmp(val, "C") != 0 && strcmp(val, "POSIX") != 0 &&
+                strncmp(val, "C.", 2) != 0) {
+                return false;
+            }
+            break;
+        }
+    }
+    return parse_sort(args, &o) == 0;
+}
+
+struct sort_line {
+    const char *data;
+    size_t len;  // Without the newline
+    long double num;
+};
+
+static bool sort_reverse;
+static bool sort_numeric;
+
+/* The numeric value of the leading number on a line, as sort -n reads
+ * it: optional blanks, an optional '-', digits, and a fraction.  A line
+ * that does not start with a number counts as zero.
+ */
+static long double leading_number(const char *data, size_t len) {
+    char buf[64];
+    size_t i = 0, n = 0;
+
+    while (i < len && is_blank(data[i])) {
+        i++;
+    }
+    if (i < len && data[i] == '-') {
+        buf[n++] = data[i++];
+    }
+    while (i < len && n < sizeof(buf) - 1 &&
+           ((data[i] >= '0' && data[i] <= '9') || data[i] == '.')) {
+        buf[n++] = data[i++];
+    }
+    buf[n] = '\0';
+    return strtold(buf, NULL);
+}
+
+static int compare_lines(const void *a, const void *b) {
+    const struct sort_line *x = a, *y = b;
+    int rv = 0;
+
+    if (sort_numeric) {
+        rv = (x->num > y->num) - (x->num < y->num);
+    }
+    if (rv == 0) {
+        // Last resort: compare the whole lines byte by byte
+        rv = memcmp(x->data, y->data, x->len < y->len ? x->len : y->len);
+        if (rv == 0) {
+            rv = (x->len > y->len) - (x->len < y->len);
+        }
+    }
+    return sort_reverse ? -rv : rv;
+}
+
+/* Builtin sort: sort the lines of stdin in byte order, or by leading
+ * number (-n), optionally reversed (-r).
+ */
+static int stage_sort(char *args[MAX_ARGS], struct stream *in,
+                      struct stream *out) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct sort_opts o;
+    struct sort_line *lines = NULL;
+    size_t nlines = 0, cap = 0;
+    char *text = NULL;  // All of stdin, as read
+    size_t len = 0, text_cap = 0;
+    char *data;
+    ssize_t n;
+    int rv = 0;
+
+    parse_sort(args, &o);
+
+    while ((n = stream_peek(in, &data)) > 0) {
+        if (len + n > text_cap) {
+            text_cap = text_cap ? text_cap * 2 : BUF_SIZE;
+            while (text_cap < len + n) {
+                text_cap *= 2;
+            }
+            char *grown = realloc(text, text_cap);
+            if (grown == NULL) {
+                rv = -ENOMEM;
+                goto out;
+            }
+            text = grown;
+        }
+        memcpy(text + len, data, n);
+        len += n;
+        stream_consume(in, n);
+    }
+    if (n < 0) {
+        rv = n;
+        goto out;
+    }
+
+    for (size_t start = 0; start < len;) {
+        char *nl = memchr(text + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - text) : len;
+
+        if (nlines == cap) {
+            cap = cap ? cap * 2 : 1024;
+            struct sort_line *grown = realloc(lines, cap * sizeof(*lines));
+            if (grown == NULL) {
+                rv = -ENOMEM;
+                goto out;
+            }
+            lines = grown;
+        }
+        lines[nlines].data = text + start;
+        lines[nlines].len = end - start;
+        if (o.numeric) {
+            lines[nlines].num = leading_number(text + start, end - start);
+        }
+        nlines++;
+        start = end + 1;
+    }
+
+    // qsort() has no context argument; serialize sorts that use the flags
+    pthread_mutex_lock(&lock);
+    sort_reverse = o.reverse;
+    sort_numeric = o.numeric;
+    qsort(lines, nlines, sizeof(*lines), compare_lines);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < nlines && !rv; i++) {
+        rv = stream_write(out, lines[i].data, lines[i].len);
+        if (rv == 0) {
+            rv = stream_write(out, "\n", 1);
+        }
+    }
+
+out:
+    free(lines);
+    free(text);
+    return rv ? stage_error("sort", rv) : 0;
+}
+
+// Is arg an option cluster coreutils echo would take (e.g., "-ne")?
+static bool is_echo_option(const char *arg) {
+    size_t n = strlen(arg);
+    return n > 1 && arg[0] == '-' && strspn(arg + 1, "neE") == n - 1;
+}
+
+/* echo only handles a leading "-n"; other options (-e, -E) are left to
+ * the real one.
+ */
+static bool echo_usable(char *args[MAX_ARGS]) {
+    int i = args[1] && strcmp(args[1], "-n") == 0 ? 2 : 1;
+    return args[i] == NULL || !is_echo_option(args[i]);
+}
+
+/* Builtin echo: write the arguments, separated by spaces, with a
+ * newline unless the first is "-n".  Cheap enough for "$(echo ...)".
+ */
+static int stage_echo(char *args[MAX_ARGS], struct stream *in,
+                      struct stream *out) {
+    bool newline = !(args[1] && strcmp(args[1], "-n") == 0);
+    int rv = 0;
+
+    for (int i = newline ? 1 : 2; args[i] && !rv; i++) {
+        if (i > (newline ? 1 : 2)) {
+            rv = stream_write(out, " ", 1);
+        }
+        if (!rv) {
+            rv = stream_write(out, args[i], strlen(args[i]));
+        }
+    }
+    if (!rv && newline) {
+        rv = stream_write(out, "\n", 1);
+    }
+    return rv ? stage_error("echo", rv) : 0;
+}
+
+static bool pwd_usable(char *args[MAX_ARGS]) {
+    return args[1] == NULL;
+}
+
+/* Builtin pwd: write the current directory. */
+static int stage_pwd(char *args[MAX_ARGS], struct stream *in,
+                     struct stream *out) {
+    char cwd[PATH_MAX + 1];
+    int rv;
+
+    if (getcwd(cwd, sizeof(cwd) - 1) == NULL) {
+        return stage_error("pwd", -errno);
+    }
+    strcat(cwd, "\n");
+    rv = stream_write(out, cwd, strlen(cwd));
+    return rv ? stage_error("pwd", rv) : 0;
+}
+
+static struct stage_builtin stage_builtins[] = {
+    {"cat", stage_cat, cat_usable},    {"tee", stage_tee, tee_usable},
+    {"head", stage_head, head_usable}, {"tail", stage_tail, tail_usable},
+    {"wc", stage_wc, wc_usable},       {"grep", stage_grep, grep_usable},
+    {"sort", stage_sort, sort_usable}, {"echo", stage_echo, echo_usable},
+    {"pwd", stage_pwd, pwd_usable},    {NULL, NULL, NULL}};
+
+/* The name of stage builtin i, for completion, or NULL if there are
+ * not that many.
+ */
+const char *stage_builtin_name(int i) {
+    return stage_builtins[i].cmd;
+}
+
+/* This function checks if the command in args is a builtin that can
+ * run as a pipeline stage, with the options given.
+ *
+ * Returns the function implementing it, or NULL if it is not one (and
+ * an external program should run instead).
+ */
+stage_func find_stage_builtin(char *args[MAX_ARGS]) {
+    for (int i = 0; stage_builtins[i].cmd != NULL; i++) {
+        if (strcmp(args[0], stage_builtins[i].cmd) == 0) {
+            if (stage_builtins[i].usable && !stage_builtins[i].usable(args)) {
+                return NULL;
+            }
+            return stage_builtins[i].func;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,378 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements command substitution: "$(cmd)" in a word is
+ * replaced by what cmd writes to stdout (see expand_word() in vars.c).
+ *
+ * cmd runs through the shell's own line runner (see thsh.c), so it may
+ * be any list or pipeline, and it uses the same job machinery as a
+ * command typed at the prompt.  In particular, builtin stages (see
+ * stage.c) run on threads inside the shell, so "$(echo x)" or
+ * "$(cat f | head -1)" does not fork at all.  A cmd that could change
+ * the shell itself (one using a shell builtin such as cd, exit or
+ * export, an assignment, or an if, while or for) runs in a forked copy
+ * of the shell instead, as in any other shell, so that "$(cd /)" or
+ * "$(exit 3)" only changes (or ends) the copy.
+ *
+ * While cmd runs, the shell's stdout is the write end of a pipe, which
+ * a thread drains into a growable buffer.  Output of any size is thus
+ * captured in memory, without a temporary file, and a stage never
+ * blocks on a full pipe waiting for the shell to finish.  The cache
+ * prefix (see cache.c) captures a pipeline's output the same way.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Smallest free space the drain thread asks read() to fill
+#define CAPTURE_CHUNK 4096
+
+static int (*subst_run)(char *line, int length, int *status);
+
+// Set in a forked copy of the shell running a substitution
+static bool subshell;
+
+// Output being captured, shared with the drain thread
+struct capture {
+    int fd;      // Read end of the pipe that is now stdout
+    int tee_fd;  // Also copy the output here as it arrives, unless -1
+    int saved;   // The shell's stdout, to put back
+    pthread_t thread;
+    char *buf;
+    size_t len, cap;
+    int error;  // -ENOMEM once the buffer could not grow
+};
+
+/* Run substitutions with run, which parses and runs one line. */
+void set_subst_runner(int (*run)(char *line, int length, int *status)) {
+    subst_run = run;
+}
+
+/* Read everything from c->fd into c->buf (and c->tee_fd).  If the
+ * buffer cannot grow, the rest is only passed on to c->tee_fd, so the
+ * writers still finish.
+ */
+static void *drain(void *arg) {
+    struct capture *c = arg;
+    char discard[CAPTURE_CHUNK];
+
+    for (;;) {
+        char *dst = discard;
+        size_t room = sizeof(discard);
+        ssize_t n;
+
+        if (c->error == 0 && c->cap - c->len < CAPTURE_CHUNK) {
+            size_t cap = c->cap ? c->cap * 2 : 4 * CAPTURE_CHUNK;
+            char *grown = realloc(c->buf, cap);
+            if (grown == NULL) {
+                c->error = -ENOMEM;
+            } else {
+                c->buf = grown;
+                c->cap = cap;
+            }
+        }
+        if (c->error == 0) {
+            dst = c->buf + c->len;
+            room = c->cap - c->len;
+        }
+
+        n = read(c->fd, dst, room);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0 && c->error == 0) {
+                c->error = -errno;
+            }
+            break;
+        }
+        for (ssize_t off = 0; c->tee_fd >= 0 && off < n;) {
+            ssize_t w = write(c->tee_fd, dst + off, n - off);
+            if (w > 0) {
+                off += w;
+            } else if (errno != EINTR) {
+                c->tee_fd = -1;  // Keep capturing regardless
+            }
+        }
+        if (c->error == 0) {
+            c->len += n;
+        }
+    }
+    return NULL;
+}
+
+/* Start capturing the shell's stdout, and so that of every stage run
+ * until capture_end(): it becomes a pipe, drained by a thread into
+ * memory, and with tee also passed on to the real stdout as it
+ * arrives.
+ *
+ * Returns 0 and sets *cp on success, -errno on failure.
+ */
+int capture_begin(struct capture **cp, bool tee) {
+    struct capture *c = calloc(1, sizeof(struct capture));
+    sigset_t all, old;
+    int fds[2], rv;
+
+    if (c == NULL) {
+        return -ENOMEM;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        rv = -errno;
+        free(c);
+        return rv;
+    }
+    c->fd = fds[0];
+
+    fflush(stdout);
+    c->saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (c->saved < 0) {
+        rv = -errno;
+        goto fail;
+    }
+    c->tee_fd = tee ? c->saved : -1;
+
+    // Leave signals to the shell's own thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rv = -pthread_create(&c->thread, NULL, drain, c);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rv < 0) {
+        close(c->saved);
+        goto fail;
+    }
+
+    // Point the shell's stdout at the pipe
+    if (dup2(fds[1], STDOUT_FILENO) < 0) {
+        rv = -errno;
+    }
+    close(fds[1]);
+    if (rv < 0) {
+        capture_end(c, NULL, NULL);
+        return rv;
+    }
+    *cp = c;
+    return 0;
+
+fail:
+    close(fds[0]);
+    close(fds[1]);
+    free(c);
+    return rv;
+}
+
+/* Hand what c drained to the caller, as capture_end() does, and free
+ * c's buffer (but not c).
+ */
+static int collect(struct capture *c, char **out, size_t *outlen) {
+    int rv = c->error;
+
+    if (rv == 0 && out) {
+        // Room for the NUL (and no more)
+        *out = realloc(c->buf, c->len + 1);
+        if (*out == NULL) {
+            rv = -ENOMEM;
+        } else {
+            (*out)[c->len] = '\0';
+            *outlen = c->len;
+            c->buf = NULL;
+        }
+    }
+    free(c->buf);
+    return rv;
+}
+
+/* Put the shell's stdout back and collect what was captured, once
+ * every stage writing to it has been waited on.  *out is set to the
+ * output, NUL-terminated, to be freed by the caller, and *outlen to its
+ * length; if out is NULL, the output is thrown away.
+ *
+ * Returns 0 on success, -errno if the output could not be kept.
+ */
+int capture_end(struct capture *c, char **out, size_t *outlen) {
+    int rv;
+
+    // This closes the last write end, so the drain thread sees EOF
+    fflush(stdout);
+    dup2(c->saved, STDOUT_FILENO);
+    close(c->saved);
+    pthread_join(c->thread, NULL);
+    close(c->fd);
+
+    rv = collect(c, out, outlen);
+    free(c);
+    return rv;
+}
+
+/* Is this process a copy of the shell forked to run a substitution?
+ * If so, "exit" must not run the shell's atexit handlers.
+ */
+bool in_subshell(void) {
+    return subshell;
+}
+
+// Is word the name of a shell builtin or prefix (see builtin.c)?
+static bool is_shell_builtin(const char *word) {
+    const char *name;
+
+    for (int i = 0; (name = builtin_name(i)) != NULL; i++) {
+        if (strcmp(word, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Can line (length bytes) run inside the shell without changing it?
+ * It must be a list of pipelines, each stage of which runs a command
+ * or a builtin stage (echo, cat, ...), not a shell builtin or an
+ * assignment, named outright rather than by an expansion.
+ */
+static bool stateless(const char *line, size_t length) {
+    struct list_item items[MAX_LIST];
+    char *commands[MAX_PIPELINE][MAX_ARGS];
+    char scratch[MAX_INPUT];
+    bool ok;
+    int n;
+
+    // Parsing compacts words in place, and line is still to be run
+    char *copy = strndup(line, length);
+    if (copy == NULL) {
+        return false;
+    }
+    n = is_script(copy, length) ? -EINVAL : parse_list(copy, length, items);
+    ok = n >= 0;
+    for (int i = 0; i < n && ok; i++) {
+        char *infile = NULL, *outfile = NULL;
+
+        memset(commands, 0, sizeof(commands));
+        ok = parse_line(items[i].start, items[i].length, commands, &infile,
+                        &outfile, scratch, sizeof(scratch)) >= 0;
+        for (int j = 0; ok && commands[j][0] != NULL; j++) {
+            char *word = commands[j][0];
+            char *eq = strchr(word, '=');
+            ok = !is_shell_builtin(word) && strchr(word, '$') == NULL &&
+                 !(eq && valid_name(word, eq - word));
+        }
+        for (int j = 0; j < MAX_PIPELINE && commands[j][0]; j++) {
+            for (int k = 0; k < MAX_ARGS && commands[j][k]; k++) {
+                free(commands[j][k]);
+            }
+        }
+        free(infile);
+        free(outfile);
+    }
+    free(copy);
+    return ok;
+}
+
+/* Run line (length bytes) in a forked copy of the shell, wait for it,
+ * and collect its stdout as capture_end() does.  "$?" is set to how it
+ * ended.
+ *
+ * The copy is forked before anything is captured, and writes straight
+ * to a pipe that the shell drains itself: forking while a drain thread
+ * runs could leave the copy holding a lock (malloc's, say) that only
+ * that thread would have released.
+ *
+ * Returns 0 on success, -errno if it could not be run or captured.
+ */
+static int run_forked(char *line, int length, char **out, size_t *outlen) {
+    struct capture c = {.tee_fd = -1};
+    int fds[2], status, rv;
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -errno;
+    }
+    fflush(stdout);
+    metric_add(METRIC_FORKS, 1);
+    pid = fork();
+    if (pid < 0) {
+        rv = -errno;
+        close(fds[0]);
+        close(fds[1]);
+        return rv;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (dup2(fds[1], STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        close(fds[1]);
+        subshell = true;
+        rv = subst_run(line, length, &status);
+        fflush(stdout);
+        set_last_status(rv < 0 ? rv : status);
+        _exit(get_last_status());
+    }
+    close(fds[1]);
+    c.fd = fds[0];
+    drain(&c);
+    close(c.fd);
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            rv = -errno;
+            free(c.buf);
+            return rv;
+        }
+    }
+    set_last_status(status);
+    return collect(&c, out, outlen);
+}
+
+/* Run the command text cmd (len bytes, without the "$(" and ")") and
+ * capture its stdout, less any trailing newlines.  *out is set to the
+ * output, NUL-terminated, to be freed by the caller, and *outlen to its
+ * length.
+ *
+ * Returns 0 on success, -errno if it could not be run or captured.
+ */
+int capture_output(const char *cmd, size_t len, char **out, size_t *outlen) {
+    struct capture *c;
+    int status, rv;
+    char *line;
+
+    if (subst_run == NULL) {
+        return -ENOSYS;
+    }
+    // The runner is handed a line of its own, as if just read
+    line = malloc(len + 2);
+    if (line == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(line, cmd, len);
+    line[len] = '\n';
+    line[len + 1] = '\0';
+
+    metric_add(METRIC_SUBSTITUTIONS, 1);
+    if (!stateless(line, len + 1)) {
+        rv = run_forked(line, len + 1, out, outlen);
+        free(line);
+    } else if ((rv = capture_begin(&c, false)) < 0) {
+        free(line);
+    } else {
+        rv = subst_run(line, len + 1, &status);
+        free(line);
+        if (rv < 0) {
+            capture_end(c, NULL, NULL);
+        } else {
+            rv = capture_end(c, out, outlen);
+        }
+    }
+    if (rv < 0) {
+        return rv;
+    }
+
+    while (*outlen > 0 && (*out)[*outlen - 1] == '\n') {
+        (*out)[--*outlen] = '\0';
+    }
+    return 0;
+}
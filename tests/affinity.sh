@@ -0,0 +1,86 @@
+#!/bin/bash
+# COMP 530: Tar Heel SHell
+#
+# CPU placement tests, on a made-up machine: two sockets (one NUMA
+# node each) of two cores, each with two SMT siblings, so CPUs 0-3 are
+# on socket 0 and 4-7 on socket 1, and CPUs 2n and 2n+1 share a core.
+# The topology is read from a fake sysfs tree (THSH_SYSFS_CPU), and
+# THSH_CPU_MASK stands in for the shell's affinity mask, so compact,
+# spread, the mask and round-robin starts can be checked on any host.
+#
+# usage: tests/affinity.sh
+#
+# Run from the top of the tree after "make".  Exits non-zero if any
+# case fails.
+
+THSH=$(realpath "${THSH:-./thsh}")
+FAILED=0
+
+if [ ! -x "$THSH" ]; then
+    echo "$THSH not found; run make first" >&2
+    exit 1
+fi
+
+# check <name> <expected> <actual>
+check() {
+    if [ "$2" == "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected [$2], got [$3]"
+        FAILED=1
+    fi
+}
+
+SYSFS=$(mktemp -d)
+trap 'rm -rf "$SYSFS"' EXIT
+
+echo 0-7 > "$SYSFS/online"
+for cpu in 0 1 2 3 4 5 6 7; do
+    dir=$SYSFS/cpu$cpu
+    mkdir -p "$dir/node$((cpu / 4))" "$dir/topology" \
+        "$dir/cache/index0" "$dir/cache/index1"
+    echo $((cpu / 4)) > "$dir/topology/physical_package_id"
+    echo $((cpu % 4 / 2)) > "$dir/topology/core_id"
+    echo 2 > "$dir/cache/index0/level"
+    echo $((cpu / 2)) > "$dir/cache/index0/id"
+    echo 3 > "$dir/cache/index1/level"
+    echo $((cpu / 4)) > "$dir/cache/index1/id"
+done
+
+# run <mask> <line>: the placement line(s) "affinity" prints in line,
+# with the shell's mask set to the CPU list mask
+run() {
+    THSH_SYSFS_CPU=$SYSFS THSH_CPU_MASK=$1 "$THSH" -c "$2" 2>&1 |
+        grep -v '^cpu '
+}
+
+check "compact keeps siblings, then sockets, together" \
+    "placement: compact 0,1,2,3,4,5,6,7 (next from cpu 0)" \
+    "$(run 0-7 'affinity compact; affinity')"
+check "spread alternates sockets, siblings last" \
+    "placement: spread 0,4,2,6,1,5,3,7 (next from cpu 0)" \
+    "$(run 0-7 'affinity spread; affinity')"
+
+check "topology only covers the mask" 6 \
+    "$(THSH_SYSFS_CPU=$SYSFS THSH_CPU_MASK=0-5 "$THSH" -c affinity |
+        grep -c '^cpu ')"
+check "compact within the mask" \
+    "placement: compact 0,1,2,3,4,5 (next from cpu 0)" \
+    "$(run 0-5 'affinity compact; affinity')"
+check "spread within the mask" \
+    "placement: spread 0,4,2,1,5,3 (next from cpu 0)" \
+    "$(run 0-5 'affinity spread; affinity')"
+check "a list outside the mask is refused" "placement: none" \
+    "$(run 0-5 'affinity 6; affinity' | grep placement)"
+check "a list within the mask" "placement: 5,1 5,1" \
+    "$(run 0-5 'affinity 5,1; affinity')"
+
+check "each pipeline starts after the last" \
+    "placement: spread 0,4,2,1,5,3 (next from cpu 1)" \
+    "$(run 0-5 'affinity spread; true | true | true; affinity')"
+check "starts wrap around" \
+    "placement: compact 0,1,2,3,4,5 (next from cpu 2)" \
+    "$(run 0-5 'affinity compact; true | true | true; true | true | true;
+                true | true; affinity')"
+
+exit $FAILED
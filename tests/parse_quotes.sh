@@ -0,0 +1,69 @@
+#!/bin/bash
+# COMP 530: Tar Heel SHell
+#
+# Quoting tests for the parser: each line is split by parser_tester
+# and run by thsh -c, and the words (or what echo prints) must match.
+# Nothing inside single quotes may be expanded or run.
+#
+# usage: tests/parse_quotes.sh
+#
+# Run from the top of the tree after "make".  Exits non-zero if any
+# case fails.
+
+THSH=${THSH:-./thsh}
+TESTER=${TESTER:-./parser_tester}
+FAILED=0
+
+for prog in "$THSH" "$TESTER"; do
+    if [ ! -x "$prog" ]; then
+        echo "$prog not found; run make first" >&2
+        exit 1
+    fi
+done
+
+# check <name> <expected> <actual>
+check() {
+    if [ "$2" == "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected [$2], got [$3]"
+        FAILED=1
+    fi
+}
+
+# words <line>: the words parser_tester finds in line, one stage
+words() {
+    echo "$1" | "$TESTER" | sed -n 's/^Pipeline Stage 0: //p'
+}
+
+# run <line>: what thsh prints for line
+run() {
+    HOME=/home/thsh "$THSH" -c "$1" 2>&1
+}
+
+check "single-quoted \$HOME" '$HOME' "$(run "echo '\$HOME'")"
+check "single-quoted text then \$HOME" 'a$HOME' "$(run "echo 'a\$HOME'")"
+check "single-quoted \$(cmd) is not run" 'x$(echo pwned)' \
+    "$(run "echo 'x\$(echo pwned)'")"
+check "single-quoted \$ mid-word" 'c$d' "$(run "echo 'c\$d'")"
+check "double quote inside single quotes" '[echo] [a"b] ' \
+    "$(words "echo 'a\"b'")"
+check "single quote inside double quotes" "[echo] [a'b] " \
+    "$(words "echo \"a'b\"")"
+check "double-quoted \$HOME" '/home/thsh' "$(run 'echo "$HOME"')"
+check "escaped \$HOME" '$HOME' "$(run 'echo \$HOME')"
+check "spaces kept in quotes" '[echo] [a  b] [c d] ' \
+    "$(words "echo 'a  b' c\\ d")"
+check "quoted operators" '[echo] [a|b] [c;d] ' \
+    "$(words "echo 'a|b' \"c;d\"")"
+check "empty quotes are a word" '[echo] [] [x] ' "$(words "echo '' x")"
+check "double-quoted \$(...) is not split" 'a   b' \
+    "$(run "printf '%s\\n' \"\$(printf 'a   b')\"")"
+check "double-quoted empty \$(...) is a word" '[]' \
+    "$(run "printf '[%s]\\n' \"\$(true)\"")"
+check "unquoted \$(...) is split" 'a b' "$(run "echo \$(printf 'a   b')")"
+
+long=$(printf 'x%.0s' {1..3000})
+check "3000-byte quoted argument" 3001 "$(run "echo '$long' | wc -c")"
+
+exit $FAILED
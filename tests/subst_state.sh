@@ -0,0 +1,59 @@
+#!/bin/bash
+# COMP 530: Tar Heel SHell
+#
+# Command substitution tests: what runs inside "$(...)" must not change
+# the shell running it (its directory, its variables, whether it is
+# still running), and "$?" must show how the substitution ended.
+#
+# usage: tests/subst_state.sh
+#
+# Run from the top of the tree after "make".  Exits non-zero if any
+# case fails.
+
+THSH=$(realpath "${THSH:-./thsh}")
+FAILED=0
+
+if [ ! -x "$THSH" ]; then
+    echo "$THSH not found; run make first" >&2
+    exit 1
+fi
+
+# check <name> <expected> <actual>
+check() {
+    if [ "$2" == "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected [$2], got [$3]"
+        FAILED=1
+    fi
+}
+
+# run <line>: what thsh prints for line, run from /tmp
+run() {
+    (cd /tmp && "$THSH" -c "$1" 2>&1)
+}
+
+check "\$(cd /) prints the new directory" / "$(run 'x=$(cd /; pwd); echo $x')"
+check "\$(cd /) leaves the shell's directory" /tmp \
+    "$(run 'x=$(cd /; pwd); pwd')"
+check "\$(v=1) leaves v unset" "[]" "$(run 'y=$(v=1); echo [$v]')"
+check "\$(export v=1) leaves v unset" "[]" \
+    "$(run 'y=$(export v=1); echo [$v]')"
+check "\$(exit 3) does not end the shell" "after 3" \
+    "$(run 'w=$(exit 3); echo after $?')"
+check "\$(exit 3) keeps what came before" "a 3" \
+    "$(run 'echo $(echo a; exit 3) $?')"
+check "stateless \$(...) still runs" "b c" "$(run 'echo $(echo b | cat) c')"
+check "\$(false) sets \$?" 1 "$(run 'x=$(false); echo $?')"
+check "plain assignment resets \$?" 0 "$(run 'false; x=1; echo $?')"
+
+# In a script, the lines after the substitution still run
+script=$(mktemp)
+printf 'w=$(exit 3)\necho next $?\nexit 4\n' > "$script"
+check "\$(exit 3) in a script" "next 3" \
+    "$("$THSH" "$script" 2>&1 | grep next)"
+"$THSH" "$script" > /dev/null 2>&1
+check "exit 4 ends a script with 4" 4 "$?"
+rm -f "$script"
+
+exit $FAILED
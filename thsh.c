@@ -3,14 +3,469 @@
 #include "thsh.h"
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+
+// Ring size between two builtin stages, unless a pipe size is set
+#define DEFAULT_RING_SIZE (64 << 10)
+
+/* Launch every stage of a parsed pipeline and wait for all of them.
+ *
+ * Stage i reads from the output of stage i - 1; the first stage
+ * inherits the shell's stdin and the last its stdout.  Two adjacent
+ * builtin stages (see stage.c) are both threads in the shell, so they
+ * are connected by a ring buffer; any other pair gets a pipe, sized by
+ * opts->pipe_size (or the shell default, see "pipesz").
+ *
+ * Each stage is pinned to a CPU according to opts->placement, or the
+ * shell-wide placement (see "affinity").  With opts->time, what each
+ * stage cost is reported on stderr at the end (see "time").  With
+ * opts->profile, the stages are sampled while they run (see profile.c).
+ * With a deadline (opts->timeout, or the shell's, see "timeout"), the
+ * stages are all processes, killed if they run past it (see
+ * watchdog.c), and the status is then 124.  Resource limits and
+ * priorities (opts->limits, over the shell's, see "limit") are applied
+ * to every stage, which is then also a process (see limits.c).
+ *
+ * Returns the wait status of the last stage waited on, or -errno if a
+ * stage could not be started.
+ */
+static int run_pipeline(char *commands[MAX_PIPELINE][MAX_ARGS],
+                        struct pipeline_opts *opts) {
+    int jobs[MAX_PIPELINE];
+    struct job_stats stats[MAX_PIPELINE];
+    struct ring *rings[MAX_PIPELINE];
+    struct stage_probe probes[MAX_PIPELINE];
+    int num_jobs = 0, num_rings = 0;
+    int prev_read_fd = STDIN_FILENO;
+    struct ring *prev_ring = NULL;
+    size_t ring_size = opts->pipe_size ? opts->pipe_size : get_pipe_size();
+    stage_func func = find_stage_builtin(commands[0]);
+    struct placement *placement =
+        opts->placement ? opts->placement : get_default_placement();
+    int nstages = 0, first_cpu;
+    struct watchdog *watchdog = NULL;
+    double grace, timeout = get_default_timeout(&grace);
+    struct job_limits limits;
+    int ret = 0;
+
+    if (ring_size == 0) {
+        ring_size = DEFAULT_RING_SIZE;
+    }
+    if (opts->timeout > 0) {
+        timeout = opts->timeout;
+    }
+    if (opts->timeout_grace > 0) {
+        grace = opts->timeout_grace;
+    }
+    if (timeout > 0) {
+        ret = watchdog_create(&watchdog, timeout, grace);
+        if (ret < 0) {
+            dprintf(2, "timeout: %s\n", strerror(-ret));
+            return ret;
+        }
+        func = NULL;  // A thread could not be killed
+    }
+    merge_limits(&limits, &opts->limits);
+    if (limits.set) {
+        func = NULL;  // ...or limited on its own
+    }
+    while (commands[nstages][0] != NULL) {
+        nstages++;
+    }
+    first_cpu = placement_start(placement, nstages);
+
+    for (int i = 0; commands[i][0] != NULL; i++) {
+        int pipefd[2] = {-1, STDOUT_FILENO};
+        struct ring *ring = NULL;
+        bool last = commands[i + 1][0] == NULL;
+        stage_func next = last || watchdog || limits.set
+                              ? NULL
+                              : find_stage_builtin(commands[i + 1]);
+
+        int job_id = create_job();
+        if (job_id < 0) {
+            dprintf(2, "Error creating command %d\n", job_id);
+            ret = job_id;
+            break;
+        }
+        jobs[num_jobs++] = job_id;
+        set_job_cpu(job_id, placement_cpu(placement, first_cpu + i));
+        set_job_watchdog(job_id, watchdog);
+        set_job_limits(job_id, &limits);
+
+        // Connect this stage to the next one, unless it is the last
+        if (!last && func && next) {
+            ring = ring_create(ring_size);
+            if (ring == NULL) {
+                ret = -ENOMEM;
+                break;
+            }
+            rings[num_rings++] = ring;
+        } else if (!last) {
+            ret = create_pipe(pipefd, opts->pipe_size);
+            if (ret < 0) {
+                dprintf(2, "failed to generate pipeline - %d\n", ret);
+                break;
+            }
+        }
+
+        // Builtin stages use the shell's descriptors; processes get 0 and 1
+        struct stage_probe *probe = &probes[num_jobs - 1];
+        probe->job_id = job_id;
+        probe->args = commands[i];
+        probe->in_ring = prev_ring;
+        probe->out_ring = ring;
+        probe->in_fd = i == 0 || prev_ring ? -1 : func ? prev_read_fd : 0;
+        probe->out_fd = last || ring ? -1 : func ? pipefd[1] : 1;
+
+        // Both calls close the ends they are handed, even on failure
+        if (func) {
+            struct stream in, out;
+            if (prev_ring) {
+                stream_init_ring(&in, prev_ring, false);
+            } else {
+                stream_init_fd(&in, prev_read_fd, false);
+            }
+            if (ring) {
+                stream_init_ring(&out, ring, true);
+            } else {
+                stream_init_fd(&out, pipefd[1], true);
+            }
+            ret = run_stage(func, commands[i], &in, &out, job_id);
+        } else {
+            ret = run_command(commands[i], prev_read_fd, pipefd[1], job_id);
+            if (ret < 0) {
+                // The stages after it are not started
+                dprintf(2, "thsh: %s: %s\n", commands[i][0], strerror(-ret));
+            }
+        }
+        prev_read_fd = pipefd[0];
+        prev_ring = ring;
+        func = next;
+        if (ret < 0) {
+            break;
+        }
+    }
+    if (prev_read_fd != STDIN_FILENO && prev_read_fd != -1) {
+        close(prev_read_fd);
+    }
+    if (prev_ring) {
+        ring_close_read(prev_ring);
+    }
+
+    if (opts->profile && num_jobs > 0) {
+        profile_pipeline(probes, num_jobs, opts->profile_interval);
+    }
+
+    for (int i = 0; i < num_jobs; i++) {
+        int status = 0;
+        if (wait_on_job_stats(jobs[i], &status, &stats[i]) < 0) {
+            dprintf(2, "Job failed: %d\n", jobs[i]);
+        } else if (ret >= 0) {
+            ret = status;
+        }
+    }
+    if (opts->time) {
+        print_time_report(STDERR_FILENO, commands, stats, num_jobs);
+    }
+    if (watchdog && watchdog_expired(watchdog)) {
+        dprintf(2, "timeout: %s: stopped after %g seconds\n", commands[0][0],
+                timeout);
+        metric_add(METRIC_TIMEOUTS, 1);
+        ret = W_EXITCODE(124, 0);
+    }
+    watchdog_free(watchdog);
+
+    for (int i = 0; i < num_rings; i++) {
+        ring_free(rings[i]);
+    }
+
+    return ret;
+}
+
+/* Run one parsed pipeline: expand its variables, then make any
+ * assignments ("name=value" alone), or else run any prefixes, then a
+ * builtin, or else the pipeline itself.  commands is
+ * not modified, so a loop body can be run again.
+ *
+ * Returns -errno if its words could not be expanded (after reporting
+ * it), otherwise 0 with the command's return value in *status.
+ */
+static int run_parsed(char *commands[MAX_PIPELINE][MAX_ARGS], int *status) {
+    char *expanded[MAX_PIPELINE][MAX_ARGS];
+    char *buf = NULL;  // Only allocated if a word changes
+    size_t size = 0;
+    struct pipeline_opts opts = {0};
+    int ret, substituted;
+
+    ret = substituted = expand_commands(commands, expanded, &buf, &size);
+    if (ret < 0) {
+        dprintf(2, "Expansion error.  Cannot execute command: %s\n",
+                strerror(-ret));
+        free(buf);
+        return ret;
+    }
+
+    if (expanded[1][0] == NULL) {
+        ret = handle_assignments(expanded[0]);
+        if (ret != 0) {
+            // The status of an assignment is its last substitution's
+            if (ret > 0) {
+                ret = substituted ? W_EXITCODE(get_last_status(), 0) : 0;
+            }
+            set_last_status(ret);
+            *status = ret;
+            free(buf);
+            return 0;
+        }
+    }
+
+    ret = handle_prefix(expanded[0], &opts);
+    if (ret >= 0 &&
+        !handle_builtin(expanded[0], STDIN_FILENO, STDOUT_FILENO, &ret)) {
+        trace_event(TRACE_PIPELINE, 'B', expanded[0][0], 0, 0);
+        if (opts.cache) {
+            ret = run_cached(expanded, &opts, run_pipeline);
+        } else {
+            ret = run_pipeline(expanded, &opts);
+        }
+        trace_event(TRACE_PIPELINE, 'E', expanded[0][0], ret, 0);
+    }
+    set_last_status(ret);
+    *status = ret;
+    free(buf);
+    return 0;
+}
+
+/* Parse one pipeline (length bytes in buf) and run it: any prefixes,
+ * then a builtin, or else the pipeline itself.
+ *
+ * Returns -errno if it could not be parsed (after reporting it),
+ * otherwise 0 with the command's return value in *status.
+ */
+static int run_one(char *buf, int length, int *status) {
+    // Buffer for scratch space - optional, only necessary for challenge
+    // problems
+    char scratch[MAX_INPUT];
+    char *parsed_commands[MAX_PIPELINE][MAX_ARGS];
+    char *infile = NULL;
+    char *outfile = NULL;
+    int pipeline_steps = 0;
+
+    // Reset memory from the last iteration
+    for (int i = 0; i < MAX_PIPELINE; i++) {
+        for (int j = 0; j < MAX_ARGS; j++) {
+            parsed_commands[i][j] = NULL;
+        }
+    }
+
+    // Pass it to the parser
+    trace_event(TRACE_PARSE, 'B', NULL, 0, 0);
+    pipeline_steps = parse_line(buf, length, parsed_commands, &infile,
+                                &outfile, scratch, MAX_INPUT);
+    trace_event(TRACE_PARSE, 'E', NULL, pipeline_steps, 0);
+    if (pipeline_steps < 0) {
+        dprintf(2, "Parsing error.  Cannot execute command. %d\n",
+                -pipeline_steps);
+        free(infile);
+        free(outfile);
+        return pipeline_steps;
+    }
+
+    // Just echo the command line for now
+    // file descriptor 1 -> writing to stdout
+    // print the whole cmd string (write number of
+    // chars/bytes equal to the length of cmd, or MAX_INPUT,
+    // whichever is less)
+    //
+    // Comment this line once you implement
+    // command handling
+    // dprintf(1, "%s\n", cmd);
+    int rv = run_parsed(parsed_commands, status);
+
+    // The pipeline is done with its words; a long script or session
+    // must not hold on to every line's
+    for (int i = 0; i < MAX_PIPELINE && parsed_commands[i][0]; i++) {
+        for (int j = 0; j < MAX_ARGS && parsed_commands[i][j]; j++) {
+            free(parsed_commands[i][j]);
+        }
+    }
+    free(infile);
+    free(outfile);
+    return rv;
+}
+
+/* Parse one line of input (length bytes in buf) and run it.  The line
+ * may be a list of pipelines joined by ';', '&&' and '||'; each runs
+ * in turn, and '&&' ('||') skips the next pipeline unless the last one
+ * that ran succeeded (failed).  The line is split once, up front.
+ *
+ * If a command starts an if, while or for, the whole input is parsed
+ * into a tree and run by script.c instead; buf may then hold several
+ * lines.
+ *
+ * Returns -EAGAIN if such a construct is not finished yet, or the line
+ * ends inside quotes or in a backslash (the caller should append the
+ * next line and try again), -errno if the line could not be parsed
+ * or its words expanded (after reporting it, and setting "$?"),
+ * otherwise 0 with the last command's return value in *status.
+ */
+static int run_line(char *buf, int length, int *status) {
+    struct list_item items[MAX_LIST];
+    struct node *tree;
+    int n, ret = 0;
+
+    if (line_continues(buf, length)) {
+        return -EAGAIN;
+    }
+    // A list's pipelines are traced as run_one() parses each of them;
+    // a script's are all parsed here, so it is traced here instead
+    bool script = is_script(buf, length);
+    if (script) {
+        trace_event(TRACE_PARSE, 'B', NULL, 0, 0);
+        n = parse_script(buf, length, &tree);
+        trace_event(TRACE_PARSE, 'E', NULL, n, 0);
+    } else {
+        n = parse_list(buf, length, items);
+    }
+    if (n == -EAGAIN) {
+        return n;
+    }
+    if (n < 0) {
+        dprintf(2, "Parsing error.  Cannot execute command. %d\n", -n);
+        goto fail;
+    }
+
+    if (script) {
+        n = run_script(tree, run_parsed, &ret);
+        free_script(tree);
+        if (n < 0) {
+            goto fail;
+        }
+        *status = ret;
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if ((items[i].op == LIST_AND && ret != 0) ||
+            (items[i].op == LIST_OR && ret == 0)) {
+            continue;
+        }
+        int rv = run_one(items[i].start, items[i].length, &ret);
+        if (rv < 0) {
+            n = rv;
+            goto fail;
+        }
+    }
+
+    *status = ret;
+    return 0;
+
+fail:
+    set_last_status(n);
+    *status = n;
+    return n;
+}
+
+// Commands are typed at a terminal, so lines are edited (see edit.c)
+static bool interactive;
+
+/* Read a line of input from input_fd into *buf (*size bytes, grown
+ * as needed, see read_line()), after writing prompt if it is the
+ * shell's stdin.
+ *
+ * Returns as read_line() does.
+ */
+static int read_input(int input_fd, const char *prompt, char **buf,
+                      size_t *size) {
+    if (interactive) {
+        return edit_line(input_fd, prompt, buf, size);
+    }
+    if (!input_fd) {
+        write(1, prompt, strlen(prompt));
+    }
+    return read_line(input_fd, buf, size);
+}
+
+/* Run a construct that run_line() found unfinished in the first line
+ * read (length bytes in *line, *size bytes), reading more lines from
+ * input_fd into *line until it is complete.  *text is set to the whole
+ * input, to be freed by the caller (and is left NULL if it could not
+ * be allocated).
+ *
+ * Returns as run_line() does, or -EINVAL if the input ends first.
+ */
+static int run_continued(int input_fd, char **line, size_t *size, int length,
+                         int *status, char **text) {
+    size_t len = length, cap = 4 * MAX_INPUT;
+    int rv = -EAGAIN;
+
+    while (len + 1 > cap) {
+        cap *= 2;
+    }
+    *text = malloc(cap);
+    if (*text == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(*text, *line, len);
+
+    while (rv == -EAGAIN) {
+        length = read_input(input_fd, "> ", line, size);
+        if (length <= 0) {
+            dprintf(2, "Parsing error.  Unexpected end of input.\n");
+            rv = -EINVAL;
+            break;
+        }
+        if (len + length + 1 > cap) {
+            char *bigger;
+            while (len + length + 1 > cap) {
+                cap *= 2;
+            }
+            bigger = realloc(*text, cap);
+            if (bigger == NULL) {
+                rv = -ENOMEM;
+                break;
+            }
+            *text = bigger;
+        }
+        memcpy(*text + len, *line, length);
+        len += length;
+        (*text)[len] = '\0';
+        record_text(*text, len);
+        rv = run_line(*text, len, status);
+    }
+    return rv;
+}
+
+/* As run_continued(), for a script file: the construct's later lines
+ * follow the first in the script, so *buf (length bytes) is extended
+ * over them in place.  *buf and *length are updated.
+ */
+static int run_script_continued(struct input *in, char **buf, int *length,
+                                int *status) {
+    int rv = -EAGAIN;
+
+    while (rv == -EAGAIN) {
+        *length = input_more(in, buf);
+        if (*length <= 0) {
+            dprintf(2, "Parsing error.  Unexpected end of input.\n");
+            return -EINVAL;
+        }
+        record_text(*buf, *length);
+        rv = run_line(*buf, *length, status);
+    }
+    return rv;
+}
 
 int main(int argc, char **argv, char **envp) {
     // flag that the program should end
     bool finished = 0;
     int input_fd = 0;  // Default to stdin
+    struct input *script = NULL;
     int ret = 0;
 
     // Lab 2:
@@ -18,128 +473,214 @@ int main(int argc, char **argv, char **envp) {
     // and handling the case where a script is passed as input to your shell
 
     // Lab 2: Your code here
+    bool trace = false, trace_binary = false, fast = false;
+    const char *trace_path = NULL, *record_path = NULL, *replay_path = NULL;
+    const char *command = NULL;
+    bool startup_profile = false;
+    struct timespec start;
+    static const struct option long_opts[] = {
+        {"startup-profile", no_argument, NULL, 'P'}, {NULL, 0, NULL, 0}};
+    int opt;
 
-    ret = init_cwd();
-    if (ret) {
-        dprintf(2, "Error initializing the current working directory: %d\n",
-                ret);
-        return ret;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // -d traces the shell (see trace.c) to -o's file, in binary with -b.
+    // -w records the session to a file; -R replays one (-F: at full
+    // speed) instead of reading commands (see replay.c).  -c runs one
+    // command line and exits with its status.  --startup-profile times
+    // each phase of startup, on stderr.  A script named after the
+    // options is run instead of reading commands from stdin.
+    while ((opt = getopt_long(argc, argv, "dbo:w:R:Fc:", long_opts, NULL)) !=
+           -1) {
+        switch (opt) {
+            case 'P':
+                startup_profile = true;
+                break;
+            case 'c':
+                command = optarg;
+                break;
+            case 'd':
+                trace = true;
+                break;
+            case 'b':
+                trace_binary = true;
+                break;
+            case 'o':
+                trace_path = optarg;
+                break;
+            case 'w':
+                record_path = optarg;
+                break;
+            case 'R':
+                replay_path = optarg;
+                break;
+            case 'F':
+                fast = true;
+                break;
+            default:
+                dprintf(2,
+                        "usage: %s [-d [-b] [-o tracefile]] "
+                        "[-w recording | -R recording [-F]] [-c command] "
+                        "[--startup-profile] [script]\n",
+                        argv[0]);
+                return 1;
+        }
     }
+    if (trace) {
+        if (trace_path == NULL) {
+            trace_path = trace_binary ? "thsh-trace.bin" : "thsh-trace.json";
+        }
+        ret = trace_open(trace_path, trace_binary);
+        if (ret) {
+            dprintf(2, "Error opening trace file %s: %s\n", trace_path,
+                    strerror(-ret));
+            return 1;
+        }
+        atexit(trace_close);
+    }
+
+    if (startup_profile) {
+        startup_profile_begin(&start);
+    }
+    startup_phase("options, trace");
 
-    ret = init_path();
+    // Failing this only loses what forked copies of the shell count
+    metrics_init();
+    startup_phase("metrics_init");
+
+    // Also hands PATH to set_path(); the table is split on first use
+    ret = init_vars(envp);
     if (ret) {
-        dprintf(2, "Error initializing the path table: %d\n", ret);
+        dprintf(2, "Error loading the environment: %d\n", ret);
         return ret;
     }
+    set_subst_runner(run_line);
+    startup_phase("init_vars");
+
+    // init_cwd() waits for the first prompt (or cd), and the path table
+    // and its on-disk cache for the first command that needs them
+    load_path_cache();
+    atexit(save_path_cache);
+    startup_phase("load_path_cache");
+
+    if (record_path) {
+        ret = record_open(record_path);
+        if (ret) {
+            dprintf(2, "Error opening recording %s: %s\n", record_path,
+                    strerror(-ret));
+            return 1;
+        }
+        atexit(record_close);
+    }
+    if (command) {
+        size_t len = strlen(command);
+        char *line = malloc(len + 2);
+        int status = 0;
+
+        startup_phase(NULL);
+        if (line == NULL) {
+            return 1;
+        }
+        // The parser is handed a line of its own, as if just read
+        memcpy(line, command, len);
+        strcpy(line + len, "\n");
+        if (run_line(line, len + 1, &status) == -EAGAIN) {
+            dprintf(2, "Parsing error.  Unexpected end of input.\n");
+            set_last_status(-EINVAL);
+        }
+        free(line);
+        return get_last_status();
+    }
+    if (replay_path) {
+        ret = replay(replay_path, fast, run_line);
+        if (ret) {
+            dprintf(2, "Error replaying %s: %s\n", replay_path,
+                    strerror(-ret));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (optind < argc) {
+        ret = input_open(&script, argv[optind]);
+        if (ret) {
+            dprintf(2, "Error opening script %s: %s\n", argv[optind],
+                    strerror(-ret));
+            return 1;
+        }
+    }
+
+    // Typed at a terminal: lines are edited, with completion
+    interactive = !script && edit_available(input_fd);
+
+    // Buffer to hold input, grown to fit the longest line so far
+    char *cmd = NULL;
+    size_t cmd_size = 0;
 
     while (!finished) {
         int length;
-        // Buffer to hold input
-        char cmd[MAX_INPUT];
-        // Buffer for scratch space - optional, only necessary for challenge
-        // problems
-        char scratch[MAX_INPUT];
-        // Get a pointer to cmd that type-checks with char *
-        char *buf = &cmd[0];
-        char *parsed_commands[MAX_PIPELINE][MAX_ARGS];
-        char *infile = NULL;
-        char *outfile = NULL;
-        int pipeline_steps = 0;
-
-        if (!input_fd) {
-            ret = print_prompt();
-            if (ret <= 0) {
-                // if we printed 0 bytes, this call failed and the program
-                // should end -- this will likely never occur.
-                finished = true;
-                break;
-            }
-        }
+        // The line: in cmd, or in the script
+        char *buf = NULL;
 
-        // Reset memory from the last iteration
-        for (int i = 0; i < MAX_PIPELINE; i++) {
-            for (int j = 0; j < MAX_ARGS; j++) {
-                parsed_commands[i][j] = NULL;
-            }
+        // The prompt is only rebuilt when the directory changes
+        const char *prompt = get_prompt();
+        if (prompt == NULL) {
+            // if we cannot print the prompt, the program
+            // should end -- this will likely never occur.
+            finished = true;
+            break;
+        }
+        // Only the first does anything
+        startup_phase("first prompt");
+        startup_phase(NULL);
+        // Read the command names in the background (once PATH changes)
+        if (interactive) {
+            complete_start();
         }
 
+        // Events from the last line are complete; write them out
+        trace_flush();
+
         // Read a line of input
-        length = read_one_line(input_fd, buf, MAX_INPUT);
+        trace_event(TRACE_READ, 'B', NULL, 0, 0);
+        if (script) {
+            // A slice of the script itself, not a copy in cmd
+            length = input_next(script, &buf);
+        } else {
+            length = read_input(input_fd, prompt, &cmd, &cmd_size);
+            buf = cmd;
+        }
+        trace_event(TRACE_READ, 'E', NULL, 0, 0);
         if (length <= 0) {
             ret = length;
             break;
         }
 
         // Add it to the history
-        // add_history_line(buf);
-
-        // Pass it to the parser
-        pipeline_steps = parse_line(buf, length, parsed_commands, &infile,
-                                    &outfile, scratch, MAX_INPUT);
-        if (pipeline_steps < 0) {
-            dprintf(2, "Parsing error.  Cannot execute command. %d\n",
-                    -pipeline_steps);
-            continue;
+        if (interactive) {
+            add_history_line(buf);
         }
 
-        // Just echo the command line for now
-        // file descriptor 1 -> writing to stdout
-        // print the whole cmd string (write number of
-        // chars/bytes equal to the length of cmd, or MAX_INPUT,
-        // whichever is less)
-        //
-        // Comment this line once you implement
-        // command handling
-        // dprintf(1, "%s\n", cmd);
-        int handled = handle_builtin((char **)parsed_commands, 0, 1, &ret);
-        if (handled == 0) {
-            int pipefd[2] = {-1, -1};
-            int prev_read_fd = -1;
-            int *jobList = (int *)malloc(sizeof(int) * 50);
-            int numOfJobs = 0;
-            for (int i = 0; parsed_commands[i][0] != '\0'; i++) {
-                int job_id = create_job();
-                if (job_id < 0) {
-                    free(jobList);
-                    dprintf(2, "Error creating command %d\n", job_id);
-                }
-                jobList[numOfJobs++] = job_id;
-                // Last command in pipeline
-                if (parsed_commands[i + 1][0] == '\0') {
-                    ret = run_command(
-                        parsed_commands[i],
-                        prev_read_fd == -1 ? STDIN_FILENO : prev_read_fd,
-                        STDOUT_FILENO, job_id);
-                    if (prev_read_fd != -1) close(prev_read_fd);
-                    break;
-                }
-
-                // Create new pipe for next command
-                if (pipe(pipefd) == -1) {
-                    if (prev_read_fd != -1) close(prev_read_fd);
-                    dprintf(2, "failed to generate pipeline - %d\n", -errno);
-                }
-
-                // Run command with appropriate fds
-                ret = run_command(
-                    parsed_commands[i],
-                    prev_read_fd == -1 ? STDIN_FILENO : prev_read_fd, pipefd[1],
-                    job_id);
-
-                // Cleanup current pipe iteration
-                if (prev_read_fd != -1) close(prev_read_fd);
-                close(pipefd[1]);
-                prev_read_fd = pipefd[0];  // Save read end for next iteration
-            }
-            printf("Ret code: %d\n", ret);
-            for (int i = 0; i < numOfJobs; i++) {
-                wait_on_job(jobList[i], &ret);
-                if (ret < 0) {
-                    dprintf(2, "Job failed: %d", jobList[i]);
-                    free(jobList);
-                }
-            }
+        char *text = NULL;
+        record_start();
+        record_text(buf, length);
+        int rv = run_line(buf, length, &ret);
+        if (rv == -EAGAIN && script) {
+            rv = run_script_continued(script, &buf, &length, &ret);
+        } else if (rv == -EAGAIN) {
+            rv = run_continued(input_fd, &cmd, &cmd_size, length, &ret,
+                               &text);
+        }
+        free(text);
+        if (rv < 0) {
+            set_last_status(rv);  // Reported already
+            ret = rv;
+        }
+        record_line(ret);
+        if (rv < 0) {
+            continue;  // Not a command that failed, so not reported as one
         }
+
         // In Lab 2, you will need to add code to actually run the commands,
         // add debug printing, and handle redirection and pipelines, as
         // explained in the handout.
@@ -162,6 +703,9 @@ int main(int argc, char **argv, char **envp) {
         }
     }
 
+    input_close(script);
+    free(cmd);
+
     // Only return a non-zero value from main() if the shell itself
     // has a bug.  Do not use this to indicate a failed command.
     return 0;
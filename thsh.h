@@ -6,9 +6,12 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
 // Assume a pipeline will never be longer than 31 stages (+NULL)
@@ -17,31 +20,326 @@
 // Assume any individual command will not have more than 15 arguments (+NULL)
 #define MAX_ARGS 16
 
+struct placement;
+struct watchdog;
+
+// Something a cached pipeline's output depends on (see cache.c)
+struct cache_dep {
+    char kind;  // 'f': a file's contents, 'm': its mtime, 'e': a variable
+    const char *name;
+};
+
+// Resource limits and priorities for a pipeline's processes (see limits.c)
+struct job_limits {
+    unsigned set;  // Which of these are given
+    rlim_t cpu, as, nofile, nproc;  // For setrlimit()
+    int nice;
+    int io_class, io_level;
+};
+
+// Per-pipeline settings, filled in by prefix builtins (e.g., "pipesz")
+struct pipeline_opts {
+    int pipe_size;  // Capacity of inter-stage pipes in bytes, 0 = default
+    struct placement *placement;  // CPUs for the stages, NULL = default
+    bool time;  // Report resource usage when the pipeline finishes
+    bool profile;             // Sample the stages while they run
+    double profile_interval;  // Seconds between live reports, 0 = at end
+    bool cache;                // Replay the output if run before, or store it
+    double timeout;  // Seconds it may run, 0 = the shell default
+    double timeout_grace;  // ...then from SIGTERM to SIGKILL, 0 = default
+    struct job_limits limits;  // Over the shell defaults, see "limit"
+    int cache_ndeps;
+    struct cache_dep cache_deps[MAX_ARGS / 2];
+};
+
+// What a job cost, from wait_on_job_stats()
+struct job_stats {
+    struct timespec start;  // First process started (CLOCK_MONOTONIC)
+    struct timespec end;    // Last process reaped
+    struct rusage ru;       // Summed over the processes; max RSS is the max
+};
+
 // Disallow exec*p* variants, lest we spoil the fun
 #pragma GCC poison execlp execvp execvpe
 
+// Assume a line will never chain more than 32 pipelines with ; && ||
+#define MAX_LIST 32
+
+// How a pipeline in a command list is joined to the one before it
+enum list_op {
+    LIST_SEQ,  // ';' (or the first): always runs
+    LIST_AND,  // '&&': runs if the one before succeeded
+    LIST_OR,   // '||': runs if the one before failed
+};
+
+// Stands in for a quoted '$' in a parsed word, which is not expanded
+#define QUOTED_DOLLAR '\001'
+// Stands in for the '$' of a "$(...)" inside double quotes, which is
+// not split into fields
+#define QUOTED_SUBST '\002'
+
+struct list_item {
+    enum list_op op;
+    char *start;    // Text of the pipeline, within the line
+    size_t length;  // ...not NUL-terminated
+};
+
 // Helper functions
 
 // In parse.c:
 int read_one_line(int input_fd, char *buf, size_t size);
+int read_line(int input_fd, char **buf, size_t *size);
 int parse_line(char *inbuf, size_t length,
                char *commands[MAX_PIPELINE][MAX_ARGS], char **infile,
                char **outfile, char *scratch, size_t scratch_len);
+int parse_list(char *inbuf, size_t length, struct list_item items[MAX_LIST]);
+size_t subst_length(const char *p, size_t len);
+size_t quote_length(const char *p, size_t len);
+bool line_continues(const char *buf, size_t length);
 
 // In builtin.c:
 int init_cwd(void);
 int handle_builtin(char *args[MAX_ARGS], int stdin, int stdout, int *retval);
+int handle_prefix(char *args[MAX_ARGS], struct pipeline_opts *opts);
+void print_time_report(int fd, char *commands[MAX_PIPELINE][MAX_ARGS],
+                       struct job_stats stats[], int nstages);
+const char *get_prompt(void);
 int print_prompt(void);
+const char *builtin_name(int i);
+
+// In ring.c:
+struct ring;
+struct ring *ring_create(size_t size);
+void ring_free(struct ring *r);
+size_t ring_peek(struct ring *r, char **data);
+void ring_consume(struct ring *r, size_t n);
+int ring_write(struct ring *r, const char *data, size_t len);
+void ring_close_write(struct ring *r);
+void ring_close_read(struct ring *r);
+void ring_stats(struct ring *r, size_t *written, size_t *read,
+                size_t *size);
+
+// In stage.c:
+// One end of a builtin stage's input or output: either a file
+// descriptor, or a ring shared with an adjacent builtin stage.
+struct stream {
+    int fd;             // -1 if this is a ring
+    struct ring *ring;  // NULL if this is a descriptor
+    bool output;        // Stage writes (rather than reads) this end
+    char *buf;          // Descriptors only: buffered bytes
+    size_t start, end;  // Unread (input) or unwritten (output) part of buf
+};
+typedef int (*stage_func)(char *args[MAX_ARGS], struct stream *in,
+                          struct stream *out);
+stage_func find_stage_builtin(char *args[MAX_ARGS]);
+const char *stage_builtin_name(int i);
+void stream_init_fd(struct stream *s, int fd, bool output);
+void stream_init_ring(struct stream *s, struct ring *ring, bool output);
+void stream_close(struct stream *s);
 
 // In jobs.c:
 int init_path(void);
+int set_path(const char *path);
+void load_path_cache(void);
+void save_path_cache(void);
 void print_path_table(void);
+char **get_path_table(void);
 int create_job(void);
 int run_command(char *args[MAX_ARGS], int stdin, int stdout, int job_id);
+int run_stage(stage_func func, char *args[MAX_ARGS], struct stream *in,
+              struct stream *out, int job_id);
+pid_t job_task(int job_id, bool *thread);
+bool job_finished(int job_id);
 int wait_on_job(int job_id, int *exit_code);
+int wait_on_job_stats(int job_id, int *exit_code, struct job_stats *stats);
+void rusage_add(struct rusage *sum, const struct rusage *ru);
+int set_job_cpu(int job_id, int cpu);
+int set_job_watchdog(int job_id, struct watchdog *w);
+int set_job_limits(int job_id, const struct job_limits *l);
+int create_pipe(int pipefd[2], int size);
+int probe_pipe_size(int size);
+int set_pipe_size(int size);
+int get_pipe_size(void);
+
+// In affinity.c:
+struct placement *find_placement(const char *spec);
+int placement_start(struct placement *pl, int nstages);
+int placement_cpu(const struct placement *pl, int stage);
+struct placement *get_default_placement(void);
+void set_default_placement(struct placement *pl);
+void print_topology(int fd);
+
+// In profile.c:
+// Where to look for one pipeline stage's progress.  The descriptors
+// are numbers in the stage's own table (0 and 1 for a process) or in
+// the shell's (for a builtin stage thread), -1 if the end is not a
+// pipe.
+struct stage_probe {
+    int job_id;
+    char **args;
+    int in_fd, out_fd;
+    struct ring *in_ring, *out_ring;  // Set instead, for ring ends
+};
+int profile_pipeline(struct stage_probe probes[], int nstages,
+                     double interval);
+// Startup work put off until first needed (see --startup-profile)
+enum deferred_phase {
+    DEFER_CWD,      // init_cwd(), at the first prompt or cd
+    DEFER_PATH,     // Splitting PATH, at the first command lookup
+    DEFER_HISTORY,  // load_history(), when the history is first used
+    DEFER_COUNT,
+};
+void startup_profile_begin(const struct timespec *start);
+void startup_phase(const char *name);
+int deferred_phase(enum deferred_phase id, int (*fn)(void));
+
+// In trace.c:
+// What a trace event records; see trace_event()
+enum trace_type {
+    TRACE_READ,       // Reading a command line
+    TRACE_PARSE,      // Parsing it
+    TRACE_PIPELINE,   // Running a whole pipeline
+    TRACE_BUILTIN,    // Running a builtin in the shell
+    TRACE_LOOKUP,     // Searching the path for a command
+    TRACE_FORK,       // fork() in the parent
+    TRACE_EXEC,       // The child's execve() succeeded
+    TRACE_EXEC_FAIL,  // The child's execve() failed
+    TRACE_STAGE,      // A builtin stage thread runs
+    TRACE_REAP,       // A child or stage thread was waited on
+};
+int trace_open(const char *path, bool binary);
+void trace_event(int type, char phase, const char *name, int arg0,
+                 int arg1);
+void trace_flush(void);
+void trace_close(void);
+
+// In metrics.c:
+enum metric_id {
+    METRIC_LINES,          // Command lines parsed
+    METRIC_TOKENS,         // Words parsed out of them
+    METRIC_PARSE_ALLOCS,   // Allocations made by the parser
+    METRIC_PARSE_BYTES,    // ...and their total size
+    METRIC_JOB_ALLOCS,     // Allocations made launching jobs
+    METRIC_JOB_BYTES,      // ...and their total size
+    METRIC_PATH_HITS,      // Commands found in the path cache
+    METRIC_PATH_MISSES,    // Commands searched for in the path
+    METRIC_ACCESS_CALLS,   // access() calls made searching
+    METRIC_FORKS,          // Processes forked
+    METRIC_EXEC_FAILURES,  // execve() calls that failed in a child
+    METRIC_ENVP_BUILDS,    // Times the environment for commands was rebuilt
+    METRIC_SUBSTITUTIONS,  // Command substitutions run
+    METRIC_CACHE_HITS,     // Cached pipelines replayed from the store
+    METRIC_CACHE_MISSES,   // ...and run (and stored)
+    METRIC_PATH_DB_HITS,   // Path cache misses found in the on-disk copy
+    METRIC_TIMEOUTS,       // Pipelines stopped at their deadline
+    METRIC_COUNT
+};
+int metrics_init(void);
+void metric_add(enum metric_id id, unsigned long n);
+void metric_wait(const struct timespec *start, const struct timespec *end);
+void metrics_reset(void);
+void print_metrics(int fd);
+int write_metrics(const char *path);
+int set_metrics_dump(const char *path, double interval);
+
+// In replay.c:
+int record_open(const char *path);
+void record_start(void);
+void record_text(const char *line, int length);
+void record_line(int status);
+void record_close(void);
+int replay(const char *path, bool fast,
+           int (*run)(char *line, int length, int *status));
+
+// In vars.c:
+struct var;
+int init_vars(char **env);
+struct var *find_var(const char *name, bool create);
+int set_var(const char *name, const char *value);
+void bind_var(struct var *v, char *value);
+int unbind_var(struct var *v);
+int export_var(const char *name, const char *value);
+void unset_var(const char *name);
+const char *get_var(const char *name);
+char **get_envp(void);
+void print_exports(int fd);
+int handle_assignments(char *args[MAX_ARGS]);
+void set_last_status(int status);
+int get_last_status(void);
+bool valid_name(const char *name, size_t len);
+int expand_word(char *word, char **buf, size_t *size, size_t used,
+                char **out);
+int expand_commands(char *commands[MAX_PIPELINE][MAX_ARGS],
+                    char *out[MAX_PIPELINE][MAX_ARGS], char **buf,
+                    size_t *size);
+
+// In subst.c:
+struct capture;
+void set_subst_runner(int (*run)(char *line, int length, int *status));
+int capture_begin(struct capture **cp, bool tee);
+int capture_end(struct capture *c, char **out, size_t *outlen);
+int capture_output(const char *cmd, size_t len, char **out, size_t *outlen);
+bool in_subshell(void);
+
+// In cache.c:
+int cache_dir(char dir[PATH_MAX]);
+int run_cached(char *commands[MAX_PIPELINE][MAX_ARGS],
+               struct pipeline_opts *opts,
+               int (*run)(char *commands[MAX_PIPELINE][MAX_ARGS],
+                          struct pipeline_opts *opts));
+
+// In pathdb.c:
+int pathdb_open(char **table);
+void pathdb_close(void);
+const char *pathdb_lookup(const char *name);
+int pathdb_save(char **names, char **paths, int n);
+
+// In complete.c:
+void complete_path_changed(void);
+void complete_start(void);
+int complete_word(const char *line, size_t len, char *insert, size_t size,
+                  int list_fd);
+
+// In edit.c:
+bool edit_available(int fd);
+int edit_line(int fd, const char *prompt, char **buf, size_t *size);
+
+// In watchdog.c:
+void set_default_timeout(double secs, double grace);
+double get_default_timeout(double *grace);
+int watchdog_create(struct watchdog **wp, double secs, double grace);
+void watchdog_child(const struct watchdog *w);
+int watchdog_add(struct watchdog *w, pid_t pid);
+int watchdog_wait(struct watchdog *w, pid_t pid);
+bool watchdog_expired(const struct watchdog *w);
+void watchdog_free(struct watchdog *w);
+
+// In input.c:
+struct input;
+int input_open(struct input **ip, const char *path);
+int input_next(struct input *in, char **line);
+int input_more(struct input *in, char **line);
+void input_close(struct input *in);
+
+// In limits.c:
+int parse_limits(char **args, struct job_limits *l);
+void merge_limits(struct job_limits *l, const struct job_limits *over);
+void set_default_limits(const struct job_limits *l);
+void print_limits(int fd);
+int apply_limits(const struct job_limits *l);
+
+// In script.c:
+struct node;
+// Runs one parsed pipeline, leaving its return value in *status
+typedef int (*run_func)(char *commands[MAX_PIPELINE][MAX_ARGS], int *status);
+bool is_script(char *text, size_t length);
+int parse_script(char *text, size_t length, struct node **tree);
+int run_script(struct node *list, run_func run, int *status);
+void free_script(struct node *list);
 
 // In history.c (optional - challenge only)
 void add_history_line(char *line);
+const char *history_line(int back);
 void clear_history(void);
 void print_history(int stdout);
 int save_history(void);
@@ -0,0 +1,235 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements the -d tracing mode.  The shell records a
+ * timestamped event as each command line is read and parsed, as
+ * builtins run, and as each stage is looked up, forked, exec'd and
+ * reaped; the events are written out as a Chrome trace (load it in
+ * chrome://tracing or Perfetto to see spawn latency on a timeline), or
+ * in a compact binary form.
+ *
+ * Events go into a fixed array of slots in shared anonymous memory, so
+ * that a forked copy of the shell running a substitution (see subst.c)
+ * records its events there too.  A writer (the shell, a stage thread
+ * or such a copy) claims a slot with one atomic add, fills
+ * it in, and marks it ready; nothing takes a lock.  When the array is
+ * full, events are counted as dropped rather than overwriting ones
+ * not yet written out.
+ *
+ * The array is only drained between command lines, when every stage
+ * of the last pipeline has finished, so no writer can still be
+ * filling in a slot.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+// Events held between flushes (64 bytes each)
+#define TRACE_SLOTS (64 << 10)
+
+// Header of the binary format, followed by the events as stored
+#define TRACE_MAGIC "THSHTRC1"
+
+struct trace_event {
+    uint64_t ts;     // CLOCK_MONOTONIC, in nanoseconds
+    int32_t tid;     // Thread or process that recorded it
+    int32_t arg0;    // Depends on the type; see trace_names
+    int32_t arg1;
+    uint16_t type;   // enum trace_type
+    char phase;      // 'B'egin, 'E'nd, or 'i'nstant
+    _Atomic uint8_t ready;  // Filled in
+    char name[40];   // Command, NUL-terminated (possibly truncated)
+};
+
+struct trace_buf {
+    _Atomic uint64_t next;     // Slots claimed since the last flush
+    _Atomic uint64_t dropped;  // Events lost to a full array
+    struct trace_event events[TRACE_SLOTS];
+};
+
+// Names of each type of event, and of its two arguments (if used)
+static const char *trace_names[][3] = {
+    [TRACE_READ] = {"read", NULL, NULL},
+    [TRACE_PARSE] = {"parse", "stages", NULL},
+    [TRACE_PIPELINE] = {"pipeline", "status", NULL},
+    [TRACE_BUILTIN] = {"builtin", "status", NULL},
+    [TRACE_LOOKUP] = {"lookup", "errno", NULL},
+    [TRACE_FORK] = {"fork", "pid", NULL},
+    [TRACE_EXEC] = {"exec", NULL, NULL},
+    [TRACE_EXEC_FAIL] = {"exec failed", "errno", NULL},
+    [TRACE_STAGE] = {"stage", "status", NULL},
+    [TRACE_REAP] = {"reap", "pid", "status"},
+};
+
+static struct trace_buf *trace_buf;
+static int trace_fd = -1;
+static bool trace_binary;
+static bool trace_first = true;  // No JSON event written yet
+static pid_t trace_pid;
+
+/* Start tracing to the file at path, as Chrome trace-event JSON or (if
+ * binary) in the compact format.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int trace_open(const char *path, bool binary) {
+    trace_buf = mmap(NULL, sizeof(struct trace_buf), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_buf == MAP_FAILED) {
+        trace_buf = NULL;
+        return -errno;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        int rv = -errno;
+        munmap(trace_buf, sizeof(struct trace_buf));
+        trace_buf = NULL;
+        return rv;
+    }
+
+    trace_binary = binary;
+    trace_pid = getpid();
+    if (binary) {
+        uint32_t size = sizeof(struct trace_event);
+        write(trace_fd, TRACE_MAGIC, 8);
+        write(trace_fd, &size, sizeof(size));
+    } else {
+        dprintf(trace_fd, "[\n");
+    }
+    return 0;
+}
+
+/* Record an event, if tracing is on.
+ *
+ * type: what happened (enum trace_type)
+ * phase: 'B' when it starts, 'E' when it ends, 'i' for an instant
+ * name: the command involved, or NULL
+ * arg0, arg1: details; see trace_names for what they mean per type
+ */
+void trace_event(int type, char phase, const char *name, int arg0,
+                 int arg1) {
+    struct trace_buf *tb = trace_buf;
+    struct timespec ts;
+
+    if (tb == NULL) {
+        return;
+    }
+    uint64_t slot = atomic_fetch_add_explicit(&tb->next, 1,
+                                              memory_order_relaxed);
+    if (slot >= TRACE_SLOTS) {
+        atomic_fetch_add_explicit(&tb->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct trace_event *ev = &tb->events[slot];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->ts = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    ev->tid = gettid();
+    ev->arg0 = arg0;
+    ev->arg1 = arg1;
+    ev->type = type;
+    ev->phase = phase;
+    ev->name[0] = '\0';
+    if (name) {
+        strncat(ev->name, name, sizeof(ev->name) - 1);
+    }
+    atomic_store_explicit(&ev->ready, 1, memory_order_release);
+}
+
+static void write_json(int fd, struct trace_event *ev) {
+    const char **names = trace_names[ev->type];
+
+    dprintf(fd, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+                "\"pid\":%d,\"tid\":%d",
+            trace_first ? "" : ",\n", names[0], ev->phase,
+            (unsigned long long)ev->ts / 1000,
+            (unsigned long long)ev->ts % 1000, trace_pid, ev->tid);
+    if (ev->phase == 'i') {
+        dprintf(fd, ",\"s\":\"t\"");
+    }
+
+    dprintf(fd, ",\"args\":{");
+    const char *sep = "";
+    if (ev->name[0]) {
+        // Commands are written as given, so escape what JSON requires
+        dprintf(fd, "\"cmd\":\"");
+        for (char *p = ev->name; *p; p++) {
+            if (*p == '"' || *p == '\\') {
+                dprintf(fd, "\\%c", *p);
+            } else if ((unsigned char)*p < 0x20) {
+                dprintf(fd, "\\u%04x", *p);
+            } else {
+                dprintf(fd, "%c", *p);
+            }
+        }
+        dprintf(fd, "\"");
+        sep = ",";
+    }
+    // Arguments are only meaningful once the event is done
+    if (names[1] && ev->phase != 'B') {
+        dprintf(fd, "%s\"%s\":%d", sep, names[1], ev->arg0);
+        if (names[2]) {
+            dprintf(fd, ",\"%s\":%d", names[2], ev->arg1);
+        }
+    }
+    dprintf(fd, "}}");
+    trace_first = false;
+}
+
+/* Write out the events recorded since the last flush, and empty the
+ * array.  Only call this while no stage is running.
+ */
+void trace_flush(void) {
+    struct trace_buf *tb = trace_buf;
+
+    if (tb == NULL) {
+        return;
+    }
+    uint64_t n = atomic_load(&tb->next);
+    if (n > TRACE_SLOTS) {
+        n = TRACE_SLOTS;
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        struct trace_event *ev = &tb->events[i];
+        if (!atomic_load_explicit(&ev->ready, memory_order_acquire)) {
+            continue;  // Claimed by a writer that never finished
+        }
+        if (trace_binary) {
+            write(trace_fd, ev, sizeof(*ev));
+        } else {
+            write_json(trace_fd, ev);
+        }
+        atomic_store_explicit(&ev->ready, 0, memory_order_relaxed);
+    }
+    atomic_store(&tb->next, 0);
+}
+
+/* Flush any remaining events, note how many were dropped, and close
+ * the trace file.  Tracing is off afterwards.
+ */
+void trace_close(void) {
+    if (trace_buf == NULL) {
+        return;
+    }
+    trace_flush();
+    uint64_t dropped = atomic_load(&trace_buf->dropped);
+    if (!trace_binary) {
+        dprintf(trace_fd, "\n]\n");
+    }
+    if (dropped) {
+        dprintf(2, "trace: %llu events dropped\n",
+                (unsigned long long)dropped);
+    }
+    close(trace_fd);
+    munmap(trace_buf, sizeof(struct trace_buf));
+    trace_buf = NULL;
+    trace_fd = -1;
+}
@@ -0,0 +1,570 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements shell variables and their expansion.
+ *
+ * Variables live in a hash table, seeded from the environment the
+ * shell starts with the first time one is used (so a shell that never
+ * looks at a variable never copies it).  Exported ones make up the
+ * environment of every command the shell runs; that envp array is only
+ * rebuilt when an exported variable has changed since it was last
+ * built, so running a command normally costs nothing here.  Setting
+ * PATH reloads the path table (see jobs.c).
+ *
+ * Unset variables keep their (empty) entry, so a pointer to one (as a
+ * for loop holds) never dangles.
+ *
+ * Words are expanded when a command runs, not when it is parsed, so a
+ * parsed loop body can be run again with new values: "$name" and
+ * "${name}" become the variable's value (or nothing), "$?" the status
+ * of the last command, and "$(cmd)" what cmd prints (see subst.c).  A
+ * word that expands to nothing is dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "thsh.h"
+
+// Buckets in the variable table; a power of two
+#define VAR_BUCKETS 256
+
+// First size of an expansion buffer, which is doubled as needed
+#define EXPAND_SIZE 4096
+
+struct var {
+    char *name;
+    char *value;    // NULL if unset
+    bool borrowed;  // value belongs to someone else (e.g., a loop)
+    bool exported;
+    struct var *next;
+};
+
+static struct var *vars[VAR_BUCKETS];
+static int last_status;
+
+// Command substitutions run so far, so a caller can tell if any ran
+static unsigned long substitutions;
+
+// The environment the shell started with, until it is loaded
+static char **initial_env;
+static bool imported, importing;
+
+// The environment for commands, and whether it is out of date
+static char **envp;
+static int nexported;
+static bool envp_stale = true;
+
+static unsigned int hash_var(const char *name) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h & (VAR_BUCKETS - 1);
+}
+
+static void import_env(void);
+
+static void set_value(struct var *v, char *value, bool borrowed) {
+    if (!v->borrowed) {
+        free(v->value);
+    }
+    v->value = value;
+    v->borrowed = borrowed;
+    if (v->exported) {
+        envp_stale = true;
+    }
+    if (strcmp(v->name, "PATH") == 0 && !importing) {
+        set_path(value);  // init_vars() did this for the initial one
+    }
+}
+
+/* Find the shell variable name, creating it (unset) if create is set.
+ *
+ * Returns NULL if there is no such variable, or it cannot be created.
+ */
+struct var *find_var(const char *name, bool create) {
+    struct var **bucket = &vars[hash_var(name)];
+    struct var *v;
+
+    import_env();
+    for (v = *bucket; v; v = v->next) {
+        if (strcmp(v->name, name) == 0) {
+            return v;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    v = calloc(1, sizeof(struct var));
+    if (v == NULL || (v->name = strdup(name)) == NULL) {
+        free(v);
+        return NULL;
+    }
+    v->next = *bucket;
+    *bucket = v;
+    return v;
+}
+
+/* Set a shell variable to a copy of value.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int set_var(const char *name, const char *value) {
+    struct var *v = find_var(name, true);
+    char *copy = strdup(value);
+
+    if (v == NULL || copy == NULL) {
+        free(copy);
+        return -ENOMEM;
+    }
+    set_value(v, copy, false);
+    return 0;
+}
+
+/* Point v at value without copying it; the caller keeps value alive
+ * until the variable is set or bound again.  This is how a for loop
+ * steps its variable through the words of its list.
+ */
+void bind_var(struct var *v, char *value) {
+    set_value(v, value, true);
+}
+
+/* Give v its own copy of the value it is bound to (see bind_var()), so
+ * the caller may let that go.  A variable set since is left alone.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+int unbind_var(struct var *v) {
+    char *copy;
+
+    if (!v->borrowed || v->value == NULL) {
+        return 0;
+    }
+    copy = strdup(v->value);
+    if (copy == NULL) {
+        return -ENOMEM;
+    }
+    set_value(v, copy, false);
+    return 0;
+}
+
+/* Mark name for export, setting it to value first if that is not
+ * NULL.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int export_var(const char *name, const char *value) {
+    struct var *v;
+
+    if (value && set_var(name, value) < 0) {
+        return -ENOMEM;
+    }
+    v = find_var(name, true);
+    if (v == NULL) {
+        return -ENOMEM;
+    }
+    if (!v->exported) {
+        v->exported = true;
+        nexported++;
+        envp_stale = true;
+    }
+    return 0;
+}
+
+/* Unset name, and stop exporting it. */
+void unset_var(const char *name) {
+    struct var *v = find_var(name, false);
+
+    if (v == NULL || (v->value == NULL && !v->exported)) {
+        return;
+    }
+    if (v->exported) {
+        v->exported = false;
+        nexported--;
+    }
+    envp_stale = true;
+    set_value(v, NULL, false);
+}
+
+/* Look up name.
+ *
+ * Returns the value, or NULL if it is not set.
+ */
+const char *get_var(const char *name) {
+    struct var *v = find_var(name, false);
+
+    return v ? v->value : NULL;
+}
+
+/* Take the environment the shell started with.  Only PATH is looked at
+ * now; the rest is loaded into the table (all exported) the first time
+ * a variable is used, and until then commands get env as it is.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int init_vars(char **env) {
+    initial_env = env;
+    for (int i = 0; env && env[i]; i++) {
+        if (strncmp(env[i], "PATH=", 5) == 0) {
+            return set_path(env[i] + 5);
+        }
+    }
+    return 0;
+}
+
+/* Load the initial environment into the table, if not done yet. */
+static void import_env(void) {
+    if (imported) {
+        return;
+    }
+    imported = true;
+    importing = true;
+    for (int i = 0; initial_env && initial_env[i]; i++) {
+        char *eq = strchr(initial_env[i], '=');
+        char name[256];
+
+        if (eq == NULL || eq - initial_env[i] >= (long)sizeof(name)) {
+            continue;
+        }
+        memcpy(name, initial_env[i], eq - initial_env[i]);
+        name[eq - initial_env[i]] = '\0';
+        export_var(name, eq + 1);
+    }
+    importing = false;
+}
+
+/* The environment to run commands with: "name=value" for each exported
+ * variable that is set.  It is rebuilt only if an exported variable
+ * has changed since the last call, and belongs to this file.
+ *
+ * Returns the array, or NULL if it could not be built.
+ */
+char **get_envp(void) {
+    char **env;
+    int n = 0;
+
+    if (!imported) {
+        return initial_env;  // Nothing has been changed
+    }
+    if (!envp_stale) {
+        return envp;
+    }
+
+    env = malloc(sizeof(char *) * (nexported + 1));
+    if (env == NULL) {
+        return NULL;
+    }
+    for (int b = 0; b < VAR_BUCKETS; b++) {
+        for (struct var *v = vars[b]; v; v = v->next) {
+            if (!v->exported || v->value == NULL) {
+                continue;
+            }
+            if (asprintf(&env[n], "%s=%s", v->name, v->value) < 0) {
+                while (n > 0) {
+                    free(env[--n]);
+                }
+                free(env);
+                return NULL;
+            }
+            n++;
+        }
+    }
+    env[n] = NULL;
+
+    for (int i = 0; envp && envp[i]; i++) {
+        free(envp[i]);
+    }
+    free(envp);
+    envp = env;
+    envp_stale = false;
+    metric_add(METRIC_ENVP_BUILDS, 1);
+    return envp;
+}
+
+/* Print the exported variables to fd, as "export" commands. */
+void print_exports(int fd) {
+    import_env();
+    for (int b = 0; b < VAR_BUCKETS; b++) {
+        for (struct var *v = vars[b]; v; v = v->next) {
+            if (v->exported) {
+                dprintf(fd, "export %s%s%s\n", v->name, v->value ? "=" : "",
+                        v->value ? v->value : "");
+            }
+        }
+    }
+}
+
+/* If args is nothing but assignments ("name=value ..."), make them.
+ *
+ * Returns 1 if it was, 0 if it is a command, or -errno on failure.
+ */
+int handle_assignments(char *args[MAX_ARGS]) {
+    int i;
+
+    for (i = 0; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+        if (eq == NULL || !valid_name(args[i], eq - args[i])) {
+            return 0;
+        }
+    }
+    if (i == 0) {
+        return 0;
+    }
+
+    for (i = 0; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+        *eq = '\0';
+        int rv = set_var(args[i], eq + 1);
+        *eq = '=';
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return 1;
+}
+
+/* Record the outcome of the last command, for "$?".  status is what
+ * the shell reports for a command: a wait status from a pipeline, or a
+ * builtin's return value (-errno on failure).
+ */
+void set_last_status(int status) {
+    if (status < 0) {
+        last_status = status == -ENOENT ? 127 : 1;
+    } else if (WIFSIGNALED(status)) {
+        last_status = 128 + WTERMSIG(status);
+    } else {
+        last_status = WEXITSTATUS(status);
+    }
+}
+
+// The exit code "$?" expands to
+int get_last_status(void) {
+    return last_status;
+}
+
+bool valid_name(const char *name, size_t len) {
+    if (len == 0 || !(isalpha(name[0]) || name[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum(name[i]) || name[i] == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_field_break(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+/* Make room for need more bytes after the first len of *buf (*size
+ * bytes), which is allocated or doubled as needed.
+ *
+ * Returns false if it could not grow.
+ */
+static bool reserve(char **buf, size_t *size, size_t len, size_t need) {
+    size_t size2 = *size ? *size : EXPAND_SIZE;
+    char *bigger;
+
+    if (len + need <= *size) {
+        return true;
+    }
+    while (size2 < len + need) {
+        size2 *= 2;
+    }
+    bigger = realloc(*buf, size2);
+    if (bigger == NULL) {
+        return false;
+    }
+    *buf = bigger;
+    *size = size2;
+    return true;
+}
+
+/* Expand the variables and command substitutions in word into *buf
+ * (*size bytes), after its first used bytes; *buf is allocated, or
+ * grown to fit, as needed (and is the caller's to free).  A word with
+ * no '$' in it is returned as is, without copying.  A '$' that was
+ * quoted (QUOTED_DOLLAR, see parse_line()) is just a '$'.
+ *
+ * What a substitution prints is split into fields at spaces, tabs and
+ * newlines, except in an assignment ("name=$(cmd)") or inside double
+ * quotes (QUOTED_SUBST), where it stays one word, even if empty.  The fields are left one after another in *buf, each
+ * NUL-terminated.
+ *
+ * Returns the number of fields, with *out set to the first (0 if the
+ * word expanded to nothing), -ENOMEM if *buf could not grow, or -errno
+ * if a substitution could not be run.
+ */
+int expand_word(char *word, char **buf, size_t *size, size_t used,
+                char **out) {
+    size_t len = used, field = used;  // Where the current field starts
+    int fields = 0;
+    bool keep = false;  // Keep the last field, even if empty
+    char *p = word;
+    char *eq = strchr(word, '=');
+    bool split = !(eq && valid_name(word, eq - word));
+
+    if (strchr(word, '$') == NULL && strchr(word, QUOTED_DOLLAR) == NULL &&
+        strchr(word, QUOTED_SUBST) == NULL) {
+        *out = word;
+        return 1;
+    }
+
+    while (*p) {
+        const char *value = NULL;
+        char name[64], status[12];
+        size_t n = 0;
+
+        if (*p != '$' && *p != QUOTED_SUBST) {
+            if (!reserve(buf, size, len, 2)) {
+                return -ENOMEM;
+            }
+            (*buf)[len++] = *p == QUOTED_DOLLAR ? '$' : *p;
+            p++;
+            continue;
+        }
+
+        if (p[1] == '(' && (n = subst_length(p, strlen(p))) > 0) {
+            bool quoted = *p == QUOTED_SUBST;
+            char *text;
+            size_t tlen;
+            int rv = capture_output(p + 2, n - 3, &text, &tlen);
+            if (rv < 0) {
+                return rv;
+            }
+            substitutions++;
+            // Sized for all of it up front, however long
+            if (!reserve(buf, size, len, tlen + 1)) {
+                free(text);
+                return -ENOMEM;
+            }
+            for (size_t i = 0; i < tlen; i++) {
+                if (!split || quoted || !is_field_break(text[i])) {
+                    (*buf)[len++] = text[i];
+                } else if (len > field) {
+                    (*buf)[len++] = '\0';
+                    fields++;
+                    field = len;
+                    keep = false;
+                }
+            }
+            free(text);
+            keep = keep || quoted;
+            p += n;
+            continue;
+        }
+
+        n = 0;
+        if (p[1] == '?') {
+            snprintf(status, sizeof(status), "%d", last_status);
+            value = status;
+            p += 2;
+        } else if (p[1] == '{') {
+            char *close = strchr(p + 2, '}');
+            n = close ? close - (p + 2) : 0;
+            if (close == NULL || !valid_name(p + 2, n) || n >= sizeof(name)) {
+                n = 0;  // Not a variable; keep the '$' as is
+            } else {
+                memcpy(name, p + 2, n);
+                p = close + 1;
+            }
+        } else {
+            while (isalnum(p[1 + n]) || p[1 + n] == '_') {
+                n++;
+            }
+            if (!valid_name(p + 1, n) || n >= sizeof(name)) {
+                n = 0;
+            } else {
+                memcpy(name, p + 1, n);
+                p += 1 + n;
+            }
+        }
+
+        if (n > 0) {
+            name[n] = '\0';
+            value = get_var(name);
+        } else if (value == NULL) {
+            value = "$";  // A lone '$'
+            p++;
+        }
+        if (value) {
+            size_t vlen = strlen(value);
+            if (!reserve(buf, size, len, vlen + 1)) {
+                return -ENOMEM;
+            }
+            memcpy(*buf + len, value, vlen);
+            len += vlen;
+        }
+    }
+
+    if (len > field || keep) {
+        (*buf)[len] = '\0';
+        fields++;
+    }
+    *out = fields ? *buf + used : NULL;
+    return fields;
+}
+
+/* Expand every word of a parsed pipeline into out, using *buf (*size
+ * bytes, allocated or grown as expand_word() does) for any words that
+ * change.  commands is left untouched, so it can be run again later.
+ *
+ * Returns the number of command substitutions run (whose status "$?"
+ * now holds) on success, -E2BIG if the expansions make too many
+ * arguments, or -errno if a substitution failed or *buf could not
+ * grow.
+ */
+int expand_commands(char *commands[MAX_PIPELINE][MAX_ARGS],
+                    char *out[MAX_PIPELINE][MAX_ARGS], char **buf,
+                    size_t *size) {
+    // Where each expanded word is in *buf, as it may yet move
+    size_t at[MAX_PIPELINE][MAX_ARGS];
+    unsigned long before = substitutions;
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < MAX_PIPELINE - 1 && commands[i][0] != NULL; i++) {
+        int k = 0;
+        for (int j = 0; j < MAX_ARGS - 1 && commands[i][j] != NULL; j++) {
+            char *word;
+            int n = expand_word(commands[i][j], buf, size, used, &word);
+            if (n < 0) {
+                return n;
+            }
+            for (int f = 0; f < n; f++) {
+                if (k == MAX_ARGS - 1) {
+                    return -E2BIG;
+                }
+                at[i][k] = SIZE_MAX;
+                out[i][k++] = word;
+                if (word != commands[i][j]) {
+                    at[i][k - 1] = word - *buf;
+                    word += strlen(word) + 1;
+                    used = word - *buf;
+                }
+            }
+        }
+        for (; k < MAX_ARGS; k++) {
+            out[i][k] = NULL;
+        }
+    }
+    for (int m = 0; m < i; m++) {
+        for (int k = 0; out[m][k] != NULL; k++) {
+            if (at[m][k] != SIZE_MAX) {
+                out[m][k] = *buf + at[m][k];
+            }
+        }
+    }
+    for (; i < MAX_PIPELINE; i++) {
+        for (int j = 0; j < MAX_ARGS; j++) {
+            out[i][j] = NULL;
+        }
+    }
+    return substitutions - before;
+}
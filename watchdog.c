@@ -0,0 +1,254 @@
+/* COMP 530: Tar Heel SHell
+ *
+ * This file implements deadlines for pipelines: "timeout secs cmd | ..."
+ * for one pipeline, or "timeout secs" for every later one.  A pipeline
+ * still running at its deadline is sent SIGTERM, then SIGKILL if it has
+ * not finished a grace period later, and its status is 124 (as with
+ * coreutils' timeout).
+ *
+ * The processes of a pipeline with a deadline are put in a process
+ * group of their own (which is given the terminal, if the shell has
+ * it), so a signal reaches whatever they started too.  The group is
+ * signalled through a pidfd for its leader, which the shell has not
+ * reaped yet, so the signal cannot reach an unrelated process that
+ * was given a recycled pid; if the leader is gone, each stage is
+ * signalled through its own pidfd instead.  (Stages are not run as
+ * builtin threads under a deadline, as a thread cannot be killed.)
+ *
+ * The deadline is a timerfd, armed when the pipeline starts.  While
+ * the shell waits for a stage, it polls that stage's pidfd and the
+ * timerfd, so it sleeps until one of them is ready: nothing runs
+ * between the two, and a pipeline without a deadline is waited on
+ * with a plain wait4(), as before.
+ */
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/pidfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "thsh.h"
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2)  // Linux 6.9
+#endif
+
+// Seconds between SIGTERM and SIGKILL, unless set with -k
+#define DEFAULT_GRACE 5.0
+
+struct watchdog {
+    int timer;     // timerfd: the deadline, then the end of the grace
+    double grace;  // Seconds from SIGTERM to SIGKILL
+    int signals;   // How many of SIGTERM and SIGKILL have been sent
+    pid_t pgid;    // The group, once its first process is started
+    int tty;       // Terminal handed to the group, or -1
+    int n;
+    pid_t pids[MAX_PIPELINE];
+    int pidfds[MAX_PIPELINE];  // -1 if it could not be opened
+};
+
+// Shell-wide deadline for pipelines, 0 for none
+static double default_timeout;
+static double default_grace = DEFAULT_GRACE;
+
+/* Set the deadline for every later pipeline to secs seconds (0 for
+ * none), and its grace period to grace seconds.
+ */
+void set_default_timeout(double secs, double grace) {
+    default_timeout = secs;
+    default_grace = grace;
+}
+
+/* Returns the shell-wide deadline (0 for none), and sets *grace to its
+ * grace period.
+ */
+double get_default_timeout(double *grace) {
+    *grace = default_grace;
+    return default_timeout;
+}
+
+static void arm(int timer, double secs) {
+    struct itimerspec when = {0};
+
+    when.it_value.tv_sec = secs;
+    when.it_value.tv_nsec = (secs - (time_t)secs) * 1e9;
+    if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0) {
+        when.it_value.tv_nsec = 1;  // 0 would disarm it
+    }
+    timerfd_settime(timer, 0, &when, NULL);
+}
+
+/* Start the clock on a pipeline that must finish within secs seconds,
+ * and be killed grace seconds after it is asked to stop.
+ *
+ * Returns 0 and sets *wp on success, -errno on failure.
+ */
+int watchdog_create(struct watchdog **wp, double secs, double grace) {
+    struct watchdog *w;
+    int probe;
+
+    // Without pidfds (before Linux 5.3), a deadline cannot be kept
+    probe = pidfd_open(getpid(), 0);
+    if (probe < 0) {
+        return -errno;
+    }
+    close(probe);
+
+    w = calloc(1, sizeof(struct watchdog));
+    if (w == NULL) {
+        return -ENOMEM;
+    }
+    w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (w->timer < 0) {
+        int rv = -errno;
+        free(w);
+        return rv;
+    }
+    w->grace = grace;
+    w->tty = -1;
+    if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+        w->tty = STDIN_FILENO;
+    }
+    arm(w->timer, secs);
+    *wp = w;
+    return 0;
+}
+
+/* Give the terminal (if any) to the process group pgid. */
+static void give_terminal(int tty, pid_t pgid) {
+    sigset_t block, old;
+
+    if (tty < 0) {
+        return;
+    }
+    // A process not in the foreground would be stopped for this
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    tcsetpgrp(tty, pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Join the pipeline's process group (starting it, if this is the first
+ * process).  Called in the child, before execve().
+ */
+void watchdog_child(const struct watchdog *w) {
+    setpgid(0, w->pgid);
+    give_terminal(w->tty, w->pgid ? w->pgid : getpid());
+}
+
+/* Watch pid, just forked (and not yet reaped), as part of the pipeline.
+ * Called in the parent; the group is joined here as well as in the
+ * child, so it is set whichever runs first.
+ *
+ * Returns 0 on success, -errno if it cannot be watched (it is then
+ * waited on without a deadline).
+ */
+int watchdog_add(struct watchdog *w, pid_t pid) {
+    if (w->n == MAX_PIPELINE) {
+        return -E2BIG;
+    }
+    if (w->pgid == 0) {
+        w->pgid = pid;
+    }
+    setpgid(pid, w->pgid);  // Fails harmlessly if the child has exec'd
+    give_terminal(w->tty, w->pgid);
+
+    w->pids[w->n] = pid;
+    w->pidfds[w->n] = pidfd_open(pid, 0);
+    return w->pidfds[w->n++] < 0 ? -errno : 0;
+}
+
+/* Send sig to the pipeline's process group or, failing that, to each
+ * of its stages.
+ */
+static void signal_pipeline(struct watchdog *w, int sig) {
+    if (w->n > 0 && w->pids[0] == w->pgid && w->pidfds[0] >= 0 &&
+        pidfd_send_signal(w->pidfds[0], sig, NULL,
+                          PIDFD_SIGNAL_PROCESS_GROUP) == 0) {
+        return;
+    }
+    for (int i = 0; i < w->n; i++) {
+        if (w->pidfds[i] >= 0) {
+            pidfd_send_signal(w->pidfds[i], sig, NULL, 0);
+        }
+    }
+}
+
+/* The timer went off: ask the pipeline to stop, or make it. */
+static void expire(struct watchdog *w) {
+    uint64_t ticks;
+
+    read(w->timer, &ticks, sizeof(ticks));
+    if (w->signals++ == 0) {
+        signal_pipeline(w, SIGTERM);
+        signal_pipeline(w, SIGCONT);  // In case it was stopped
+        arm(w->timer, w->grace);
+    } else {
+        signal_pipeline(w, SIGKILL);
+    }
+}
+
+/* Wait until pid, a process of the pipeline, has exited (without
+ * reaping it), enforcing the deadline meanwhile.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int watchdog_wait(struct watchdog *w, pid_t pid) {
+    struct pollfd fds[2];
+    int i;
+
+    for (i = 0; i < w->n && w->pids[i] != pid; i++) {
+    }
+    if (i == w->n || w->pidfds[i] < 0) {
+        return 0;  // Not watched; the caller just waits
+    }
+    fds[0] = (struct pollfd){.fd = w->pidfds[i], .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = w->timer, .events = POLLIN};
+
+    for (;;) {
+        // After SIGKILL, there is nothing left to do but wait
+        if (poll(fds, w->signals < 2 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (fds[0].revents) {
+            return 0;
+        }
+        if (w->signals < 2 && fds[1].revents) {
+            expire(w);
+        }
+    }
+}
+
+/* Did the pipeline run past its deadline? */
+bool watchdog_expired(const struct watchdog *w) {
+    return w->signals > 0;
+}
+
+/* Stop watching the pipeline, once it has been reaped, and take the
+ * terminal back.
+ */
+void watchdog_free(struct watchdog *w) {
+    if (w == NULL) {
+        return;
+    }
+    if (w->pgid) {
+        give_terminal(w->tty, getpgrp());
+    }
+    for (int i = 0; i < w->n; i++) {
+        if (w->pidfds[i] >= 0) {
+            close(w->pidfds[i]);
+        }
+    }
+    close(w->timer);
+    free(w);
+}